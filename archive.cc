@@ -0,0 +1,514 @@
+#include <map>
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "archive.h"
+
+using namespace std;
+
+static const char archive_magic[8] = { 'B', 'D', 'L', 'A', 'R', 'C', 'H', 'V' };
+static const uint32_t archive_version = 1;
+
+static int column_encoding(int type)
+	{
+	switch (type)
+		{
+		case BRO_TYPE_INT:
+		case BRO_TYPE_COUNT:
+		case BRO_TYPE_IPADDR:
+		case BRO_TYPE_PORT:
+			return ARCHIVE_RAW32;
+		case BRO_TYPE_BOOL:
+			return ARCHIVE_BOOL;
+		case BRO_TYPE_DOUBLE:
+		case BRO_TYPE_INTERVAL:
+			return ARCHIVE_DOUBLE;
+		case BRO_TYPE_TIME:
+			return ARCHIVE_DELTA;
+		case BRO_TYPE_STRING:
+			return ARCHIVE_DICTIONARY;
+		case ROW_TYPE_INT64:
+			return ARCHIVE_RAW64;
+		default:
+			return ARCHIVE_NONE;
+		}
+	}
+
+static inline void put_varint(Buffer &out, uint64_t value)
+	{
+	unsigned char *w = (unsigned char *) out.reserve(10);
+	size_t n = 0;
+	while( value >= 0x80 )
+		{
+		w[n++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+		}
+	w[n++] = value;
+	out.commit(n);
+	}
+
+static inline bool get_varint(const char *&p, const char *end, uint64_t &value)
+	{
+	value = 0;
+	for(int shift=0; p < end && shift < 64; shift += 7)
+		{
+		unsigned char byte = *p++;
+		value |= (uint64_t) (byte & 0x7F) << shift;
+		if( !(byte & 0x80) )
+			return true;
+		}
+	return false;
+	}
+
+// Whether a is below b, for values of a column of type.
+static bool range_below(int type, uint64_t a, uint64_t b)
+	{
+	if( type == BRO_TYPE_TIME || type == BRO_TYPE_DOUBLE || type == BRO_TYPE_INTERVAL )
+		{
+		double x, y;
+		memcpy(&x, &a, sizeof(x));
+		memcpy(&y, &b, sizeof(y));
+		return x < y;
+		}
+	if( type == BRO_TYPE_INT || type == ROW_TYPE_INT64 )
+		return (int64_t) a < (int64_t) b;
+	return a < b;
+	}
+
+// A column of a segment while it is being built.
+class ColumnBuilder {
+	public:
+		ColumnBuilder() : has_range(false), min(0), max(0), last_bits(0) { }
+
+		void range(int type, uint64_t value)
+			{
+			if( !has_range || range_below(type, value, min) )
+				min = value;
+			if( !has_range || range_below(type, max, value) )
+				max = value;
+			has_range = true;
+			}
+
+		Buffer data;
+		bool has_range;
+		uint64_t min, max;
+
+		// For times, the bits of the last one.
+		uint64_t last_bits;
+
+		// For strings, the index of each distinct value, and the values
+		// in the order they were first seen.
+		std::map<std::string, uint32_t> dictionary;
+		std::vector<const std::string*> entries;
+		Buffer indexes;
+};
+
+void encode_segment(const Schema &schema, const char *rows, int records, Buffer &out)
+	{
+	size_t columns = schema.types.size();
+	std::vector<ColumnBuilder> builders(columns);
+
+	const char *p = rows;
+	for(int r=0; r < records; r++)
+		{
+		p += sizeof(uint16);
+		for(size_t c=0; c < columns; c++)
+			{
+			ColumnBuilder &b = builders[c];
+			int type = *p++;
+			switch (type)
+				{
+				case BRO_TYPE_INT:
+					{
+					int value;
+					memcpy(&value, p, sizeof(value));
+					p += sizeof(value);
+					b.data.append(&value, sizeof(value));
+					b.range(type, (int64_t) value);
+					break;
+					}
+				case BRO_TYPE_BOOL:
+					{
+					int value;
+					memcpy(&value, p, sizeof(value));
+					p += sizeof(value);
+					b.data.push_back(value != 0);
+					b.range(type, value != 0);
+					break;
+					}
+				case BRO_TYPE_COUNT:
+				case BRO_TYPE_IPADDR:
+					{
+					uint32 value;
+					memcpy(&value, p, sizeof(value));
+					p += sizeof(value);
+					b.data.append(&value, sizeof(value));
+					b.range(type, type == BRO_TYPE_IPADDR ? ntohl(value) : value);
+					break;
+					}
+				case BRO_TYPE_PORT:
+					{
+					uint32 port;
+					int proto;
+					memcpy(&port, p, sizeof(port));
+					memcpy(&proto, p + sizeof(port), sizeof(proto));
+					p += sizeof(port) + sizeof(proto);
+					uint32 packed = (port & 0xFFFF) | ((uint32) proto << 16);
+					b.data.append(&packed, sizeof(packed));
+					b.range(type, port & 0xFFFF);
+					break;
+					}
+				case ROW_TYPE_INT64:
+					{
+					int64_t value;
+					memcpy(&value, p, sizeof(value));
+					p += sizeof(value);
+					b.data.append(&value, sizeof(value));
+					b.range(type, value);
+					break;
+					}
+				case BRO_TYPE_DOUBLE:
+				case BRO_TYPE_INTERVAL:
+				case BRO_TYPE_TIME:
+					{
+					uint64_t bits;
+					memcpy(&bits, p, sizeof(bits));
+					p += sizeof(bits);
+					if( type == BRO_TYPE_TIME )
+						{
+						int64_t delta = (int64_t) (bits - b.last_bits);
+						put_varint(b.data, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+						b.last_bits = bits;
+						}
+					else
+						b.data.append(&bits, sizeof(bits));
+					b.range(type, bits);
+					break;
+					}
+				case BRO_TYPE_STRING:
+					{
+					uint32 length;
+					memcpy(&length, p, sizeof(length));
+					p += sizeof(length);
+					std::pair<std::map<std::string, uint32_t>::iterator, bool> entry =
+						b.dictionary.insert(make_pair(std::string(p, length), (uint32_t) b.entries.size()));
+					if( entry.second )
+						b.entries.push_back(&entry.first->first);
+					put_varint(b.indexes, entry.first->second);
+					p += length + 1;
+					break;
+					}
+				default:
+					break;
+				}
+			}
+		}
+
+	// Dictionaries are finished now that every value has been seen.  The
+	// map is in order, so the range is its first and last value.
+	for(size_t c=0; c < columns; c++)
+		{
+		ColumnBuilder &b = builders[c];
+		if( column_encoding(schema.types[c]) != ARCHIVE_DICTIONARY )
+			continue;
+		uint32_t count = b.entries.size();
+		b.data.append(&count, sizeof(count));
+		for(size_t i=0; i < b.entries.size(); i++)
+			{
+			put_varint(b.data, b.entries[i]->size());
+			b.data.append(b.entries[i]->data(), b.entries[i]->size());
+			}
+		b.data.append(b.indexes.data(), b.indexes.size());
+		b.has_range = !b.dictionary.empty();
+		}
+
+	size_t directory = sizeof(ArchiveHeader) + schema.table.size();
+	for(size_t c=0; c < columns; c++)
+		{
+		directory += sizeof(ArchiveColumnEntry) + schema.names[c].size();
+		if( builders[c].has_range && schema.types[c] == BRO_TYPE_STRING )
+			directory += builders[c].dictionary.begin()->first.size() +
+			             builders[c].dictionary.rbegin()->first.size();
+		}
+	uint64_t offset = (directory + 7) & ~(size_t) 7;
+
+	ArchiveHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, archive_magic, sizeof(archive_magic));
+	header.version = archive_version;
+	header.columns = columns;
+	header.rows = records;
+	header.table_length = schema.table.size();
+	header.size = offset;
+	for(size_t c=0; c < columns; c++)
+		header.size += builders[c].data.size();
+
+	size_t start = out.size();
+	out.append(&header, sizeof(header));
+	out.append(schema.table.data(), schema.table.size());
+	for(size_t c=0; c < columns; c++)
+		{
+		ColumnBuilder &b = builders[c];
+		ArchiveColumnEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.type = schema.types[c];
+		entry.format = schema.formats[c];
+		entry.encoding = column_encoding(schema.types[c]);
+		entry.flags = b.has_range ? ARCHIVE_HAS_RANGE : 0;
+		entry.name_length = schema.names[c].size();
+		entry.offset = offset;
+		entry.length = b.data.size();
+		offset += b.data.size();
+
+		const std::string *min_string = NULL, *max_string = NULL;
+		if( b.has_range && entry.type == BRO_TYPE_STRING )
+			{
+			min_string = &b.dictionary.begin()->first;
+			max_string = &b.dictionary.rbegin()->first;
+			entry.min = min_string->size();
+			entry.max = max_string->size();
+			}
+		else
+			{
+			entry.min = b.min;
+			entry.max = b.max;
+			}
+
+		out.append(&entry, sizeof(entry));
+		out.append(schema.names[c].data(), schema.names[c].size());
+		if( min_string )
+			{
+			out.append(min_string->data(), min_string->size());
+			out.append(max_string->data(), max_string->size());
+			}
+		}
+	while( (out.size() - start) % 8 )
+		out.push_back('\0');
+	for(size_t c=0; c < columns; c++)
+		out.append(builders[c].data.data(), builders[c].data.size());
+	}
+
+bool ArchiveSegment::parse(const char *data, size_t length, std::string &error)
+	{
+	ArchiveHeader header;
+	if( length < sizeof(header) )
+		{
+		error = "too short for a segment";
+		return false;
+		}
+	memcpy(&header, data, sizeof(header));
+	if( memcmp(header.magic, archive_magic, sizeof(archive_magic)) != 0 )
+		{
+		error = "not an archive segment";
+		return false;
+		}
+	if( header.version != archive_version )
+		{
+		error = "unknown segment version";
+		return false;
+		}
+	if( header.size != length )
+		{
+		error = "segment is cut off";
+		return false;
+		}
+
+	const char *p = data + sizeof(header);
+	const char *end = data + length;
+	if( (size_t) (end - p) < header.table_length )
+		{
+		error = "directory is cut off";
+		return false;
+		}
+	table.assign(p, header.table_length);
+	p += header.table_length;
+	rows = header.rows;
+
+	columns.clear();
+	for(uint32_t c=0; c < header.columns; c++)
+		{
+		ArchiveColumnEntry entry;
+		if( (size_t) (end - p) < sizeof(entry) )
+			{
+			error = "directory is cut off";
+			return false;
+			}
+		memcpy(&entry, p, sizeof(entry));
+		p += sizeof(entry);
+
+		ArchiveColumn column;
+		column.type = entry.type;
+		column.format = entry.format;
+		column.encoding = entry.encoding;
+		column.has_range = entry.flags & ARCHIVE_HAS_RANGE;
+		column.min = entry.min;
+		column.max = entry.max;
+
+		uint64_t strings = entry.name_length;
+		if( column.has_range && column.type == BRO_TYPE_STRING )
+			strings += entry.min + entry.max;
+		if( (uint64_t) (end - p) < strings || entry.offset > length ||
+		    entry.length > length - entry.offset || entry.encoding > ARCHIVE_RAW64 )
+			{
+			error = "bad column entry";
+			return false;
+			}
+		column.name.assign(p, entry.name_length);
+		p += entry.name_length;
+		if( column.has_range && column.type == BRO_TYPE_STRING )
+			{
+			column.min_string.assign(p, entry.min);
+			p += entry.min;
+			column.max_string.assign(p, entry.max);
+			p += entry.max;
+			}
+		column.data = data + entry.offset;
+		column.length = entry.length;
+		columns.push_back(column);
+		}
+	return true;
+	}
+
+bool ArchiveColumn::overlaps(uint64_t lo, uint64_t hi) const
+	{
+	return has_range && !range_below(type, max, lo) && !range_below(type, hi, min);
+	}
+
+bool ArchiveColumn::overlaps(const std::string &lo, const std::string &hi) const
+	{
+	return has_range && max_string >= lo && min_string <= hi;
+	}
+
+// Where decoding a column has got to.
+class ColumnCursor {
+	public:
+		const char *p, *end;
+		uint64_t last_bits;
+		std::vector<std::pair<const char*, uint32_t> > entries;
+};
+
+bool ArchiveSegment::decode_rows(Buffer &out, std::string &error) const
+	{
+	std::vector<ColumnCursor> cursors(columns.size());
+	for(size_t c=0; c < columns.size(); c++)
+		{
+		ColumnCursor &cursor = cursors[c];
+		cursor.p = columns[c].data;
+		cursor.end = cursor.p + columns[c].length;
+		cursor.last_bits = 0;
+
+		size_t width = 0;
+		if( columns[c].encoding == ARCHIVE_RAW32 )
+			width = sizeof(uint32);
+		else if( columns[c].encoding == ARCHIVE_BOOL )
+			width = 1;
+		else if( columns[c].encoding == ARCHIVE_DOUBLE )
+			width = sizeof(double);
+		else if( columns[c].encoding == ARCHIVE_RAW64 )
+			width = sizeof(int64_t);
+		if( width && columns[c].length != width * rows )
+			{
+			error = "column " + columns[c].name + " has the wrong size";
+			return false;
+			}
+
+		if( columns[c].encoding == ARCHIVE_DICTIONARY )
+			{
+			uint32_t count;
+			if( cursor.end - cursor.p < (ptrdiff_t) sizeof(count) )
+				{
+				error = "dictionary of " + columns[c].name + " is cut off";
+				return false;
+				}
+			memcpy(&count, cursor.p, sizeof(count));
+			cursor.p += sizeof(count);
+			for(uint32_t i=0; i < count; i++)
+				{
+				uint64_t length;
+				if( !get_varint(cursor.p, cursor.end, length) ||
+				    (uint64_t) (cursor.end - cursor.p) < length )
+					{
+					error = "dictionary of " + columns[c].name + " is cut off";
+					return false;
+					}
+				cursor.entries.push_back(make_pair(cursor.p, (uint32_t) length));
+				cursor.p += length;
+				}
+			}
+		}
+
+	for(uint32_t r=0; r < rows; r++)
+		{
+		uint16 fields = columns.size();
+		out.append(&fields, sizeof(fields));
+		for(size_t c=0; c < columns.size(); c++)
+			{
+			const ArchiveColumn &column = columns[c];
+			ColumnCursor &cursor = cursors[c];
+			out.push_back((char) column.type);
+			switch (column.encoding)
+				{
+				case ARCHIVE_RAW32:
+					{
+					uint32 value;
+					memcpy(&value, cursor.p, sizeof(value));
+					cursor.p += sizeof(value);
+					if( column.type == BRO_TYPE_PORT )
+						{
+						uint32 port = value & 0xFFFF;
+						int proto = value >> 16;
+						out.append(&port, sizeof(port));
+						out.append(&proto, sizeof(proto));
+						}
+					else
+						out.append(&value, sizeof(value));
+					break;
+					}
+				case ARCHIVE_BOOL:
+					{
+					int value = *cursor.p++;
+					out.append(&value, sizeof(value));
+					break;
+					}
+				case ARCHIVE_DOUBLE:
+					out.append(cursor.p, sizeof(double));
+					cursor.p += sizeof(double);
+					break;
+				case ARCHIVE_RAW64:
+					out.append(cursor.p, sizeof(int64_t));
+					cursor.p += sizeof(int64_t);
+					break;
+				case ARCHIVE_DELTA:
+					{
+					uint64_t zigzag;
+					if( !get_varint(cursor.p, cursor.end, zigzag) )
+						{
+						error = "column " + column.name + " is cut off";
+						return false;
+						}
+					cursor.last_bits += (zigzag >> 1) ^ -(zigzag & 1);
+					out.append(&cursor.last_bits, sizeof(cursor.last_bits));
+					break;
+					}
+				case ARCHIVE_DICTIONARY:
+					{
+					uint64_t index;
+					if( !get_varint(cursor.p, cursor.end, index) || index >= cursor.entries.size() )
+						{
+						error = "column " + column.name + " is cut off";
+						return false;
+						}
+					uint32 length = cursor.entries[index].second;
+					out.append(&length, sizeof(length));
+					out.append(cursor.entries[index].first, length);
+					out.push_back('\0');
+					break;
+					}
+				default:
+					break;
+				}
+			}
+		}
+	return true;
+	}
@@ -0,0 +1,112 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "rows.h"
+
+// Rows that are kept for a long time can be written as columnar archive
+// segments instead of COPY files (-A).  Every column of a segment is
+// stored on its own in the encoding that suits its Bro type, and has the
+// range of its values in the segment's directory, so that a scan for a
+// time or address range can skip the segments that can't have any.
+//
+// A segment is an ArchiveHeader, the table name, an ArchiveColumnEntry
+// for every field of the table's records, each followed by the field's
+// name and (for strings) the smallest and largest value, and then the
+// data of each column at its offset.  Numbers are in the byte order of
+// the machine that wrote the segment, as in the spool.
+struct ArchiveHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t columns;
+	uint32_t rows;
+	uint32_t table_length;
+	// The size of the whole segment, so that a cut off one is noticed.
+	uint64_t size;
+};
+
+// How a column's values are stored.
+enum ArchiveEncoding {
+	// The type has no values; every row is NULL.
+	ARCHIVE_NONE = 0,
+	// A uint32 for each row: counts, ints, addresses in network byte
+	// order, and ports as the port number plus the protocol << 16.
+	ARCHIVE_RAW32,
+	// A byte for each row, for bools.
+	ARCHIVE_BOOL,
+	// A double for each row.
+	ARCHIVE_DOUBLE,
+	// For times: each row's double as the difference of its bits from
+	// the bits of the row before it (0 for the first), zigzag encoded as
+	// a varint.  Times of neighbouring rows are close, so this takes a
+	// few bytes where a double takes eight, and loses nothing.
+	ARCHIVE_DELTA,
+	// For strings: a uint32 count of distinct values, each as a varint
+	// length and the bytes, and then the index of each row's value as a
+	// varint.
+	ARCHIVE_DICTIONARY,
+	// An int64_t for each row, for the sums of rollups.
+	ARCHIVE_RAW64
+};
+
+enum { ARCHIVE_HAS_RANGE = 1 };
+
+struct ArchiveColumnEntry {
+	uint8_t type;
+	uint8_t format;
+	uint8_t encoding;
+	uint8_t flags;
+	uint32_t name_length;
+	uint64_t offset, length;
+	// The smallest and largest value, if flags has ARCHIVE_HAS_RANGE:
+	// the bits of a double for times and doubles, an int64 for ints and
+	// a uint64 for everything else, with addresses in host byte order
+	// and ports without their protocol.  For strings these are the
+	// lengths of the two values that follow the name.
+	uint64_t min, max;
+};
+
+// Build a segment out of records rows in the form RowBatch keeps them,
+// laid out as schema says.
+void encode_segment(const Schema &schema, const char *rows, int records, Buffer &out);
+
+class ArchiveColumn {
+	public:
+		std::string name;
+		int type, format, encoding;
+		const char *data;
+		size_t length;
+
+		bool has_range;
+		uint64_t min, max;
+		std::string min_string, max_string;
+
+		// Whether the column can have a value from lo to hi, given in the
+		// form of min and max (see ArchiveColumnEntry), or as strings for
+		// a string column.
+		bool overlaps(uint64_t lo, uint64_t hi) const;
+		bool overlaps(const std::string &lo, const std::string &hi) const;
+};
+
+// A segment that was read back.  The data it was parsed from has to stay
+// around for as long as the segment is used.
+class ArchiveSegment {
+	public:
+		// Returns false, and says why in error, if data isn't a whole,
+		// valid segment.
+		bool parse(const char *data, size_t length, std::string &error);
+
+		// Append every row to rows in the form RowBatch keeps them, so
+		// that encode_row_text() can write them.
+		bool decode_rows(Buffer &rows, std::string &error) const;
+
+		std::string table;
+		uint32_t rows;
+		std::vector<ArchiveColumn> columns;
+};
+
+#endif
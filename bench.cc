@@ -0,0 +1,574 @@
+// bro-dblogger-bench - Drives the decode, encode and COPY paths of
+// bro-dblogger with synthetic db_log records and reports how fast they are.
+//
+// Records are built with Broccoli from a few mixes of made up data, the
+// same way they would arrive from Bro, and then go through each stage in
+// turn.  Every stage is timed per batch and reports rows and bytes per
+// second, heap allocations per row and the batch latency percentiles.
+// The COPY stage only runs when a database is given; it creates a table
+// for each mix and writes everything through a WriterPool.
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include "bro-dblogger.h"
+#include "rows.h"
+#include "encode.h"
+#include "format.h"
+#include "writer.h"
+#include "metrics.h"
+
+using namespace std;
+
+string postgresql_host = "127.0.0.1", postgresql_port = "5432";
+string postgresql_user, postgresql_password, postgresql_db;
+bool use_binary_copy = false;
+string spool_directory;
+size_t spool_budget = 0;
+string metrics_socket, metrics_file;
+int metrics_interval = 10;
+size_t string_cache_bytes = 1024*1024;
+SharedSetting verbose_output;
+
+// Every allocation in the process is counted, whichever thread makes it.
+static Counter allocations;
+
+extern "C" {
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t n, size_t size);
+	void *__libc_realloc(void *p, size_t size);
+
+	void *malloc(size_t size)
+		{
+		allocations.add();
+		return __libc_malloc(size);
+		}
+
+	void *calloc(size_t n, size_t size)
+		{
+		allocations.add();
+		return __libc_calloc(n, size);
+		}
+
+	void *realloc(void *p, size_t size)
+		{
+		allocations.add();
+		return __libc_realloc(p, size);
+		}
+}
+
+// Distinct records made for each mix.  The rows cycle through them.
+static const int records_per_mix = 1024;
+
+class Mix {
+	public:
+		std::string name;
+		int weight;
+		std::vector<BroRecord*> records;
+		Schema *schema;
+
+		// The decoded rows, in batches, for the encode and COPY stages.
+		std::vector<RowBatch*> batches;
+		int rows;
+};
+
+static unsigned int seed = 1;
+
+static int random_below(int n)
+	{
+	return rand_r(&seed) % n;
+	}
+
+static void add_string(BroRecord *r, const char *name, const std::string &value)
+	{
+	BroString bs;
+	bro_string_init(&bs);
+	bro_string_set_data(&bs, (const uchar *) value.data(), value.size());
+	bro_record_add_val(r, name, BRO_TYPE_STRING, NULL, &bs);
+	bro_string_cleanup(&bs);
+	}
+
+static void add_time(BroRecord *r, const char *name)
+	{
+	double value = 1200000000.0 + random_below(100000000) + random_below(1000000) / 1000000.0;
+	bro_record_add_val(r, name, BRO_TYPE_TIME, NULL, &value);
+	}
+
+static void add_addr(BroRecord *r, const char *name)
+	{
+	uint32 value = htonl(0x0a000000 | random_below(0xffffff));
+	bro_record_add_val(r, name, BRO_TYPE_IPADDR, NULL, &value);
+	}
+
+static void add_port(BroRecord *r, const char *name)
+	{
+	BroPort value;
+	value.port_num = random_below(65536);
+	value.port_proto = IPPROTO_TCP;
+	bro_record_add_val(r, name, BRO_TYPE_PORT, NULL, &value);
+	}
+
+static void add_count(BroRecord *r, const char *name, int below)
+	{
+	uint32 value = random_below(below);
+	bro_record_add_val(r, name, BRO_TYPE_COUNT, NULL, &value);
+	}
+
+// Like examples/dblog-conns.bro.
+static BroRecord* conn_record(void)
+	{
+	BroRecord *r = bro_record_new();
+	add_time(r, "epoch");
+	add_addr(r, "orig_ip");
+	add_port(r, "orig_port");
+	add_addr(r, "resp_ip");
+	add_port(r, "resp_port");
+	return r;
+	}
+
+// Long URLs with the odd character that needs escaping.
+static BroRecord* http_record(void)
+	{
+	static const char *methods[] = { "GET", "POST", "HEAD" };
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789/-_.?=&%";
+	BroRecord *r = bro_record_new();
+	add_time(r, "epoch");
+	add_addr(r, "orig_ip");
+	add_string(r, "method", methods[random_below(3)]);
+
+	std::string host = "www.";
+	for(int i = 4 + random_below(20); i > 0; i--)
+		host.push_back(chars[random_below(26)]);
+	host.append(".com");
+	add_string(r, "host", host);
+
+	std::string uri = "/";
+	for(int i = 100 + random_below(1900); i > 0; i--)
+		{
+		int pick = random_below(200);
+		if( pick == 0 )
+			uri.push_back('\\');
+		else if( pick == 1 )
+			uri.push_back('\t');
+		else
+			uri.push_back(chars[random_below(sizeof(chars) - 1)]);
+		}
+	add_string(r, "uri", uri);
+
+	add_string(r, "user_agent", "Mozilla/5.0 (X11; U; Linux i686; en-US; rv:1.9.0.5) Gecko/2008121622 Firefox/3.0.5");
+	add_count(r, "status", 600);
+	return r;
+	}
+
+// Mostly multibyte UTF-8, with some bytes that aren't valid UTF-8 and
+// some control characters.
+static BroRecord* utf8_record(void)
+	{
+	static const char *pieces[] = {
+		"\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82",	// Cyrillic
+		"\xe4\xbd\xa0\xe5\xa5\xbd\xe4\xb8\x96\xe7\x95\x8c",	// CJK
+		"\xf0\x9f\x98\x80",	// emoji
+		"caf\xc3\xa9 ",
+		"\xff\xfe",	// invalid
+		"\xc3",	// truncated
+		"\x01\x1b",
+		"plain ascii "
+	};
+	BroRecord *r = bro_record_new();
+	add_time(r, "epoch");
+	add_addr(r, "orig_ip");
+
+	std::string text;
+	for(int i = 10 + random_below(100); i > 0; i--)
+		text.append(pieces[random_below(8)]);
+	add_string(r, "subject", text);
+	add_count(r, "size", 1000000);
+	return r;
+	}
+
+// The column types for a mix's table, in record order.
+static std::string column_type(int bro_type)
+	{
+	switch (bro_type)
+		{
+		case BRO_TYPE_IPADDR:
+			return "inet";
+		case BRO_TYPE_PORT:
+			return "integer";
+		case BRO_TYPE_COUNT:
+			return "bigint";
+		case BRO_TYPE_STRING:
+			return "text";
+		default:
+			return "double precision";
+		}
+	}
+
+static Oid column_oid(int bro_type)
+	{
+	switch (bro_type)
+		{
+		case BRO_TYPE_IPADDR:
+			return INETOID;
+		case BRO_TYPE_PORT:
+			return INT4OID;
+		case BRO_TYPE_COUNT:
+			return INT8OID;
+		case BRO_TYPE_STRING:
+			return TEXTOID;
+		default:
+			return FLOAT8OID;
+		}
+	}
+
+class Stage {
+	public:
+		Stage() : rows(0), bytes(0), usec(0), allocs(0) { }
+
+		void report(const std::string &stage, const std::string &table)
+			{
+			report(stage, table, latency);
+			}
+
+		void report(const std::string &stage, const std::string &table,
+		            const Histogram &latency)
+			{
+			double seconds = usec ? usec / 1000000.0 : 0.000001;
+			printf("%-8s %-12s %10llu %12.0f %10.2f %10.3f %8llu %8llu %8llu %8llu\n",
+			       stage.c_str(), table.c_str(), (unsigned long long) rows,
+			       rows / seconds, bytes / seconds / (1024*1024),
+			       rows ? (double) allocs / rows : 0.0,
+			       (unsigned long long) latency.percentile(50),
+			       (unsigned long long) latency.percentile(90),
+			       (unsigned long long) latency.percentile(99),
+			       (unsigned long long) latency.percentile(100));
+			}
+
+		uint64_t rows, bytes, usec, allocs;
+		Histogram latency;
+};
+
+// Time one batch of a stage.
+class StageTimer {
+	public:
+		StageTimer(Stage &s) : stage(s), start(monotonic_usec()), start_allocs(allocations.get()) { }
+		~StageTimer()
+			{
+			uint64_t elapsed = monotonic_usec() - start;
+			stage.usec += elapsed;
+			stage.allocs += allocations.get() - start_allocs;
+			stage.latency.record(elapsed);
+			}
+
+	private:
+		Stage &stage;
+		uint64_t start, start_allocs;
+};
+
+static void decode_stage(Mix &mix, int rows, int batch_rows)
+	{
+	Stage stage;
+	RowBatch scratch;
+	scratch.schema = mix.schema;
+
+	for(int done=0; done < rows; )
+		{
+		int n = min(batch_rows, rows - done);
+		scratch.data.clear();
+		scratch.records = 0;
+			{
+			StageTimer timer(stage);
+			for(int i=0; i < n; i++)
+				{
+				if( decode_record(mix.records[(done + i) % records_per_mix], &scratch) != RECORD_DECODED )
+					{
+					cerr << "Could not decode a " << mix.name << " record." << endl;
+					exit(-1);
+					}
+				}
+			}
+		stage.rows += n;
+		stage.bytes += scratch.data.size();
+		done += n;
+
+		RowBatch *batch = new RowBatch;
+		batch->schema = mix.schema;
+		batch->data = scratch.data;
+		batch->records = scratch.records;
+		mix.batches.push_back(batch);
+		}
+	stage.report("decode", mix.name);
+	}
+
+// With cached, strings go through an escaped string cache, as the writers
+// do unless -E is 0.
+static void encode_stage(Mix &mix, bool binary, bool cached)
+	{
+	Stage stage;
+	Buffer out;
+	EscapeCache cache;
+	cache.set_limit(cached ? string_cache_bytes : 0);
+	TableMetrics strings;
+	std::vector<Oid> columns;
+	for(size_t i=0; i < mix.schema->types.size(); i++)
+		columns.push_back(column_oid(mix.schema->types[i]));
+
+	for(size_t b=0; b < mix.batches.size(); b++)
+		{
+		RowBatch *batch = mix.batches[b];
+		out.clear();
+			{
+			StageTimer timer(stage);
+			const char *p = batch->data.data();
+			for(int i=0; i < batch->records; i++)
+				{
+				if( binary )
+					p = encode_row_binary(p, columns, mix.schema->formats, out, &cache);
+				else
+					p = encode_row_text(p, mix.schema->formats, out, &cache);
+				}
+			}
+		stage.rows += batch->records;
+		stage.bytes += out.size();
+		}
+	stage.report(std::string(binary ? "binary" : "text") + (cached ? "+c" : ""), mix.name);
+
+	cache.report(&strings);
+	uint64_t hits = strings.string_cache_hits.get();
+	uint64_t misses = strings.string_cache_misses.get();
+	if( cached && hits + misses )
+		printf("%-8s %-12s %10llu strings, %.1f%% from the cache\n", "cache", mix.name.c_str(),
+		       (unsigned long long) (hits + misses), 100.0 * hits / (hits + misses));
+	}
+
+static void create_table(PGconn *conn, const Mix &mix)
+	{
+	std::string query = "CREATE TABLE IF NOT EXISTS " + mix.schema->table + " (";
+	for(size_t i=0; i < mix.schema->names.size(); i++)
+		{
+		if( i > 0 )
+			query.append(", ");
+		query.append(mix.schema->names[i] + " " + column_type(mix.schema->types[i]));
+		}
+	query.append(")");
+
+	PGresult *result = PQexec(conn, query.c_str());
+	if( PQresultStatus(result) != PGRES_COMMAND_OK )
+		{
+		cerr << "Could not create " << mix.schema->table << ": " << PQerrorMessage(conn);
+		exit(-1);
+		}
+	PQclear(result);
+	}
+
+// Everything goes through the writers at once and the stage ends when
+// they have committed all of it.  The latency is the time from
+// PQputCopyEnd to the server's answer for each COPY, as the writers
+// measure it for the metrics.
+static void copy_stage(std::vector<Mix> &mixes, int threads, int connections)
+	{
+	std::string conninfo = "host=" + postgresql_host + " port=" + postgresql_port +
+	                       " dbname=" + postgresql_db + " user=" + postgresql_user;
+	if( !postgresql_password.empty() )
+		conninfo += " password=" + postgresql_password;
+	PGconn *conn = PQconnectdb(conninfo.c_str());
+	if( PQstatus(conn) != CONNECTION_OK )
+		{
+		cerr << "Could not connect to PostgreSQL: " << PQerrorMessage(conn);
+		exit(-1);
+		}
+	for(size_t m=0; m < mixes.size(); m++)
+		create_table(conn, mixes[m]);
+	PQfinish(conn);
+
+	// bro-dblogger's defaults.
+	WriterSettings settings;
+	settings.seconds_between_copyend = 30;
+	settings.max_copy_bytes = 16*1024*1024;
+	settings.min_copy_bytes = 64*1024;
+	settings.max_copy_records = 0;
+	settings.target_commit_latency = 0;
+	settings.max_table_connections = 2;
+
+	WriterPool *writers = new WriterPool(threads, connections, settings);
+	writers->start();
+
+	uint64_t start = monotonic_usec(), start_allocs = allocations.get();
+	uint64_t rows = 0;
+	for(size_t m=0; m < mixes.size(); m++)
+		{
+		for(size_t b=0; b < mixes[m].batches.size(); b++)
+			{
+			rows += mixes[m].batches[b]->records;
+			writers->submit(mixes[m].batches[b]);
+			}
+		mixes[m].batches.clear();
+		}
+	writers->shutdown();
+	uint64_t usec = monotonic_usec() - start;
+	uint64_t allocs = allocations.get() - start_allocs;
+	delete writers;
+
+	for(size_t m=0; m < mixes.size(); m++)
+		{
+		TableMetrics *metrics = table_metrics(mixes[m].schema->table);
+		Stage stage;
+		stage.rows = metrics->rows.get();
+		stage.bytes = metrics->bytes.get();
+		stage.usec = usec;
+		stage.allocs = rows ? allocs * stage.rows / rows : 0;
+		if( metrics->rejected_rows.get() || metrics->dropped_rows.get() )
+			cerr << "The server rejected rows of " << mixes[m].schema->table << endl;
+		stage.report("copy", mixes[m].name, metrics->commit_usec);
+		}
+	}
+
+void usage(void)
+	{
+	cout << "bro-dblogger-bench - Measures the decode, encode and COPY paths with synthetic db_log records." << endl <<
+		"USAGE: bro-dblogger-bench [-b] [-n rows] [-x mix] [-B rows] [-w threads] [-C conns] [-E bytes] [-H postgres_host=localhost] [-p postgres_port=5432] [-d database_name -u postgres_user [-P postgres_password]]" << endl <<
+		endl <<
+		"  -h       Display this help message." << endl <<
+		"  -n rows  Number of rows to generate (default 200000)." << endl <<
+		"  -x mix   Weights of each kind of row (default conn=60,http=30,utf8=10)." << endl <<
+		"           conn rows are like examples/dblog-conns.bro, http rows carry" << endl <<
+		"           long URLs and utf8 rows mostly multibyte and invalid UTF-8." << endl <<
+		"  -B rows  Rows per batch (default 256).  Latencies are per batch, in usecs." << endl <<
+		"  -b       Use binary COPY where the column types allow it." << endl <<
+		"  -w num   Number of database writer threads (default 4)." << endl <<
+		"  -C num   Number of connections to PostgreSQL (default 8)." << endl <<
+		"  -E bytes Memory for the escaped string cache of the +c stages (default 1MB)." << endl <<
+		"  -d name  Also COPY the rows into tables bench_<mix> in this database." << endl << endl;
+	exit(0);
+	}
+
+int main(int argc, char **argv)
+	{
+	int opt = 0;
+	int total_rows = 200000;
+	int batch_rows = 256;
+	int threads = 4, connections = 8;
+	std::string mix_spec = "conn=60,http=30,utf8=10";
+
+	while ( (opt = getopt(argc, argv, "bn:x:B:w:C:E:H:p:d:u:P:h?")) != -1)
+		{
+		switch (opt)
+			{
+			case 'b':
+				use_binary_copy = true;
+				break;
+			case 'n':
+				total_rows = atoi(optarg);
+				break;
+			case 'x':
+				mix_spec = optarg;
+				break;
+			case 'B':
+				batch_rows = atoi(optarg);
+				if( batch_rows < 1 )
+					usage();
+				break;
+			case 'w':
+				threads = atoi(optarg);
+				if( threads < 1 )
+					usage();
+				break;
+			case 'C':
+				connections = atoi(optarg);
+				if( connections < threads )
+					usage();
+				break;
+			case 'E':
+				string_cache_bytes = strtoul(optarg, NULL, 10);
+				break;
+			case 'H':
+				postgresql_host = optarg;
+				break;
+			case 'p':
+				postgresql_port = optarg;
+				break;
+			case 'd':
+				postgresql_db = optarg;
+				break;
+			case 'u':
+				postgresql_user = optarg;
+				break;
+			case 'P':
+				postgresql_password = optarg;
+				break;
+			default:
+				usage();
+			}
+		}
+
+	std::vector<Mix> mixes;
+	int total_weight = 0;
+	size_t at = 0;
+	while( at < mix_spec.size() )
+		{
+		size_t end = mix_spec.find(',', at);
+		if( end == std::string::npos )
+			end = mix_spec.size();
+		std::string item = mix_spec.substr(at, end - at);
+		at = end + 1;
+
+		Mix mix;
+		size_t equals = item.find('=');
+		mix.name = item.substr(0, equals);
+		mix.weight = equals == std::string::npos ? 1 : atoi(item.c_str() + equals + 1);
+		if( mix.weight <= 0 )
+			continue;
+
+		BroRecord* (*make)(void) = NULL;
+		if( mix.name == "conn" )
+			make = conn_record;
+		else if( mix.name == "http" )
+			make = http_record;
+		else if( mix.name == "utf8" )
+			make = utf8_record;
+		else
+			{
+			cerr << "Unknown mix '" << mix.name << "'." << endl;
+			usage();
+			}
+		for(int i=0; i < records_per_mix; i++)
+			mix.records.push_back(make());
+		mix.schema = new_schema("bench_" + mix.name, mix.records[0], 0);
+		total_weight += mix.weight;
+		mixes.push_back(mix);
+		}
+	if( mixes.empty() )
+		usage();
+
+	printf("%-8s %-12s %10s %12s %10s %10s %8s %8s %8s %8s\n", "stage", "mix", "rows",
+	       "rows/s", "MB/s", "allocs/row", "p50", "p90", "p99", "max");
+	for(size_t m=0; m < mixes.size(); m++)
+		{
+		mixes[m].rows = (long long) total_rows * mixes[m].weight / total_weight;
+		decode_stage(mixes[m], mixes[m].rows, batch_rows);
+		}
+	for(size_t m=0; m < mixes.size(); m++)
+		encode_stage(mixes[m], false, false);
+	for(size_t m=0; m < mixes.size(); m++)
+		encode_stage(mixes[m], false, true);
+	for(size_t m=0; m < mixes.size(); m++)
+		encode_stage(mixes[m], true, false);
+	for(size_t m=0; m < mixes.size(); m++)
+		encode_stage(mixes[m], true, true);
+
+	if( !postgresql_db.empty() )
+		{
+		if( postgresql_user.empty() )
+			usage();
+		copy_stage(mixes, threads, connections);
+		}
+	return 0;
+	}
@@ -1,29 +1,31 @@
-
 #include <string>
 #include <list>
 #include <map>
+#include <set>
+#include <algorithm>
 #include <iostream>
-#include <sstream>
-#include <iomanip>
-#include <stdexcept>
 #include <errno.h>
 #include <signal.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <time.h>
 
-#include "utf_validate.h"
-
-extern "C" {
-	#include "broccoli.h"
-	#include "libpq-fe.h"
-}
+#include "bro-dblogger.h"
+#include "rows.h"
+#include "scan.h"
+#include "writer.h"
+#include "filesink.h"
+#include "encode.h"
+#include "peers.h"
+#include "metrics.h"
+#include "capture.h"
+#include "partition.h"
+#include "rollup.h"
+#include "filter.h"
+#include "config.h"
 
 using namespace std;
 
@@ -36,221 +38,700 @@ using std::cerr;
 string default_postgresql_host = "127.0.0.1";
 string default_postgresql_port = "5432";
 int default_seconds_between_copyend = 30;
+size_t default_max_copy_bytes = 16*1024*1024;
+int default_writer_threads = 4;
+int default_pool_connections = 8;
+int default_max_table_connections = 2;
 
 string postgresql_host, postgresql_port;
 string postgresql_user, postgresql_password, postgresql_db;
 int seconds_between_copyend;
+int writer_threads;
+
+// The writers share pool_connections connections to PostgreSQL, and no
+// table ever uses more than max_table_connections (0 for no limit) of
+// them at once.
+int pool_connections;
+int max_table_connections;
+
+// Rows that can't go to the database are spooled to segment files in
+// spool_directory (if one is given), using up to spool_budget bytes of
+// disk (0 for no limit).
+string spool_directory;
+size_t spool_budget = 1024*1024*1024;
+
+// With -F, the rows of the tables given with -f (or of every table if
+// there are none) are written to COPY files in file_directory to be bulk
+// loaded later, instead of being COPYed into PostgreSQL.  A file is closed
+// once it holds file_rotate_bytes or is file_rotate_interval seconds old
+// (0 for no limit).  With -A the rows are written as columnar archive
+// segments rather than COPY files.
+string file_directory;
+std::set<std::string> file_tables;
+size_t file_rotate_bytes = 256*1024*1024;
+int file_rotate_interval = 300;
+bool file_archive = false;
+
+// Besides its age, a COPY is ended once it holds max_copy_bytes or
+// max_copy_records (0 for no limit).  With a target commit latency (in
+// milliseconds) the byte limit of each table is tuned between
+// min_copy_bytes and max_copy_bytes.
+size_t max_copy_bytes;
+size_t min_copy_bytes = 64*1024;
+int max_copy_records = 0;
+
+// How much memory each writer thread may keep for each table's escaped
+// string cache (-E, 0 for none).
+size_t string_cache_bytes = 1024*1024;
+long target_commit_latency = 0;
+bool use_binary_copy = false;
 
 int debugging = 0;
-// By default, don't show output
-int verbose_output = 0;
-BroConn *bc;
-
-// Only use this if connections to multiple Bro instances is implemented.
-//class BroConnection {
-//	public:
-//		BroConn *bc;
-//};
-//std::list<BroConnection> bro_conns;
-
-class PGConnection {
+// By default, don't show output.  Options set verbose_level, which is
+// handed to the other threads in verbose_output once they are all read.
+int verbose_level = 0;
+SharedSetting verbose_output;
+BroPeers *bro_peers;
+
+// Set from the SIGINT handler; the main loop shuts down when it sees it.
+volatile sig_atomic_t quit_requested = 0;
+
+// Set from the SIGUSR1 handler; the main loop prints the metrics.
+volatile sig_atomic_t metrics_requested = 0;
+
+// Set from the SIGHUP handler; the main loop reads the config file again.
+volatile sig_atomic_t reload_requested = 0;
+
+// Settings can also come from a config file given with -c, as lines of
+// "name = value" for these options.  Those marked reloadable are applied
+// again, in place, when the file is read again on SIGHUP.
+class ConfigOption {
 	public:
-		PGconn *conn;
-		
-		// The "Copy" query that this connection is associated with.
-		std::string query;
+		const char *name;
+		int opt;
+		bool reloadable;
+};
+static const ConfigOption config_options[] = {
+	{ "host", 'H', false },
+	{ "port", 'p', false },
+	{ "database", 'd', false },
+	{ "user", 'u', false },
+	{ "password", 'P', false },
+	{ "binary", 'b', false },
+	{ "threads", 'w', false },
+	{ "spool_dir", 'q', false },
+	{ "spool_bytes", 'Q', false },
+	{ "metrics_socket", 'M', false },
+	{ "metrics_file", 'j', false },
+	{ "metrics_interval", 'J', false },
+	{ "partition", 't', false },
+	{ "rollup", 'g', false },
+	{ "columns", 'T', false },
+	{ "file_dir", 'F', false },
+	{ "file_tables", 'f', false },
+	{ "file_rotate_bytes", 'R', false },
+	{ "file_rotate_interval", 'I', false },
+	{ "file_archive", 'A', false },
+	{ "string_cache_bytes", 'E', false },
+	{ "verbose", 'v', true },
+	{ "flush_interval", 's', true },
+	{ "flush_bytes", 'S', true },
+	{ "flush_rows", 'r', true },
+	{ "commit_latency", 'l', true },
+	{ "connections", 'C', true },
+	{ "table_connections", 'm', true },
+	{ "allow", 'a', true },
+	{ "deny", 'e', true },
+	{ "sample", 'k', true },
+	{ "backpressure_bytes", 'W', true }
+};
 
-		// The record keeping count of records in the current Copy query.
-		int records;
+string config_file;
 
-		// Unix timestamp of last CopyEnd.
-		time_t last_insert;
-		
-		// This is if the COPY query should be attempted again.
-		bool try_it;
+// Every setting in the config file as it was first read, so that a
+// reload can tell which of the ones it can't apply were changed.
+map<string, vector<string> > startup_config;
+
+// Reloadable options given on the command line after -c, which a reload
+// applies again after the file.  value is empty for options without one.
+class CommandLineOption {
+	public:
+		int opt;
+		bool has_value;
+		std::string value;
+};
+vector<CommandLineOption> config_overrides;
+
+// Metrics are served on a UNIX socket and written to a file every
+// metrics_interval seconds, if either is given.
+string metrics_socket, metrics_file;
+int metrics_interval = 10;
+
+// Events are recorded to a capture file if one is given with -o.  With -i
+// they are read back from one instead of coming from Bro, at replay_rate
+// times the speed they arrived (0 for as fast as possible).
+CaptureWriter *capture = NULL;
+string replay_file;
+double replay_rate = 0;
+
+// Rows are handed to the writers in batches of about this many bytes.
+const size_t max_batch_bytes = 64*1024;
+
+// Rows of a partitioned table are COPYed into the partition for the time
+// in their key field, given with -t as "table:field:interval".
+std::map<std::string, PartitionRule> partition_rules;
+
+// Tables whose rows are summed up over windows of time with -g, and only
+// written as sums.
+std::map<std::string, RollupRule> rollup_rules;
+
+// Tables given with -a are the only ones inserted, if there are any, and
+// tables given with -e never are.  -k keeps a sample of a table's rows.
+std::set<std::string> allowed_tables, denied_tables;
+std::map<std::string, SampleRule> sample_rules;
+
+// Fields of a table that are written in another form than their type's
+// default, given with -T as "table:field=format,...".
+std::map<std::string, std::map<std::string, int> > column_formats;
+
+// Bro is told that a table is falling behind once this many bytes of its
+// rows are waiting for a COPY (-W, 0 to never tell it).
+size_t backpressure_bytes = 64*1024*1024;
+
+// The levels of the db_log_backpressure event, as in policy/dblog.bro.
+enum {
+	BACKPRESSURE_OK = 0,
+	BACKPRESSURE_BEHIND = 1,
+	BACKPRESSURE_OVERLOADED = 2
+};
+
+// A level other than OK is sent again this often, for Bro peers that
+// connected since it changed.
+const int backpressure_repeat = 10;
+
+// Partitions are looked at this often to retire the ones that are done.
+const int partition_retire_check = 60;
+
+// A partition that rows of one layout of a table went to, and whether
+// rows came for it since partitions were last looked at.
+class IntakePartition {
+	public:
+		IntakePartition() : schema(NULL), pending(NULL), used(false) { }
+
+		Schema *schema;
+		RowBatch *pending;
+		bool used;
 };
-std::map<std::string, PGConnection> pg_conns;
 
-class BadConversion : public std::runtime_error {
-public:
-  BadConversion(const std::string& s)
-    : std::runtime_error(s)
-    { }
+// What the Broccoli thread knows about a table: the column layouts its
+// records have come in, and for each of them the rows that haven't been
+// handed to a writer yet.  current is the layout of the last record.
+class IntakeTable {
+	public:
+		IntakeTable() : current(0), rule(NULL), retired_until(0), reopened(0), rollup(NULL), ignored(false),
+		                sampled(false), metrics(NULL), sink(NULL), backpressure(BACKPRESSURE_OK),
+		                backpressure_sent(0) { }
+
+		std::vector<Schema*> schemas;
+		std::vector<RowBatch*> pending;
+		size_t current;
+
+		// For a partitioned table: its rule, the index of the key field
+		// in each layout (-1 if the layout has none) and the partitions
+		// that are in use, by layout and start.
+		const PartitionRule *rule;
+		std::vector<int> key_fields;
+		std::map<std::pair<size_t, time_t>, IntakePartition> partitions;
+
+		// The end of the latest partition that was retired, and how many
+		// were opened again since.
+		time_t retired_until;
+		int reopened;
+
+		// For a table with a rollup rule, its windows.  Its rows go in
+		// there instead of into pending.
+		Rollup *rollup;
+
+		// Whether the table's rows are thrown away unread, and which of
+		// them are kept if it is sampled.  The rule is a copy, as a
+		// reload replaces sample_rules.
+		bool ignored;
+		bool sampled;
+		SampleRule sample;
+
+		// The metrics of the table, which its partitions count into too.
+		TableMetrics *metrics;
+
+		// Where the table's rows go.
+		Sink *sink;
+
+		// The backpressure level last sent to Bro, and when.
+		int backpressure;
+		time_t backpressure_sent;
 };
+std::map<std::string, IntakeTable> intake_tables;
 
-template<typename T>
-inline std::string stringify(const T& x)
-{
-  std::ostringstream o;
-  if (!(o << fixed << x))
-    throw BadConversion(std::string("stringify(")
-                        + typeid(x).name() + ")");
-  return o.str();
-}
+WriterPool *writers;
+FileSink *file_sink = NULL;
 
 void usage(void)
 	{
 	cout << "bro_dblogger - Listens for the db_log event and pushes data into a database." << endl <<
-		"USAGE: bro_dblogger -hqD [-s seconds] [-H postgres_host=localhost] [-p postgres_port=5432] -d database_name -u postgres_user [-P postgres_password] bro_host bro_port" << endl << 
+		"USAGE: bro_dblogger -hqbD [-c config] [-s seconds] [-S bytes] [-r rows] [-l msecs] [-w threads] [-C conns] [-m conns] [-q spool_dir] [-Q bytes] [-M socket] [-j file] [-J secs] [-t table:field:interval] [-g table:field:interval:groups:aggregates] [-a tables] [-e tables] [-k table:field:N] [-T table:field=format,...] [-W bytes] [-E bytes] [-F dir [-A] [-f tables] [-R bytes] [-I secs]] [-o capture] [-i capture [-x rate]] [-H postgres_host=localhost] [-p postgres_port=5432] -d database_name -u postgres_user [-P postgres_password] [bro_host bro_port ...]" << endl << 
 		endl << 
 		"  -h       Display this help message." << endl <<
+		"  -c file  Read settings from this file, as name = value lines.  Options after" << endl <<
+		"           -c override it.  SIGHUP reads it again and applies the flush limits," << endl <<
+		"           table lists, sampling, connections, backpressure and verbosity." << endl <<
 		"  -v       Increase verbosity.  By default only show errors." << endl <<
 		"  -s secs  Number of seconds between database flushes (default 30)." << endl <<
+		"  -S bytes Flush a table once this much data is buffered (default 16MB, 0 for no limit)." << endl <<
+		"  -r rows  Flush a table once this many rows are buffered (default no limit)." << endl <<
+		"  -l msecs Tune each table's flush size toward this commit latency." << endl <<
+		"  -w num   Number of database writer threads (default 4)." << endl <<
+		"  -C num   Number of connections to PostgreSQL, shared by all tables (default 8)." << endl <<
+		"  -m num   Most connections a single table may use at once (default 2, 0 for no limit)," << endl <<
+		"           never more than its writer's share of -C." << endl <<
+		"  -q dir   Spool rows to this directory while PostgreSQL is down or falling behind." << endl <<
+		"  -Q bytes Disk space the spool may use (default 1GB, 0 for no limit)." << endl <<
+		"  -M path  Serve metrics as JSON on this UNIX socket." << endl <<
+		"  -j file  Write metrics as JSON to this file." << endl <<
+		"  -J secs  Seconds between writes of the metrics file (default 10)." << endl <<
+		"  -t rule  COPY rows of a table straight into time partitions, which are created as" << endl <<
+		"           needed.  The rule is table:field:interval, where interval is hourly," << endl <<
+		"           daily or a number of seconds (e.g. -t conns:epoch:daily)." << endl <<
+		"  -g rule  Only write sums of a table's rows over windows of time, a row for each" << endl <<
+		"           window and group, given as table:field:interval:group,...:aggregate,..." << endl <<
+		"           where aggregates are count, sum(f), min(f) or max(f), optionally as" << endl <<
+		"           name=sum(f) (e.g. -g notices:epoch:hourly:note,src:count,max(n))." << endl <<
+		"  -a list  Only insert rows for these tables (comma separated)." << endl <<
+		"  -e list  Never insert rows for these tables (comma separated)." << endl <<
+		"  -k rule  Keep one in N rows of a table, chosen by a hash of one field, given as" << endl <<
+		"           table:field:N (e.g. -k dns:orig_h:10)." << endl <<
+		"  -T map   Write fields of a table in the form their columns take, given as" << endl <<
+		"           table:field=format,... where format is timestamptz (a time), inet (an" << endl <<
+		"           address), port (a port and its protocol, as 80/tcp, into a text column)" << endl <<
+		"           or exact (a double with all its digits, not rounded to six decimals)." << endl <<
+		"  -W bytes Tell Bro with db_log_backpressure when this much of a table is waiting" << endl <<
+		"           for a COPY (default 64MB, 0 to never)." << endl <<
+		"  -E bytes Memory for each table's cache of escaped strings (default 1MB, 0 for" << endl <<
+		"           no cache)." << endl <<
+		"  -F dir   Write rows to COPY files in this directory for bulk loading, instead" << endl <<
+		"           of COPYing them into PostgreSQL.  Each closed file has its COPY" << endl <<
+		"           statement next to it in a .sql file." << endl <<
+		"  -A       Write columnar archive segments instead of COPY files (read them" << endl <<
+		"           back with bro-dblogger-unarchive)." << endl <<
+		"  -f list  Only write these tables to files (comma separated, default all)." << endl <<
+		"  -R bytes Close a COPY file once it holds this much, or write a segment once this" << endl <<
+		"           much is kept for it (default 256MB, 0 for no limit)." << endl <<
+		"  -I secs  Close a COPY file or write a segment once it is this old (default 300," << endl <<
+		"           0 for no limit)." << endl <<
+		"  -o file  Record the events from Bro to this capture file." << endl <<
+		"  -i file  Insert the events from this capture file instead of connecting to Bro." << endl <<
+		"  -x rate  Replay the capture at this multiple of its original speed (default 0, as fast as possible)." << endl <<
+		"  -b       Use binary COPY for tables whose column types allow it." << endl <<
 		"  -D       Enable debugging output from Broccoli (if Broccoli was compiled in debugging mode)." << endl << endl;
 	exit(0);
 	}
 
-BroConn* connect_to_bro(std::string host, std::string port)
+void dispatch_batch(Sink *sink, RowBatch *&batch)
 	{
-	BroConn *conn;
-	
-	if (! (conn = bro_conn_new_str( (host + ":" + port).c_str(), BRO_CFLAG_NONE)))
+	if( batch && batch->records > 0 )
 		{
-		cerr << endl << "Could not connect to Bro (" << host << ") at " <<
-		        host << ":" << port << endl;
-		exit(-1);
+		sink->submit(batch);
+		batch = NULL;
 		}
+	}
 
-	if (!bro_conn_connect(conn)) {
-		cerr << endl << "Could not connect to Bro at " << host << ":" << port << endl;
-		exit(-1);
-	} else {
-		if(verbose_output)
-			cerr << "Connected to Bro (" << host << ") at " <<
-			        host << ":" << port << endl;
+void dispatch_table(IntakeTable &t)
+	{
+	for(size_t i=0; i < t.pending.size(); i++)
+		dispatch_batch(t.sink, t.pending[i]);
+
+	map<pair<size_t, time_t>, IntakePartition>::iterator iter;
+	for( iter = t.partitions.begin(); iter != t.partitions.end(); iter++ )
+		dispatch_batch(t.sink, iter->second.pending);
+
+	if( t.rollup )
+		dispatch_batch(t.sink, t.rollup->pending);
 	}
-	
-	return conn;
+
+// The batch that rows with the table's current layout go into.
+RowBatch* intake_batch(IntakeTable &t)
+	{
+	RowBatch *&batch = t.pending[t.current];
+	if( !batch )
+		{
+		batch = t.sink->get_batch();
+		batch->schema = t.schemas[t.current];
+		}
+	return batch;
 	}
-	
-int connect_to_postgres(std::string table)
+
+// Make the layout of record r the table's current one.  Each layout keeps
+// its own batches, and the writers give it its own COPY stream, so rows
+// of different layouts never end up in the same COPY.
+void switch_layout(IntakeTable &t, const std::string &table, BroRecord *r)
 	{
-	if( pg_conns.count(table)>0 )
-		return 0;
-	
-	std::string connect_string =
-		"host="+postgresql_host+" port="+postgresql_port+
-		" user="+postgresql_user+" password="+postgresql_password+
-		" dbname="+postgresql_db;
-	if( !(pg_conns[table].conn = PQconnectStart(connect_string.c_str())) )
+	uint64_t fingerprint = record_fingerprint(r);
+	for(size_t i=0; i < t.schemas.size(); i++)
 		{
-		cerr << "Total screw up with the postgres connection" << endl;
-		exit(-1);
+		if( t.schemas[i]->fingerprint == fingerprint )
+			{
+			t.current = i;
+			return;
+			}
 		}
 
-	if(verbose_output)
-		cout << "Connecting to PostgreSQL";
-	while( PQconnectPoll(pg_conns[table].conn) != PGRES_POLLING_OK )
+	t.current = t.schemas.size();
+	Schema *schema = new_schema(table, r, t.current);
+	t.schemas.push_back(schema);
+	t.pending.push_back(NULL);
+	if( t.current > 0 )
+		cerr << "Records for table " << table << " changed their fields; starting "
+		     << schema->stream << endl;
+
+	map<string, map<string,int> >::iterator formats = column_formats.find(table);
+	if( formats != column_formats.end() )
 		{
-		if( PQstatus(pg_conns[table].conn) == CONNECTION_BAD )
+		for(size_t i=0; i < schema->names.size(); i++)
 			{
-			cout << PQerrorMessage(pg_conns[table].conn) <<endl;
-			exit(-1);
+			map<string,int>::iterator format = formats->second.find(schema->names[i]);
+			if( format != formats->second.end() )
+				schema->formats[i] = format->second;
 			}
-			
-		if(verbose_output)
+		}
+
+	if( t.rule )
+		{
+		int key = -1;
+		for(size_t i=0; i < schema->names.size(); i++)
 			{
-			cout << "."; 
-			cout.flush();
+			int type = schema->types[i];
+			if( schema->names[i] == t.rule->field &&
+			    (type == BRO_TYPE_TIME || type == BRO_TYPE_DOUBLE ||
+			     type == BRO_TYPE_COUNT || type == BRO_TYPE_INT) )
+				key = i;
 			}
-		sleep(1);
+		if( key < 0 )
+			cerr << "Records for table " << table << " have no time field named "
+			     << t.rule->field << "; they go into " << table << " itself." << endl;
+		t.key_fields.push_back(key);
 		}
-	if(verbose_output)
-		cout << "done" << endl;
-
-	//PQsetnonblocking(pg_conns[table].conn, 1);
-	//if( PQisnonblocking(pg_conns[table].conn) )
-	//	{
-	//	if(verbose_output)
-	//		cout << "PostgreSQL is in non-blocking mode" << endl;
-	//	}
-	return 0;
 	}
-	
-int flush_table(std::string table, bool use_timeout)
+
+// Move the row that was just decoded into the batch of the partition that
+// its key falls into, and return that batch.
+RowBatch* route_row(IntakeTable &t, BroRecord *r, RowBatch *batch, size_t row_start)
 	{
-	PGresult *result=NULL;
-	ExecStatusType result_status;
-	char *error_message = NULL;
-	time_t now_time = time((time_t *)NULL);
-	int flushed_records = 0;
-	
-	result = PQgetResult(pg_conns[table].conn);
-	result_status = PQresultStatus(result);
-	PQclear(result);
-	if( result_status != PGRES_COPY_IN )
-		return 0;
+	int field = t.key_fields[t.current];
+	if( field < 0 )
+		return batch;
 
-	if( use_timeout && 
-	    difftime(now_time, pg_conns[table].last_insert) < 
-	      seconds_between_copyend )
-		return 0;
+	int type = 0;
+	void *data = bro_record_get_nth_val(r, field, &type);
+	double value;
+	if( type == BRO_TYPE_TIME || type == BRO_TYPE_DOUBLE )
+		value = *(double *) data;
+	else if( type == BRO_TYPE_COUNT )
+		value = *(uint32 *) data;
+	else
+		value = *(int *) data;
 
-	if( pg_conns.count(table) > 0 )
+	time_t start = partition_start(value, *t.rule);
+	IntakePartition &p = t.partitions[make_pair(t.current, start)];
+	if( !p.schema )
 		{
-		if(PQputCopyEnd(pg_conns[table].conn, error_message) == 1)
-			{
-			if(verbose_output)
-				cout << "Inserting " << pg_conns[table].records << " records into " << table << "." << endl;
-			}
-		else
-			{
-			cerr << "ERROR: " << PQerrorMessage(pg_conns[table].conn) << error_message << endl;
-			return -1;
-			}
-		
-		result = PQgetResult(pg_conns[table].conn);
-		result_status = PQresultStatus(result);
-		PQclear(result);
-		if(result_status != PGRES_COMMAND_OK)
+		const Schema *layout = t.schemas[t.current];
+		Partition *partition = new Partition(layout->table, *t.rule, start);
+		p.schema = new Schema(*layout);
+		p.schema->table = partition->name;
+		p.schema->stream = partition->name + layout->stream.substr(layout->table.size());
+		p.schema->partition = partition;
+
+		// A writer may still be finishing the stream of a partition that
+		// was retired, so one that is opened again gets a new stream.
+		if( start < t.retired_until )
 			{
-			cerr << "Error when ending copy on \"" << table << "\" table :: " 
-				 << PQerrorMessage(pg_conns[table].conn);
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), " (reopened %d)", ++t.reopened);
+			p.schema->stream.append(suffix);
 			}
-			
-		while(PQconsumeInput(pg_conns[table].conn) && PQisBusy(pg_conns[table].conn))
+		}
+	p.used = true;
+	if( !p.pending )
+		{
+		p.pending = t.sink->get_batch();
+		p.pending->schema = p.schema;
+		}
+
+	p.pending->data.append(batch->data.data() + row_start, batch->data.size() - row_start);
+	p.pending->records++;
+	batch->data.truncate(row_start);
+	batch->records--;
+	return p.pending;
+	}
+
+// Hand every table's waiting rows over to the writers.  This is done after
+// each pass through bro_conn_process_input so that the queue locks are
+// taken once per batch rather than once per event.
+void dispatch_pending(void)
+	{
+	map<string,IntakeTable>::iterator iter;
+	for( iter = intake_tables.begin(); iter != intake_tables.end(); iter++ )
+		dispatch_table(iter->second);
+	}
+
+// Hand the streams of partitions that are done back to their writers:
+// those whose window ended an interval ago and that got no rows since they
+// were last looked at.  A row that comes for one later opens it again.
+void retire_partitions(void)
+	{
+	static time_t last_check = 0;
+	time_t now_time = time((time_t *)NULL);
+	if( now_time - last_check < partition_retire_check )
+		return;
+	last_check = now_time;
+
+	map<string,IntakeTable>::iterator iter;
+	for( iter = intake_tables.begin(); iter != intake_tables.end(); iter++ )
+		{
+		IntakeTable &t = iter->second;
+		map<pair<size_t, time_t>, IntakePartition>::iterator p = t.partitions.begin();
+		while( p != t.partitions.end() )
 			{
-			//cout << "pg is busy" << endl;
-			sleep(1);
+			IntakePartition &partition = p->second;
+			const Partition *window = partition.schema->partition;
+			if( partition.used || (partition.pending && partition.pending->records) ||
+			    now_time < window->end + t.rule->interval )
+				{
+				partition.used = false;
+				p++;
+				continue;
+				}
+
+			if( verbose_output )
+				cout << "Retiring partition " << window->name << endl;
+			if( partition.pending )
+				t.sink->release_batch(partition.pending);
+			t.retired_until = max(t.retired_until, window->end);
+			writers->retire(partition.schema);
+			t.partitions.erase(p++);
 			}
-		flushed_records = pg_conns[table].records;
-		pg_conns[table].records=0;
-		pg_conns[table].last_insert = now_time;
 		}
-	else
+	}
+
+// Write out the rollup windows that are done, or all of them.
+void close_rollups(bool all)
+	{
+	time_t now_time = time((time_t *)NULL);
+	map<string,IntakeTable>::iterator iter;
+	for( iter = intake_tables.begin(); iter != intake_tables.end(); iter++ )
 		{
-		cerr << "Attempted to flush table '" << table << "', but no active query for that table exists." << endl;
-		return 0;
+		if( iter->second.rollup )
+			iter->second.rollup->close_windows(now_time, all);
 		}
-	
-	return flushed_records;
 	}
-	
-int flush_tables(bool use_timeout)
+
+// Tell the Bro peers how far behind each table is, so that their scripts
+// can shed or aggregate rows before they pile up here and in Broccoli (see
+// policy/dblog.bro).  A table is BEHIND once backpressure_bytes of its rows
+// are waiting to be COPYed and OVERLOADED at four times that, and only
+// drops back a level when it is under half of the mark for its level.
+void check_backpressure(void)
 	{
-	int flushed=0;
+	static time_t last_check = 0;
+	time_t now_time = time((time_t *)NULL);
+	if( !backpressure_bytes || now_time == last_check )
+		return;
+	last_check = now_time;
 
-	// Iterator for finishing all existing queries by their timeout.
-	map<string,PGConnection>::iterator iter;
-	for( iter = pg_conns.begin(); iter != pg_conns.end(); iter++ )
+	const uint64_t marks[] = { 0, backpressure_bytes, 4 * (uint64_t) backpressure_bytes };
+
+	map<string,IntakeTable>::iterator iter;
+	for( iter = intake_tables.begin(); iter != intake_tables.end(); iter++ )
 		{
-		if(flush_table(iter->first, use_timeout))
-			flushed++;
+		IntakeTable &t = iter->second;
+		uint64_t waiting = t.metrics->queued_bytes.get() + t.metrics->pending_bytes.get();
+
+		int level = t.backpressure;
+		while( level < BACKPRESSURE_OVERLOADED && waiting >= marks[level + 1] )
+			level++;
+		while( level > BACKPRESSURE_OK && waiting < marks[level] / 2 )
+			level--;
+
+		if( level == t.backpressure &&
+		    (level == BACKPRESSURE_OK || now_time - t.backpressure_sent < backpressure_repeat) )
+			continue;
+
+		if( level != t.backpressure && verbose_output )
+			cout << "Table " << iter->first << " has " << waiting << " bytes waiting, "
+			     << "sending backpressure level " << level << " to Bro" << endl;
+		t.backpressure = level;
+		t.backpressure_sent = now_time;
+		t.metrics->backpressure.set(level);
+
+		BroEvent *ev = bro_event_new("db_log_backpressure");
+		if( !ev )
+			continue;
+		uint32 value = level;
+		BroString table;
+		bro_string_init(&table);
+		bro_string_set(&table, iter->first.c_str());
+		bro_event_add_val(ev, BRO_TYPE_COUNT, NULL, &value);
+		bro_event_add_val(ev, BRO_TYPE_STRING, NULL, &table);
+		bro_peers->send(ev);
+		bro_event_free(ev);
+		bro_string_cleanup(&table);
 		}
-	return flushed;
 	}
 
-void db_log_flush_all_event_handler(BroConn *bc, void *user_data, BroEvMeta *meta)
+void flush_all_tables(void)
 	{
-	int total_flushed = 0;
-	
 	if(verbose_output)
 		cout << "Flushing all active COPY queries to the database" << endl;
+
+	if( capture )
+		capture->flush_all();
+	dispatch_pending();
+	writers->flush_all();
+	if( file_sink )
+		file_sink->flush_all();
+	}
+
+void flush_table(const std::string &table)
+	{
+	if( capture )
+		capture->flush(table);
+	Sink *sink = writers;
+	if( intake_tables.count(table) > 0 )
+		{
+		dispatch_table(intake_tables[table]);
+		sink = intake_tables[table].sink;
+		}
+	else
+		cerr << "Attempted to flush table '" << table << "', but no rows for that table have come in." << endl;
+	sink->flush(table);
+	}
+
+// Whether the table's rows are ignored or sampled, from the table lists
+// and sampling rules in effect.
+void apply_filters(IntakeTable &t, const std::string &table)
+	{
+	bool ignored = denied_tables.count(table) ||
+	               (!allowed_tables.empty() && !allowed_tables.count(table));
+	if( ignored != t.ignored && verbose_output )
+		cout << (ignored ? "Ignoring" : "Inserting") << " the rows for table " << table << endl;
+	t.ignored = ignored;
+
+	map<string,SampleRule>::iterator sample = sample_rules.find(table);
+	t.sampled = sample != sample_rules.end();
+	if( t.sampled )
+		t.sample = sample->second;
+	}
+
+// Decode a db_log record into the pending rows of its table.
+void intake_record(const std::string &table, BroRecord *r)
+	{
+	map<string,IntakeTable>::iterator iter = intake_tables.find(table);
+	if( iter == intake_tables.end() )
+		{
+		iter = intake_tables.insert(make_pair(table, IntakeTable())).first;
+		IntakeTable &t = iter->second;
+		t.sink = writers;
+		if( file_sink && (file_tables.empty() || file_tables.count(table)) )
+			t.sink = file_sink;
+
+		// Partitions are made in the database, so tables that go to
+		// files leave routing their rows to whatever loads them.
+		map<string,PartitionRule>::iterator rule = partition_rules.find(table);
+		if( rule != partition_rules.end() && t.sink == writers )
+			t.rule = &rule->second;
+
+		// The sums of a rolled up table go into the table itself.
+		map<string,RollupRule>::iterator rollup = rollup_rules.find(table);
+		if( rollup != rollup_rules.end() )
+			{
+			map<string, map<string,int> >::iterator formats = column_formats.find(table);
+			t.rollup = new Rollup(table, rollup->second,
+			                      formats != column_formats.end() ? &formats->second : NULL, t.sink);
+			t.rule = NULL;
+			}
+		t.metrics = table_metrics(table);
+		apply_filters(t, table);
+		}
+	IntakeTable &t = iter->second;
+
+	// Rows that aren't wanted are dropped before the record is looked at.
+	if( t.ignored )
+		{
+		t.metrics->filtered_rows.add();
+		return;
+		}
+	if( t.sampled && !sample_keep(r, t.sample) )
+		{
+		t.metrics->sampled_out_rows.add();
+		return;
+		}
+
+	// Records are decoded with the plan of the layout the last one had.
+	// Only a record that doesn't fit it goes looking for another.
+	DecodeResult result = RECORD_DRIFTED;
+	RowBatch *batch = NULL;
+	size_t row_start = 0;
+	if( !t.schemas.empty() )
+		{
+		batch = intake_batch(t);
+		row_start = batch->data.size();
+		result = decode_record(r, batch);
+		}
+	if( result == RECORD_DRIFTED )
+		{
+		switch_layout(t, table, r);
+		batch = intake_batch(t);
+		row_start = batch->data.size();
+		result = decode_record(r, batch);
+		}
+	if( result != RECORD_DECODED )
+		return;
+
+	if( capture )
+		capture->row(batch, row_start);
+
+	if( t.rollup )
+		{
+		if( t.rollup->add(batch->schema, batch->data.data() + row_start) )
+			t.metrics->rolled_up_rows.add();
+		else
+			t.metrics->dropped_rows.add();
+		batch->data.truncate(row_start);
+		batch->records--;
+		return;
+		}
+
+	if( t.rule )
+		batch = route_row(t, r, batch, row_start);
+
+	if(verbose_output>2)
+		{
+		// Instead of just a dot, output the first character of the table for 
+		// visual accounting.
+		cout << table[0];
+		cout.flush();
+		}
+
+	if( batch->data.size() >= max_batch_bytes )
+		dispatch_table(t);
+	}
+
+void db_log_flush_all_event_handler(BroConn *bc, void *user_data, BroEvMeta *meta)
+	{
+	((PeerMetrics *) user_data)->events.add();
 	
 	if( meta->ev_numargs > 0 )
 		cerr << "db_log_flush_all takes no arguments, but " << meta->ev_numargs << " were given" << endl;
 	
-	total_flushed = flush_tables(false);
+	flush_all_tables();
 	
 	user_data=NULL;
 	meta=NULL;	
@@ -259,6 +740,8 @@ void db_log_flush_all_event_handler(BroConn *bc, void *user_data, BroEvMeta *met
 void db_log_flush_event_handler(BroConn *bc, void *user_data, BroEvMeta *meta)
 	{
 	std::string table;
+	
+	((PeerMetrics *) user_data)->events.add();
 
 	if( meta->ev_numargs != 1 )
 		{
@@ -267,27 +750,21 @@ void db_log_flush_event_handler(BroConn *bc, void *user_data, BroEvMeta *meta)
 		}
 		
 	table = (const char*) bro_string_get_data( (BroString*) meta->ev_args[0].arg_data );
-
-	flush_table(table, false);
+	flush_table(table);
 
 	user_data=NULL;
 	meta=NULL;	
 	}
 
+// Reused for every event so that looking up the table doesn't allocate.
+std::string db_log_table;
+
 //global db_log: event(db_table: string, data: any);
 void db_log_event_handler(BroConn *bc, void *user_data, BroEvMeta *meta)
 	{
-	int type=0;
-	time_t now_time = time((time_t *)NULL);
-	
-	struct in_addr ip={0};
-	std::string table("");
-	std::string field_names("");
-	std::string output_value("");
+	std::string &table = db_log_table;
 	
-	PGresult *result;
-	ExecStatusType result_status;
-	int query_exists = 0;
+	((PeerMetrics *) user_data)->events.add();
 	
 	if( meta->ev_numargs != 2 )
 		{
@@ -304,256 +781,494 @@ void db_log_event_handler(BroConn *bc, void *user_data, BroEvMeta *meta)
 		}
 	
 	table = (const char*) bro_string_get_data( (BroString*) meta->ev_args[0].arg_data);
-	query_exists = pg_conns.count(table);
+	intake_record(table, (BroRecord*) meta->ev_args[1].arg_data);
+	
+	user_data=NULL;
+	meta=NULL;	
+	}
 
-	// If try_it is false, skip all of this.  This query has had a fatal error.
-	if( query_exists && !pg_conns[table].try_it )
+// Feed the events of the capture file through the same code as the ones
+// from Bro, and hand the rows to the writers every so often.
+void replay_capture(void)
+	{
+	CaptureReader reader;
+	reader.open(replay_file);
+	PeerMetrics *metrics = peer_metrics("replay " + replay_file);
+
+	uint64_t start = monotonic_usec();
+	double first_time = -1;
+	int since_dispatch = 0;
+	CaptureReader::Event event;
+
+	while( !quit_requested && (event = reader.next()) != CaptureReader::END )
 		{
-		cerr << "ERROR: Some earlier fatal error with " << table << endl;
-		return;
+		metrics->events.add();
+
+		if( replay_rate > 0 )
+			{
+			if( first_time < 0 )
+				first_time = reader.time;
+			uint64_t due = start + (uint64_t) ((reader.time - first_time) / replay_rate * 1000000.0);
+			if( due > monotonic_usec() )
+				dispatch_pending();
+			while( !quit_requested && due > monotonic_usec() )
+				{
+				uint64_t wait = min(due - monotonic_usec(), (uint64_t) 1000000);
+				struct timespec ts = { 0, 0 };
+				ts.tv_sec = wait / 1000000;
+				ts.tv_nsec = (wait % 1000000) * 1000;
+				nanosleep(&ts, NULL);
+				}
+			}
+
+		if( event == CaptureReader::ROW )
+			intake_record(reader.table, reader.record);
+		else if( event == CaptureReader::FLUSH )
+			flush_table(reader.table);
+		else
+			flush_all_tables();
+
+		if( ++since_dispatch >= 1000 )
+			{
+			dispatch_pending();
+			retire_partitions();
+			since_dispatch = 0;
+			}
+
+		if( metrics_requested )
+			{
+			metrics_requested = 0;
+			cout << metrics_json() << endl;
+			}
 		}
+
+	if(verbose_output)
+		cout << "Finished replaying " << replay_file << endl;
+	}
 	
-	BroRecord* r = (BroRecord*) meta->ev_args[1].arg_data;
-	void* data;
-	const char* field_name;
+/* Signal handler for SIGINT. */
+void SIGINT_handler (int signum)
+	{
+	quit_requested = 1;
+	}
+
+/* Signal handler for SIGUSR1. */
+void SIGUSR1_handler (int signum)
+	{
+	metrics_requested = 1;
+	}
+
+/* Signal handler for SIGHUP. */
+void SIGHUP_handler (int signum)
+	{
+	reload_requested = 1;
+	}
+
+// Pass everything that is still buffered to the database and quit.
+void shutdown_dblogger(void)
+	{
+	// Shut down the connections to Bro
+	delete bro_peers;
+	delete capture;
+	capture = NULL;
 	
-	int rec_len = bro_record_get_length(r);
-	for(int i=0 ; i < rec_len ; i++)
+	// Flush all existing queries to the database and shut down the
+	// PostgreSQL connections.
+	close_rollups(true);
+	dispatch_pending();
+	writers->shutdown();
+	delete writers;
+	if( file_sink )
 		{
-		if(i>0)
+		file_sink->shutdown();
+		delete file_sink;
+		}
+	write_metrics_file();
+		
+	cout << "Finished flushing current queries and freeing memory.  Now quitting." << endl;
+	exit(0);
+	}
+
+bool load_config(bool reload);
+
+// The settings that a reload changes.  A reload starts over from the ones
+// in effect before the config file was first read, so that a line taken
+// out of the file no longer applies, and goes back to the ones in effect
+// if the file has anything wrong in it.
+class ReloadableSettings {
+	public:
+		void save()
 			{
-			output_value.append("\t");
-			if( !query_exists )
-				field_names.append(", ");
+			verbose = verbose_level;
+			flush_interval = seconds_between_copyend;
+			flush_bytes = max_copy_bytes;
+			flush_rows = max_copy_records;
+			commit_latency = target_commit_latency;
+			connections = pool_connections;
+			table_connections = max_table_connections;
+			allowed = allowed_tables;
+			denied = denied_tables;
+			samples = sample_rules;
+			backpressure = backpressure_bytes;
 			}
-		// type needs to be zero so that it can be assigned with
-		// whatever type the record value actually is.
-		type=0;
-		data = bro_record_get_nth_val(r, i, &type);
+
+		void restore() const
+			{
+			verbose_level = verbose;
+			seconds_between_copyend = flush_interval;
+			max_copy_bytes = flush_bytes;
+			max_copy_records = flush_rows;
+			target_commit_latency = commit_latency;
+			pool_connections = connections;
+			max_table_connections = table_connections;
+			allowed_tables = allowed;
+			denied_tables = denied;
+			sample_rules = samples;
+			backpressure_bytes = backpressure;
+			}
+
+	private:
+		int verbose, flush_interval, flush_rows, connections, table_connections;
+		size_t flush_bytes, backpressure;
+		long commit_latency;
+		std::set<std::string> allowed, denied;
+		std::map<std::string, SampleRule> samples;
+};
+ReloadableSettings before_config;
+
+// Whether the config file may change opt on a reload.
+bool reloadable(int opt)
+	{
+	for(size_t o=0; o < sizeof(config_options) / sizeof(config_options[0]); o++)
+		{
+		if( config_options[o].opt == opt )
+			return config_options[o].reloadable;
+		}
+	return false;
+	}
+
+// Apply one command line option, or the same setting from the config file.
+// value is NULL for options that don't take one.  Returns false if the
+// value isn't valid.
+bool set_option(int opt, const char *value)
+	{
+	switch (opt)
+		{
+		case 'b':
+			use_binary_copy = !value || (strcmp(value, "no") && strcmp(value, "0"));
+			break;
+			
+		case 'd':
+			postgresql_db = value;
+			break;
+			
+		case 'v': 
+			// A config file sets the level.
+			verbose_level = value ? atoi(value) : verbose_level + 1;
+			break;
+			
+		case 'D':
+			debugging++;
+			
+			if (debugging > 0)
+				bro_debug_messages = 1;
+			
+			if (debugging > 1)
+				bro_debug_calltrace = 1;
+			break;
+		
+		case 'H':
+			postgresql_host = value;
+			break;
+		
+		case 'p':
+			postgresql_port = value;
+			break;
+		
+		case 'u':
+			postgresql_user = value;
+			break;
+		
+		case 'P':
+			postgresql_password = value;
+			break;
+		
+		case 's':
+			seconds_between_copyend = atoi(value);
+			break;
+		
+		case 'S':
+			max_copy_bytes = strtoul(value, NULL, 10);
+			break;
+		
+		case 'r':
+			max_copy_records = atoi(value);
+			break;
+		
+		case 'l':
+			target_commit_latency = atol(value);
+			break;
+		
+		case 'w':
+			writer_threads = atoi(value);
+			if( writer_threads < 1 )
+				return false;
+			break;
 		
-		if( !query_exists )
+		case 'C':
+			pool_connections = atoi(value);
+			if( pool_connections < 1 )
+				return false;
+			break;
+		
+		case 'm':
+			max_table_connections = atoi(value);
+			if( max_table_connections < 0 )
+				return false;
+			break;
+		
+		case 'q':
+			spool_directory = value;
+			break;
+		
+		case 'Q':
+			spool_budget = strtoul(value, NULL, 10);
+			break;
+		
+		case 'M':
+			metrics_socket = value;
+			break;
+		
+		case 'j':
+			metrics_file = value;
+			break;
+		
+		case 'J':
+			metrics_interval = atoi(value);
+			if( metrics_interval < 1 )
+				return false;
+			break;
+		
+		case 'o':
+			capture = new CaptureWriter;
+			capture->open(value);
+			break;
+		
+		case 'i':
+			replay_file = value;
+			break;
+		
+		case 'x':
+			replay_rate = atof(value);
+			if( replay_rate < 0 )
+				return false;
+			break;
+		
+		case 't':
 			{
-			field_name = bro_record_get_nth_name(r, i);
-			field_names.append(field_name);
+			string table;
+			PartitionRule rule;
+			if( !parse_partition_rule(value, table, rule) )
+				{
+				cerr << "Could not read the partition rule '" << value << "'." << endl;
+				return false;
+				}
+			partition_rules[table] = rule;
+			break;
+			}
+		
+		case 'g':
+			{
+			string table;
+			RollupRule rule;
+			if( !parse_rollup_rule(value, table, rule) )
+				{
+				cerr << "Could not read the rollup rule '" << value << "'." << endl;
+				return false;
+				}
+			rollup_rules[table] = rule;
+			break;
 			}
 		
-		// These vars are all involved with string handling
-		char *str=NULL;
-		char *s=NULL;
-		char *sp=NULL; 
-		BroString *bs=NULL;
-		uint string_length=0;
-		char *hex_fmt = new char[2];
+		case 'a':
+			parse_table_list(value, allowed_tables);
+			break;
 		
-		int tmp_char=0;
-		std::string single_value("");
+		case 'e':
+			parse_table_list(value, denied_tables);
+			break;
 		
-		if(data==NULL)
+		case 'k':
 			{
-			cerr << "data couldn't be extracted from record!" << endl;
-			return;
+			string table;
+			SampleRule rule;
+			if( !parse_sample_rule(value, table, rule) )
+				{
+				cerr << "Could not read the sampling rule '" << value << "'." << endl;
+				return false;
+				}
+			sample_rules[table] = rule;
+			break;
 			}
-		switch (type)
+		
+		case 'W':
+			backpressure_bytes = strtoul(value, NULL, 10);
+			break;
+		
+		case 'E':
+			string_cache_bytes = strtoul(value, NULL, 10);
+			break;
+		
+		case 'F':
+			file_directory = value;
+			break;
+		
+		case 'A':
+			file_archive = !value || (strcmp(value, "no") && strcmp(value, "0"));
+			break;
+		
+		case 'f':
+			parse_table_list(value, file_tables);
+			break;
+		
+		case 'R':
+			file_rotate_bytes = strtoul(value, NULL, 10);
+			break;
+		
+		case 'I':
+			file_rotate_interval = atoi(value);
+			if( file_rotate_interval < 0 )
+				return false;
+			break;
+		
+		case 'T':
 			{
-			case BRO_TYPE_INT:
-				single_value = stringify(*((int *) data));
-				break;
-			case BRO_TYPE_PORT:
-				// TODO: handle the port's protocol somehow.
-				single_value = stringify( (*((bro_port *) data)).port_num );
-				break;
-			case BRO_TYPE_STRING:
-				// TODO: UTF8 input is handled appropriately
-				//       UTF16/32 will come through looking very weird.
-				bs = (BroString*) data;
-				str = (char *) bro_string_get_data(bs);
-				string_length = bro_string_get_length(bs);
-				
-				// Maxmimum character expansion is as \\xHH, so a factor of 5.
-				s = new char[string_length*5 + 1];	// +1 is for final '\0'
-				sp = s;
-				
-				for ( uint i=0; i < string_length; ++i )
-					{
-					tmp_char = str[i]&0xFF;
-					//printf("char (%d): %02x\n", i, tmp_char);
-					if ( tmp_char == '\0' )
-						{
-						*sp++ = '\\'; *sp++ = '\\'; *sp++ = '0';
-						}
-						
-					// TODO: maybe deal with UTF16?
-					//else if ( tmp_char > 244 )
-					//	{
-					//	if (string_length-1 > i)
-					//		{
-					//		   I doubt if many of the string we'd be encountering
-					//		   would actually include the BOM though so
-					//		   this technique probably wouldn't help much.
-					//		if ( tmp_char == 254 && str[i+1]&0xFF == 255 )
-					//			cout << "UTF16-BOM Big Endian" << endl;
-					//		else if ( tmp_char == 255 && str[i+1]&0xFF == 254 )
-					//			cout << "UTF16-BOM Little Endian" << endl;
-					//		}
-					//	}
-						
-					else if ( 193 < tmp_char && tmp_char < 245 )
-						{
-						int byte_count=0;
-						if(193 < tmp_char && tmp_char < 224)
-							byte_count=2;
-						else if(223 < tmp_char && tmp_char < 240)
-							byte_count=3;
-						else if(239 < tmp_char && tmp_char < 245)
-							byte_count=4;
-						
-						//cout << byte_count << " byte sequence " << i << endl;
-						
-						// Don't overrun the buffer in case of invalid UTF8.
-						if((int) (string_length-1-i) > byte_count)
-							byte_count = string_length-i-3;
-						
-						if(utf_is_valid(str+i, byte_count))
-							{
-							// if utf8 is valid, include it verbatim
-							*sp++ = tmp_char;
-							for(int y=0; y<byte_count-1; ++y)
-								*sp++ = str[++i];
-							}
-						}
-                
-					else if ( tmp_char == '\x7f' )
-						{
-						*sp++ = '^'; *sp++ = '?';
-						}
-                    
-					else if ( tmp_char <= 26 )
-						{
-						*sp++ = '^'; *sp++ = tmp_char + 'A' - 1;
-						}
-					
-					else if ( tmp_char == '\\' )
-						{
-						*sp++ = '\\'; *sp++ = '\\';
-						}
-					
-					else if ( tmp_char > 126 )
-						{
-						// extended ascii and anything else not yet handled
-						// should be displayed as hex.
-						*sp++ = '\\'; *sp++ = '\\'; *sp++ = 'x';
-						sprintf(hex_fmt, "%02x", tmp_char);
-						*sp++ = hex_fmt[0]; *sp++ = hex_fmt[1];
-						}
-					else
-						{
-						*sp++ = tmp_char;
-						}
-					}
-				*sp++ = '\0';	// NUL-terminate.
-                
-				if ( verbose_output > 1 )
-					cout << "After munging: " << s << endl;
-					
-				single_value = s;
-				delete [] s;
-				break;
-			case BRO_TYPE_COUNT:
-				single_value = stringify(*((uint32 *) data));
-				break;
-			case BRO_TYPE_TIME:
-			case BRO_TYPE_DOUBLE:
-			case BRO_TYPE_INTERVAL:
-				single_value = stringify(*((double *) data));
-				break;
-			case BRO_TYPE_BOOL:
-				single_value = *((int *) data) ? "true" : "false";
-				break;
-			case BRO_TYPE_IPADDR:
-				ip.s_addr = *((uint32 *) data);
-				single_value = inet_ntoa(ip);
-				break;
-			default:
-				cerr << "unhandled data type" << endl;
-				break;
+			string table;
+			map<string,int> formats;
+			if( !parse_column_formats(value, table, formats) )
+				{
+				cerr << "Could not read the column mapping '" << value << "'." << endl;
+				return false;
+				}
+			column_formats[table].insert(formats.begin(), formats.end());
+			break;
 			}
-			delete [] hex_fmt;
-			
-			if( single_value == "" )
-					single_value = "\\N";
-			output_value.append(single_value);
-		}
+		 
+		case 'c':
+			if( config_file.empty() )
+				before_config.save();
+			config_file = value;
+			if( !load_config(false) )
+				exit(-1);
+			break;
 		
-	// Connect to the database for the current table if not already done.
-	if( !query_exists )
+		case '?':
+		default:
+			return false;
+		}
+	return true;
+	}
+
+// Read the config file and apply its settings.  A reload applies the
+// file to the settings that were in effect before it was first read and
+// then the command line options that came after -c, and leaves the
+// settings that can't be changed without a restart alone.  Returns false,
+// with the settings as they were, if the file couldn't be read or any
+// setting in it is wrong.
+bool load_config(bool reload)
+	{
+	vector<ConfigEntry> entries;
+	if( !read_config(config_file, entries) )
+		return false;
+
+	map<string, vector<string> > values;
+	for(size_t i=0; i < entries.size(); i++)
+		values[entries[i].name].push_back(entries[i].value);
+
+	ReloadableSettings in_effect;
+	if( reload )
 		{
-		connect_to_postgres(table);
-		pg_conns[table].records = 0;
-		pg_conns[table].last_insert = now_time;
-		pg_conns[table].try_it = true;
-		pg_conns[table].query = "COPY " + table + " (" + field_names + ") FROM STDIN";
+		in_effect.save();
+		before_config.restore();
 		}
-	
-	result = PQgetResult(pg_conns[table].conn);
-	result_status = PQresultStatus(result);
-	PQclear(result);
-	if(result_status != PGRES_COPY_IN)
-		{
-		if(verbose_output)
-			cout << "Executing: " << pg_conns[table].query << endl;
-		
-		pg_conns[table].last_insert = now_time;
-		result = PQexec(pg_conns[table].conn, pg_conns[table].query.c_str());
-		result_status = PQresultStatus(result);
-		PQclear(result);
-		if(result_status == PGRES_FATAL_ERROR)
+
+	bool ok = true;
+	set<string> restart_needed;
+	for(size_t i=0; i < entries.size(); i++)
+		{
+		const ConfigEntry &e = entries[i];
+		const ConfigOption *option = NULL;
+		for(size_t o=0; o < sizeof(config_options) / sizeof(config_options[0]); o++)
 			{
-			cerr << "On table (" << table << ") -- " << PQerrorMessage(pg_conns[table].conn) << endl;
-			cerr << "    Removing the '" << table << "' table due to failure." << endl;
-			pg_conns[table].try_it=false;
-			return;
+			if( e.name == config_options[o].name )
+				option = &config_options[o];
+			}
+
+		if( !option )
+			{
+			cerr << config_file << ":" << e.line << ": unknown setting " << e.name << endl;
+			ok = false;
+			}
+		else if( reload && !option->reloadable )
+			{
+			if( values[e.name] != startup_config[e.name] && restart_needed.insert(e.name).second )
+				cerr << config_file << ":" << e.line << ": " << e.name
+				     << " only changes when bro-dblogger is restarted." << endl;
+			}
+		else if( !set_option(option->opt, e.value.c_str()) )
+			{
+			cerr << config_file << ":" << e.line << ": bad value for " << e.name << endl;
+			ok = false;
 			}
 		}
 
-	if(verbose_output>2)
+	if( reload )
 		{
-		// Instead of just a dot, output the first character of the table for 
-		// visual accounting.
-		cout << table[0];
-		cout.flush();
+		for(size_t i=0; i < config_overrides.size(); i++)
+			{
+			const CommandLineOption &o = config_overrides[i];
+			set_option(o.opt, o.has_value ? o.value.c_str() : NULL);
+			}
+		if( !ok )
+			in_effect.restore();
 		}
-		
-	output_value.append("\n");
-	if(PQputCopyData(pg_conns[table].conn, output_value.c_str(), output_value.length()) != 1)
-		cerr << "Put copy data failed! -- " << PQerrorMessage(pg_conns[table].conn) << endl;
 	else
-		pg_conns[table].records++;
-		
-	flush_table(table, true);
-	
-	user_data=NULL;
-	meta=NULL;	
+		startup_config = values;
+	return ok;
 	}
-	
-/* Signal handler for SIGINT. */
-void SIGINT_handler (int signum)
+
+// The settings the writers work with, as they are now.
+WriterSettings writer_settings(void)
 	{
-	// Shut down the connection to Bro
-	if( !bro_conn_delete(bc) )
-		cerr << "There was a problem shutting down the Bro connection." << endl;
-	
-	// Flush all existing queries to the database.
-	flush_tables(false);
-	
-	// Shut down and delete all PostgreSQL connections
-	map<string,PGConnection>::iterator iter;
-	for( iter = pg_conns.begin(); iter != pg_conns.end(); iter++ )
+	WriterSettings settings;
+	settings.seconds_between_copyend = seconds_between_copyend;
+	settings.max_copy_bytes = max_copy_bytes;
+	settings.min_copy_bytes = min_copy_bytes;
+	settings.max_copy_records = max_copy_records;
+	settings.target_commit_latency = target_commit_latency;
+	settings.max_table_connections = max_table_connections;
+	return settings;
+	}
+
+// Apply the config file again, keeping the Bro connections, the rows that
+// are buffered and the COPYs that are running.  Each writer takes up the
+// new flush settings between two of its jobs.
+void reload_config(void)
+	{
+	cout << "Reloading " << config_file << endl;
+	if( !load_config(true) )
 		{
-			PQfinish(pg_conns[iter->first].conn);
+		cerr << "Keeping the settings in effect." << endl;
+		return;
 		}
-		
-	cout << "Finished flushing current queries and freeing memory.  Now quitting." << endl;
-	exit(0);
+
+	verbose_output = verbose_level;
+
+	map<string,IntakeTable>::iterator iter;
+	for( iter = intake_tables.begin(); iter != intake_tables.end(); iter++ )
+		apply_filters(iter->second, iter->first);
+
+	writers->reconfigure(pool_connections, writer_settings());
 	}
 
 int main(int argc, char **argv)
@@ -561,131 +1276,111 @@ int main(int argc, char **argv)
 	bro_debug_messages  = 0;
 	bro_debug_calltrace = 0;
 	
-	int fd;
-	fd_set readfds;
-	
 	int opt = 0;
 	extern char *optarg;
 	extern int optind;
-	
-	int readsocks;
-	struct timeval timeout;  /* Timeout for select */
+	const char *options = "bc:d:hH:p:u:P:vDs:S:r:l:w:C:m:q:Q:M:j:J:o:i:x:t:g:a:e:k:T:W:E:F:Af:R:I:?";
 
 	postgresql_host = default_postgresql_host;
 	postgresql_port = default_postgresql_port;
 	seconds_between_copyend = default_seconds_between_copyend;
+	max_copy_bytes = default_max_copy_bytes;
+	writer_threads = default_writer_threads;
+	pool_connections = default_pool_connections;
+	max_table_connections = default_max_table_connections;
 
 	signal (SIGINT, SIGINT_handler);
+	signal (SIGUSR1, SIGUSR1_handler);
+	signal (SIGHUP, SIGHUP_handler);
 
-	while ( (opt = getopt(argc, argv, "d:hH:p:u:P:vDs:?")) != -1)
+	while ( (opt = getopt(argc, argv, options)) != -1)
 		{
-		switch (opt)
+		// optarg is left as it was for options without an argument.
+		const char *spec = strchr(options, opt);
+		const char *value = spec && spec[1] == ':' ? optarg : NULL;
+		bool after_config = !config_file.empty();
+		if( !set_option(opt, value) )
+			usage();
+
+		if( after_config && reloadable(opt) )
 			{
-			case 'd':
-				postgresql_db = optarg;
-				break;
-				
-			case 'v': 
-				verbose_output++;
-				break;
-				
-			case 'D':
-				debugging++;
-				
-				if (debugging > 0)
-					bro_debug_messages = 1;
-				
-				if (debugging > 1)
-					bro_debug_calltrace = 1;
-				break;
-			
-			case 'H':
-				postgresql_host = optarg;
-				break;
-			
-			case 'p':
-				postgresql_port = optarg;
-				break;
-			
-			case 'u':
-				postgresql_user = optarg;
-				break;
-			
-			case 'P':
-				postgresql_password = optarg;
-				break;
-			
-			case 's':
-				seconds_between_copyend = atoi(optarg);
-				break;
-			 
-			case '?':
-			default:
-				usage();
-				break;
+			CommandLineOption o;
+			o.opt = opt;
+			o.has_value = value != NULL;
+			o.value = value ? value : "";
+			config_overrides.push_back(o);
 			}
 		}
+	verbose_output = verbose_level;
 		
 	argc -= optind;
 	argv += optind;
 	
-	if( postgresql_db.compare("") == 0 || argc < 2 )
+	// Replaying a capture doesn't need Bro, and writing every table to
+	// files doesn't need PostgreSQL.
+	bool files_only = !file_directory.empty() && file_tables.empty();
+	if( (postgresql_db.compare("") == 0 && !files_only) || argc % 2 ||
+	    (argc < 2 && replay_file.empty()) )
 		usage();
 	
+	if(verbose_output)
+		cout << "Using " << scan_implementation() << " string scanning." << endl;
+	
+	// Every writer needs at least one connection of its own.
+	if( writer_threads > pool_connections )
+		writer_threads = pool_connections;
+	
+	writers = new WriterPool(writer_threads, pool_connections, writer_settings());
+	writers->start();
+	if( !file_directory.empty() )
+		{
+		file_sink = new FileSink(writer_threads);
+		file_sink->start();
+		}
+	start_metrics();
+	
+	if( !replay_file.empty() )
+		{
+		replay_capture();
+		shutdown_dblogger();
+		}
+	
+	bro_peers = new BroPeers;
 	for(int i=0; i<argc; i+=2)
 		{
-		string host(argv[i]);
-		string port(argv[i+1]);
+		BroPeer *peer = bro_peers->add(argv[i], argv[i+1]);
+		bro_event_registry_add_compact(peer->bc, "db_log", db_log_event_handler, peer->metrics);
+		bro_event_registry_add_compact(peer->bc, "db_log_flush_all", db_log_flush_all_event_handler, peer->metrics);
+		bro_event_registry_add_compact(peer->bc, "db_log_flush", db_log_flush_event_handler, peer->metrics);
+		}
+	
+	// Flushing tables on their timeout is left to the writer threads, so
+	// this only has to wake up to look after lost Bro peers.
+	while( !quit_requested )
+		{
+		bro_peers->process(1000);
+		close_rollups(false);
+		dispatch_pending();
+		retire_partitions();
+		check_backpressure();
 		
-		bc = connect_to_bro(host, port);
-		bro_event_registry_add_compact(bc, "db_log", db_log_event_handler, NULL);
-		bro_event_registry_add_compact(bc, "db_log_flush_all", db_log_flush_all_event_handler, NULL);
-		bro_event_registry_add_compact(bc, "db_log_flush", db_log_flush_event_handler, NULL);
-		bro_event_registry_request(bc);
-
-		fd = bro_conn_get_fd(bc);
-		for(;;)
+		if( reload_requested )
 			{
-			timeout.tv_sec = 5;
-			timeout.tv_usec = 0;
-			
-			//BUG?: If I don't do this for each loop, the select doesn't trigger
-			//      with incoming data and the timeout fires eventually.
-			FD_ZERO(&readfds);
-			FD_SET(fd, &readfds);
-			
-			readsocks = select(fd+1, &readfds, NULL, NULL, &timeout);
-
-			// Always attempt to process input.
-			bro_conn_process_input(bc);
-			
-			// Handle timer expirations AND socket disconnects.
-			if(readsocks <= 0)
-				{
-				// TODO: maybe some reconnect attempt limit?
-				while( !bro_conn_alive(bc) )
-					{
-					cerr << "Bro connection is lost; reconnecting...";
-					if( bro_conn_reconnect(bc) )
-						cerr << "done." << endl;
-					else
-						cerr << "failed!" << endl;
-					bro_conn_process_input(bc);
-					sleep(3);
-					}
-					
-				// This is run when the select timeout is reached.
-				if(readsocks == 0)
-					{
-					int flush_count = flush_tables(true);
-					if(verbose_output>1)
-						cout << "Flushed " << flush_count 
-						     << " table(s) based on last-flush time." 
-						     << endl;
-					}
-				}
+			reload_requested = 0;
+			if( config_file.empty() )
+				cerr << "Ignoring SIGHUP: there is no config file to reload (-c)." << endl;
+			else
+				reload_config();
+			}
+		
+		if( metrics_requested )
+			{
+			metrics_requested = 0;
+			cout << metrics_json() << endl;
 			}
 		}
+	
+	shutdown_dblogger();
 	}
 
 
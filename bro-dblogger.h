@@ -0,0 +1,41 @@
+#ifndef BRO_DBLOGGER_H
+#define BRO_DBLOGGER_H
+
+#include <string>
+
+extern "C" {
+	#include "broccoli.h"
+	#include "libpq-fe.h"
+}
+
+// A setting that the Broccoli thread changes on a reload while other
+// threads read it.
+class SharedSetting {
+	public:
+		SharedSetting(int value=0) : value(value) { }
+		operator int() const { return __atomic_load_n(&value, __ATOMIC_RELAXED); }
+		SharedSetting& operator=(int n) { __atomic_store_n(&value, n, __ATOMIC_RELAXED); return *this; }
+
+	private:
+		int value;
+};
+
+// Settings shared by the Broccoli thread and the writer threads.  These are
+// only written from main() before the writer threads are started, except
+// for verbose_output.  The settings a reload changes for the writers are
+// handed to them in a CONFIGURE job (see WriterSettings).
+extern std::string postgresql_host, postgresql_port;
+extern std::string postgresql_user, postgresql_password, postgresql_db;
+extern bool use_binary_copy;
+extern std::string spool_directory;
+extern size_t spool_budget;
+extern std::string file_directory;
+extern size_t file_rotate_bytes;
+extern int file_rotate_interval;
+extern bool file_archive;
+extern size_t string_cache_bytes;
+extern std::string metrics_socket, metrics_file;
+extern int metrics_interval;
+extern SharedSetting verbose_output;
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+// A growable byte buffer that values are formatted into directly.  clear()
+// keeps the storage, so a buffer that is reused for every row stops
+// allocating once it has grown to the size of the largest batch.
+class Buffer {
+	public:
+		Buffer() : buf(NULL), len(0), cap(0) { }
+		Buffer(const Buffer &other) : buf(NULL), len(0), cap(0)
+			{ append(other.buf, other.len); }
+		~Buffer() { free(buf); }
+
+		Buffer& operator=(const Buffer &other)
+			{
+			if( this != &other )
+				{
+				clear();
+				append(other.buf, other.len);
+				}
+			return *this;
+			}
+
+		char* data() { return buf; }
+		const char* data() const { return buf; }
+		size_t size() const { return len; }
+		bool empty() const { return len == 0; }
+
+		void clear() { len = 0; }
+
+		// Drop everything after the first n bytes.
+		void truncate(size_t n) { if( n < len ) len = n; }
+
+		// Make room for at least n more bytes and return where they go.
+		// Nothing is counted as used until commit() is called.
+		char* reserve(size_t n)
+			{
+			if( len + n > cap )
+				grow(len + n);
+			return buf + len;
+			}
+
+		void commit(size_t n) { len += n; }
+
+		void append(const void *data, size_t n)
+			{
+			if( n == 0 )
+				return;
+			memcpy(reserve(n), data, n);
+			len += n;
+			}
+
+		void append(const char *s) { append(s, strlen(s)); }
+
+		void push_back(char c)
+			{
+			if( len == cap )
+				grow(len + 1);
+			buf[len++] = c;
+			}
+
+		void swap(Buffer &other)
+			{
+			char *b = buf; buf = other.buf; other.buf = b;
+			size_t l = len; len = other.len; other.len = l;
+			size_t c = cap; cap = other.cap; other.cap = c;
+			}
+
+	private:
+		void grow(size_t needed)
+			{
+			size_t new_cap = cap ? cap : 4096;
+			while( new_cap < needed )
+				new_cap *= 2;
+			char *new_buf = (char *) realloc(buf, new_cap);
+			if( !new_buf )
+				abort();
+			buf = new_buf;
+			cap = new_cap;
+			}
+
+		char *buf;
+		size_t len, cap;
+};
+
+#endif
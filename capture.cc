@@ -0,0 +1,355 @@
+#include <iostream>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "capture.h"
+
+using namespace std;
+
+static const char capture_magic[8] = { 'B', 'D', 'L', 'C', 'A', 'P', 'T', '1' };
+
+// The capture is written out whenever this much is buffered.
+static const size_t capture_buffer_size = 64*1024;
+
+// Length of the kind and time at the start of every entry.
+static const size_t entry_header_size = 1 + sizeof(double);
+
+// Anything longer than this is taken to be a corrupt length.
+static const uint32_t max_entry_size = 256*1024*1024;
+
+template<typename T>
+static inline void put(Buffer &out, T value)
+	{
+	out.append(&value, sizeof(T));
+	}
+
+static void put_name(Buffer &out, const std::string &name)
+	{
+	uint16_t length = name.size() > 0xFFFF ? 0xFFFF : name.size();
+	put(out, length);
+	out.append(name.data(), length);
+	}
+
+template<typename T>
+static inline bool get(const char *&p, const char *end, T &value)
+	{
+	if( end - p < (ptrdiff_t) sizeof(T) )
+		return false;
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return true;
+	}
+
+static bool get_name(const char *&p, const char *end, std::string &name)
+	{
+	uint16_t length;
+	if( !get(p, end, length) || end - p < length )
+		return false;
+	name.assign(p, length);
+	p += length;
+	return true;
+	}
+
+CaptureWriter::CaptureWriter()
+	: file(NULL), entry_start(0)
+	{
+	}
+
+CaptureWriter::~CaptureWriter()
+	{
+	if( file )
+		{
+		sync();
+		fclose(file);
+		}
+	}
+
+void CaptureWriter::open(const std::string &capture_path)
+	{
+	path = capture_path;
+	file = fopen(path.c_str(), "wb");
+	if( !file )
+		{
+		cerr << "Could not create the capture file " << path << ": " << strerror(errno) << endl;
+		exit(-1);
+		}
+	buffer.append(capture_magic, sizeof(capture_magic));
+	}
+
+void CaptureWriter::begin(CaptureKind kind)
+	{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	entry_start = buffer.size();
+	put(buffer, (uint32_t) 0);
+	buffer.push_back((char) kind);
+	put(buffer, now.tv_sec + now.tv_usec / 1000000.0);
+	}
+
+void CaptureWriter::end()
+	{
+	uint32_t length = buffer.size() - entry_start - sizeof(uint32_t);
+	memcpy(buffer.data() + entry_start, &length, sizeof(length));
+	if( buffer.size() >= capture_buffer_size )
+		sync();
+	}
+
+void CaptureWriter::row(const RowBatch *batch, size_t row_start)
+	{
+	const Schema *schema = batch->schema;
+	map<const Schema*, uint32_t>::iterator iter = layouts.find(schema);
+	if( iter == layouts.end() )
+		{
+		uint32_t id = layouts.size();
+		iter = layouts.insert(make_pair(schema, id)).first;
+
+		begin(CAPTURE_LAYOUT);
+		put(buffer, id);
+		put_name(buffer, schema->table);
+		put(buffer, (uint16_t) schema->types.size());
+		for(size_t i=0; i < schema->types.size(); i++)
+			{
+			buffer.push_back((char) schema->types[i]);
+			put_name(buffer, schema->names[i]);
+			}
+		end();
+		}
+
+	begin(CAPTURE_ROW);
+	put(buffer, iter->second);
+	buffer.append(batch->data.data() + row_start, batch->data.size() - row_start);
+	end();
+	}
+
+void CaptureWriter::flush(const std::string &table)
+	{
+	begin(CAPTURE_FLUSH);
+	put_name(buffer, table);
+	end();
+	}
+
+void CaptureWriter::flush_all()
+	{
+	begin(CAPTURE_FLUSH_ALL);
+	end();
+	}
+
+void CaptureWriter::sync()
+	{
+	if( buffer.empty() )
+		return;
+	if( fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size() || fflush(file) != 0 )
+		cerr << "Could not write to the capture file " << path << ": " << strerror(errno) << endl;
+	buffer.clear();
+	}
+
+CaptureReader::CaptureReader()
+	: time(0), record(NULL), file(NULL)
+	{
+	}
+
+CaptureReader::~CaptureReader()
+	{
+	if( record )
+		bro_record_free(record);
+	if( file )
+		fclose(file);
+	}
+
+void CaptureReader::open(const std::string &capture_path)
+	{
+	char magic[sizeof(capture_magic)];
+
+	path = capture_path;
+	file = fopen(path.c_str(), "rb");
+	if( !file )
+		{
+		cerr << "Could not open the capture file " << path << ": " << strerror(errno) << endl;
+		exit(-1);
+		}
+	if( fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+	    memcmp(magic, capture_magic, sizeof(magic)) != 0 )
+		{
+		cerr << path << " is not a capture file." << endl;
+		exit(-1);
+		}
+	}
+
+CaptureReader::Event CaptureReader::next()
+	{
+	if( record )
+		{
+		bro_record_free(record);
+		record = NULL;
+		}
+
+	for(;;)
+		{
+		uint32_t length;
+		size_t n = fread(&length, 1, sizeof(length), file);
+		if( n == 0 )
+			return END;
+		if( n != sizeof(length) || length < entry_header_size || length > max_entry_size )
+			{
+			cerr << "The capture file " << path << " ends with a broken entry." << endl;
+			return END;
+			}
+		entry.resize(length);
+		if( fread(&entry[0], 1, length, file) != length )
+			{
+			cerr << "The capture file " << path << " ends with a broken entry." << endl;
+			return END;
+			}
+
+		const char *p = &entry[0] + entry_header_size;
+		const char *end = &entry[0] + length;
+		int kind = entry[0];
+		memcpy(&time, &entry[1], sizeof(time));
+
+		switch (kind)
+			{
+			case CAPTURE_LAYOUT:
+				if( read_layout(p, end) )
+					continue;
+				break;
+			case CAPTURE_ROW:
+				if( build_record(p, end) )
+					return ROW;
+				break;
+			case CAPTURE_FLUSH:
+				if( get_name(p, end, table) )
+					return FLUSH;
+				break;
+			case CAPTURE_FLUSH_ALL:
+				return FLUSH_ALL;
+			default:
+				break;
+			}
+
+		cerr << "Stopping at a corrupt entry in the capture file " << path << endl;
+		return END;
+		}
+	}
+
+bool CaptureReader::read_layout(const char *p, const char *end)
+	{
+	uint32_t id;
+	uint16_t fields;
+	Layout layout;
+
+	if( !get(p, end, id) || !get_name(p, end, layout.table) || !get(p, end, fields) )
+		return false;
+	for(int i=0; i < fields; i++)
+		{
+		unsigned char type;
+		std::string name;
+		if( !get(p, end, type) || !get_name(p, end, name) )
+			return false;
+		layout.types.push_back(type);
+		layout.names.push_back(name);
+		}
+	layouts[id] = layout;
+	return true;
+	}
+
+// Turn the row back into the record it was decoded from.
+bool CaptureReader::build_record(const char *p, const char *end)
+	{
+	uint32_t id;
+	uint16_t fields;
+	if( !get(p, end, id) || !layouts.count(id) || !get(p, end, fields) )
+		return false;
+	const Layout &layout = layouts[id];
+	if( fields != layout.types.size() )
+		return false;
+
+	table = layout.table;
+	record = bro_record_new();
+	for(int i=0; i < fields; i++)
+		{
+		unsigned char type = 0;
+		const char *name = layout.names[i].c_str();
+		bool valid = get(p, end, type);
+
+		switch (type)
+			{
+			case BRO_TYPE_INT:
+			case BRO_TYPE_BOOL:
+				{
+				int value;
+				valid = valid && get(p, end, value);
+				if( valid )
+					bro_record_add_val(record, name, type, NULL, &value);
+				break;
+				}
+			case BRO_TYPE_COUNT:
+			case BRO_TYPE_IPADDR:
+				{
+				uint32 value;
+				valid = valid && get(p, end, value);
+				if( valid )
+					bro_record_add_val(record, name, type, NULL, &value);
+				break;
+				}
+			case BRO_TYPE_TIME:
+			case BRO_TYPE_DOUBLE:
+			case BRO_TYPE_INTERVAL:
+				{
+				double value;
+				valid = valid && get(p, end, value);
+				if( valid )
+					bro_record_add_val(record, name, type, NULL, &value);
+				break;
+				}
+			case BRO_TYPE_PORT:
+				{
+				uint32 port_num;
+				int port_proto;
+				valid = valid && get(p, end, port_num) && get(p, end, port_proto);
+				if( valid )
+					{
+					BroPort value;
+					value.port_num = port_num;
+					value.port_proto = port_proto;
+					bro_record_add_val(record, name, type, NULL, &value);
+					}
+				break;
+				}
+			case BRO_TYPE_STRING:
+			default:
+				{
+				// Values of the other types weren't captured.  They are
+				// written as NULL, which an empty string is as well.
+				// They can't be made in their own type again (an enum
+				// needs the name of its type, which Broccoli doesn't give
+				// out), so the record is another layout of its table.
+				uint32 length = 0;
+				if( type == BRO_TYPE_STRING )
+					valid = valid && get(p, end, length) && (uint32) (end - p) > length;
+				if( valid )
+					{
+					BroString value;
+					bro_string_init(&value);
+					bro_string_set_data(&value, (const uchar *) p, length);
+					bro_record_add_val(record, name, BRO_TYPE_STRING, NULL, &value);
+					bro_string_cleanup(&value);
+					if( type == BRO_TYPE_STRING )
+						p += length + 1;
+					}
+				break;
+				}
+			}
+
+		if( !valid )
+			{
+			bro_record_free(record);
+			record = NULL;
+			return false;
+			}
+		}
+	return true;
+	}
@@ -0,0 +1,102 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "bro-dblogger.h"
+#include "buffer.h"
+#include "rows.h"
+
+// A capture file holds the db_log events that arrived, in order, so that
+// they can be fed through the decoding and COPY code again later.
+//
+// It starts with the 8 byte magic "BDLCAPT1".  Every entry after that is
+// a uint32 length of what follows it, a one byte kind and the time the
+// event arrived as a double, followed by:
+//   CAPTURE_LAYOUT     uint32 id, uint16 length and the table name,
+//                      uint16 field count and for every field its one
+//                      byte Bro type, uint16 length and name
+//   CAPTURE_ROW        uint32 id of the row's layout and the row as it is
+//                      kept in a RowBatch
+//   CAPTURE_FLUSH      uint16 length and the table name
+//   CAPTURE_FLUSH_ALL  nothing
+// A layout is written before the first row that has it.  Numbers are in
+// host byte order.  Fields of types that carry no value in a row are read
+// back as empty strings.
+enum CaptureKind {
+	CAPTURE_LAYOUT = 1,
+	CAPTURE_ROW = 2,
+	CAPTURE_FLUSH = 3,
+	CAPTURE_FLUSH_ALL = 4
+};
+
+class CaptureWriter {
+	public:
+		CaptureWriter();
+		~CaptureWriter();
+
+		// Exits if the file can't be created.
+		void open(const std::string &path);
+
+		// Append the row that was just decoded from an event, which runs
+		// from row_start to the end of the batch.
+		void row(const RowBatch *batch, size_t row_start);
+		void flush(const std::string &table);
+		void flush_all();
+
+		// Write out what is buffered.
+		void sync();
+
+	private:
+		void begin(CaptureKind kind);
+		void end();
+
+		FILE *file;
+		std::string path;
+		Buffer buffer;
+		size_t entry_start;
+		std::map<const Schema*, uint32_t> layouts;
+};
+
+// Reads a capture file back one event at a time.
+class CaptureReader {
+	public:
+		enum Event { ROW, FLUSH, FLUSH_ALL, END };
+
+		CaptureReader();
+		~CaptureReader();
+
+		// Exits if the file isn't a capture.
+		void open(const std::string &path);
+
+		// The next event.  For a ROW, record holds it until the next
+		// call; for a FLUSH, table is the table to flush.  A capture that
+		// ends in the middle of an entry ends there.
+		Event next();
+
+		double time;
+		std::string table;
+		BroRecord *record;
+
+	private:
+		class Layout {
+			public:
+				std::string table;
+				std::vector<std::string> names;
+				std::vector<int> types;
+		};
+
+		bool read_layout(const char *p, const char *end);
+		bool build_record(const char *p, const char *end);
+
+		FILE *file;
+		std::string path;
+		std::vector<char> entry;
+		std::map<uint32_t, Layout> layouts;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <fstream>
+#include <errno.h>
+#include <string.h>
+
+#include "config.h"
+
+using namespace std;
+
+static std::string trim(const std::string &s)
+	{
+	const char *space = " \t\r";
+	size_t start = s.find_first_not_of(space);
+	if( start == std::string::npos )
+		return "";
+	return s.substr(start, s.find_last_not_of(space) - start + 1);
+	}
+
+bool read_config(const std::string &path, std::vector<ConfigEntry> &entries)
+	{
+	ifstream file(path.c_str());
+	if( !file )
+		{
+		cerr << "Could not open the config file " << path << ": " << strerror(errno) << endl;
+		return false;
+		}
+
+	std::string text;
+	for(int line=1; getline(file, text); line++)
+		{
+		size_t comment = text.find('#');
+		if( comment != std::string::npos )
+			text.erase(comment);
+		text = trim(text);
+		if( text.empty() )
+			continue;
+
+		size_t equals = text.find('=');
+		ConfigEntry entry;
+		if( equals != std::string::npos )
+			entry.name = trim(text.substr(0, equals));
+		if( entry.name.empty() )
+			{
+			cerr << path << ":" << line << ": expected \"name = value\"." << endl;
+			return false;
+			}
+		entry.value = trim(text.substr(equals + 1));
+		entry.line = line;
+		entries.push_back(entry);
+		}
+	return true;
+	}
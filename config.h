@@ -0,0 +1,20 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+
+// One "name = value" line of a config file.
+class ConfigEntry {
+	public:
+		std::string name, value;
+		int line;
+};
+
+// Read the settings in the config file at path, in order.  Blank lines
+// and everything after a '#' are skipped, and whitespace around names and
+// values is dropped.  Returns false, after saying why, if the file can't
+// be read or has a line that isn't a setting.
+bool read_config(const std::string &path, std::vector<ConfigEntry> &entries);
+
+#endif
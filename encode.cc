@@ -0,0 +1,849 @@
+#include <iostream>
+
+#include <string.h>
+#include <stdio.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "utf_validate.h"
+#include "scan.h"
+#include "format.h"
+#include "encode.h"
+
+using namespace std;
+
+template<typename T>
+static inline T read_raw(const char *&p)
+	{
+	T value;
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return value;
+	}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Escape string_length bytes of str for COPY text into sp, which must have
+// room for string_length*5 bytes.  Returns the end of the output.
+static char* escape_string(const char *str, uint string_length, char *sp)
+	{
+	int tmp_char=0;
+
+	for ( uint i=0; i < string_length; ++i )
+		{
+		// Most strings are plain printable ASCII, which is copied through
+		// in bulk.  Everything else goes through the checks below.
+		size_t clean = copy_clean_prefix(str+i, string_length-i);
+		if ( clean )
+			{
+			memcpy(sp, str+i, clean);
+			sp += clean;
+			i += clean;
+			if ( i == string_length )
+				break;
+			}
+
+		tmp_char = str[i]&0xFF;
+		//printf("char (%d): %02x\n", i, tmp_char);
+		if ( tmp_char == '\0' )
+			{
+			*sp++ = '\\'; *sp++ = '\\'; *sp++ = '0';
+			}
+
+		// TODO: maybe deal with UTF16?
+		//else if ( tmp_char > 244 )
+		//	{
+		//	if (string_length-1 > i)
+		//		{
+		//		   I doubt if many of the string we'd be encountering
+		//		   would actually include the BOM though so
+		//		   this technique probably wouldn't help much.
+		//		if ( tmp_char == 254 && str[i+1]&0xFF == 255 )
+		//			cout << "UTF16-BOM Big Endian" << endl;
+		//		else if ( tmp_char == 255 && str[i+1]&0xFF == 254 )
+		//			cout << "UTF16-BOM Little Endian" << endl;
+		//		}
+		//	}
+
+		else if ( 193 < tmp_char && tmp_char < 245 )
+			{
+			int byte_count=0;
+			if(193 < tmp_char && tmp_char < 224)
+				byte_count=2;
+			else if(223 < tmp_char && tmp_char < 240)
+				byte_count=3;
+			else if(239 < tmp_char && tmp_char < 245)
+				byte_count=4;
+
+			//cout << byte_count << " byte sequence " << i << endl;
+
+			// Don't overrun the buffer in case of invalid UTF8.
+			if((int) (string_length-1-i) > byte_count)
+				byte_count = string_length-i-3;
+
+			if(utf_is_valid(str+i, byte_count))
+				{
+				// if utf8 is valid, include it verbatim
+				*sp++ = tmp_char;
+				for(int y=0; y<byte_count-1; ++y)
+					{
+					// The value always ended at the first '\0' that
+					// came through here, since it used to be handled
+					// as a C string.
+					if( str[i+1] == '\0' )
+						return sp;
+					*sp++ = str[++i];
+					}
+				}
+			}
+
+		else if ( tmp_char == '\x7f' )
+			{
+			*sp++ = '^'; *sp++ = '?';
+			}
+
+		else if ( tmp_char <= 26 )
+			{
+			*sp++ = '^'; *sp++ = tmp_char + 'A' - 1;
+			}
+
+		else if ( tmp_char == '\\' )
+			{
+			*sp++ = '\\'; *sp++ = '\\';
+			}
+
+		else if ( tmp_char > 126 )
+			{
+			// extended ascii and anything else not yet handled
+			// should be displayed as hex.
+			*sp++ = '\\'; *sp++ = '\\'; *sp++ = 'x';
+			*sp++ = hex_digits[tmp_char >> 4];
+			*sp++ = hex_digits[tmp_char & 0xF];
+			}
+		else
+			{
+			*sp++ = tmp_char;
+			}
+		}
+	return sp;
+	}
+
+// Strings longer than this are rarely repeated (URIs, subjects) and would
+// only push out the ones that are, so they aren't cached.
+static const uint32 max_cached_length = 512;
+
+static inline uint64_t hash_bytes(const char *s, size_t len)
+	{
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+	uint64_t v;
+	for( ; len >= 8; s += 8, len -= 8 )
+		{
+		memcpy(&v, s, 8);
+		h = (h ^ v) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+		}
+	v = 0;
+	memcpy(&v, s, len);
+	h = (h ^ v) * 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 29);
+	}
+
+EscapeCache::EscapeCache()
+	: top(0), live_bytes(0), limit(0), max_entries(0), hand(0), hits(0), misses(0)
+	{
+	}
+
+void EscapeCache::set_limit(size_t bytes)
+	{
+	limit = bytes;
+	// Room for entries of 128 bytes or so, with an index twice that size.
+	max_entries = bytes / 128;
+	if( max_entries > 0xFFFFFFF )
+		max_entries = 0xFFFFFFF;
+	}
+
+char* EscapeCache::escape(const char *str, uint32 length, char *sp)
+	{
+	if( !max_entries || length > max_cached_length )
+		return escape_string(str, length, sp);
+
+	uint64_t hash = hash_bytes(str, length);
+	size_t mask = index.size() - 1;
+	for( size_t slot = hash & mask; !index.empty() && index[slot]; slot = (slot + 1) & mask )
+		{
+		Entry &e = entries[index[slot] - 1];
+		const char *raw = &arena[e.offset + sizeof(ChunkHeader)];
+		if( e.hash == hash && e.raw_length == length && memcmp(raw, str, length) == 0 )
+			{
+			++hits;
+			e.referenced = true;
+			memcpy(sp, raw + length, e.escaped_length);
+			return sp + e.escaped_length;
+			}
+		}
+
+	++misses;
+	char *end = escape_string(str, length, sp);
+	insert(hash, str, length, sp, end - sp);
+	return end;
+	}
+
+// The index and the bookkeeping of max_entries entries take their share
+// of the limit and the arena gets the rest.  Nothing is made until there
+// is something to put in it, so tables without strings cost nothing.
+void EscapeCache::allocate()
+	{
+	size_t slots = 16;
+	while( slots < max_entries * 2 )
+		slots *= 2;
+	index.resize(slots, 0);
+	entries.reserve(max_entries);
+	free_entries.reserve(max_entries);
+
+	size_t overhead = slots * sizeof(uint32_t) + max_entries * (sizeof(Entry) + sizeof(uint32_t));
+	arena.resize(limit > overhead ? limit - overhead : 0);
+	}
+
+void EscapeCache::insert(uint64_t hash, const char *str, uint32 length, const char *escaped, size_t escaped_length)
+	{
+	if( index.empty() )
+		allocate();
+
+	size_t need = sizeof(ChunkHeader) + length + escaped_length;
+	if( need > arena.size() / 4 )
+		return;
+
+	while( live_bytes + need > arena.size() || (free_entries.empty() && entries.size() >= max_entries) )
+		evict();
+
+	// Compacting leaves a quarter of the arena free, so that it isn't
+	// done again for a while.
+	if( top + need > arena.size() )
+		{
+		while( live_bytes + need > arena.size() / 4 * 3 )
+			evict();
+		compact();
+		}
+
+	uint32_t id;
+	if( !free_entries.empty() )
+		{
+		id = free_entries.back();
+		free_entries.pop_back();
+		}
+	else
+		{
+		id = entries.size();
+		entries.push_back(Entry());
+		}
+
+	ChunkHeader chunk;
+	chunk.id = id;
+	chunk.length = need;
+	memcpy(&arena[top], &chunk, sizeof(chunk));
+	memcpy(&arena[top + sizeof(chunk)], str, length);
+	memcpy(&arena[top + sizeof(chunk) + length], escaped, escaped_length);
+
+	Entry &e = entries[id];
+	e.hash = hash;
+	e.offset = top;
+	e.raw_length = length;
+	e.escaped_length = escaped_length;
+	e.live = true;
+	e.referenced = false;
+	top += need;
+	live_bytes += need;
+
+	size_t mask = index.size() - 1;
+	size_t slot = hash & mask;
+	while( index[slot] )
+		slot = (slot + 1) & mask;
+	index[slot] = id + 1;
+	}
+
+// Take out the first entry the clock hand finds that wasn't used since it
+// last went by, and close the gap it leaves in the index.  Its chunk stays
+// in the arena until the next compact().
+void EscapeCache::evict()
+	{
+	uint32_t id;
+	for( ;; )
+		{
+		id = hand;
+		hand = (hand + 1) % entries.size();
+		Entry &e = entries[id];
+		if( !e.live )
+			continue;
+		if( e.referenced )
+			{
+			e.referenced = false;
+			continue;
+			}
+		break;
+		}
+
+	Entry &e = entries[id];
+	size_t mask = index.size() - 1;
+	size_t slot = e.hash & mask;
+	while( index[slot] != id + 1 )
+		slot = (slot + 1) & mask;
+
+	// Move later entries of the same run back into the gap, unless that
+	// would put them before the slot they hash to.
+	for( size_t next = (slot + 1) & mask; index[next]; next = (next + 1) & mask )
+		{
+		size_t home = entries[index[next] - 1].hash & mask;
+		bool stays = slot <= next ? (slot < home && home <= next)
+		                          : (slot < home || home <= next);
+		if( stays )
+			continue;
+		index[slot] = index[next];
+		slot = next;
+		}
+	index[slot] = 0;
+
+	live_bytes -= sizeof(ChunkHeader) + e.raw_length + e.escaped_length;
+	e.live = false;
+	free_entries.push_back(id);
+	}
+
+// Move the live chunks down to the start of the arena, in the order they
+// are in.  A chunk that was moved is always below the ones still to be
+// looked at, so a dead chunk whose id was given to a later entry can't be
+// taken for that entry's.
+void EscapeCache::compact()
+	{
+	size_t from = 0, to = 0;
+	while( from < top )
+		{
+		ChunkHeader chunk;
+		memcpy(&chunk, &arena[from], sizeof(chunk));
+		Entry &e = entries[chunk.id];
+		if( e.live && e.offset == from )
+			{
+			if( to != from )
+				memmove(&arena[to], &arena[from], chunk.length);
+			e.offset = to;
+			to += chunk.length;
+			}
+		from += chunk.length;
+		}
+	top = to;
+	}
+
+void EscapeCache::report(TableMetrics *metrics)
+	{
+	metrics->string_cache_hits.add(hits);
+	metrics->string_cache_misses.add(misses);
+	hits = misses = 0;
+	}
+
+bool parse_column_formats(const std::string &spec, std::string &table, std::map<std::string, int> &formats)
+	{
+	size_t colon = spec.find(':');
+	if( colon == std::string::npos || colon == 0 || colon + 1 == spec.size() )
+		return false;
+	table = spec.substr(0, colon);
+
+	size_t start = colon + 1;
+	while( start <= spec.size() )
+		{
+		size_t comma = spec.find(',', start);
+		if( comma == std::string::npos )
+			comma = spec.size();
+		std::string mapping = spec.substr(start, comma - start);
+		start = comma + 1;
+
+		size_t equals = mapping.find('=');
+		if( equals == std::string::npos || equals == 0 )
+			return false;
+		std::string field = mapping.substr(0, equals);
+		std::string format = mapping.substr(equals + 1);
+		if( format == "timestamptz" )
+			formats[field] = COLUMN_TIMESTAMPTZ;
+		else if( format == "inet" )
+			formats[field] = COLUMN_INET;
+		else if( format == "port" )
+			formats[field] = COLUMN_PORT;
+		else if( format == "exact" )
+			formats[field] = COLUMN_EXACT;
+		else
+			return false;
+		}
+	return true;
+	}
+
+// Bro writes the protocols it knows about by name and the rest as
+// "unknown".
+static const char* port_proto_name(int proto)
+	{
+	switch (proto)
+		{
+		case IPPROTO_TCP: return "tcp";
+		case IPPROTO_UDP: return "udp";
+		case IPPROTO_ICMP: return "icmp";
+		default: return "unknown";
+		}
+	}
+
+// Room needed for a port with its protocol, or a timestamp.
+static const size_t max_literal_length = 40;
+
+// Write a time as a timestamptz literal in UTC with microseconds, which
+// the server reads without a cast or trigger.  Writes nothing for times
+// that aren't finite, so they go in as NULL.
+static char* format_timestamptz(double value, char *w)
+	{
+	if( !isfinite(value) )
+		return w;
+
+	long long usecs = llround(value * 1000000.0);
+	long long secs = usecs / 1000000;
+	long frac = usecs % 1000000;
+	if( frac < 0 )
+		{
+		frac += 1000000;
+		secs--;
+		}
+
+	time_t t = secs;
+	struct tm tm;
+	if( !gmtime_r(&t, &tm) || tm.tm_year + 1900 < 0 || tm.tm_year + 1900 > 9999 )
+		return w;
+	w = format_padded(tm.tm_year + 1900, 4, w);
+	*w++ = '-';
+	w = format_padded(tm.tm_mon + 1, 2, w);
+	*w++ = '-';
+	w = format_padded(tm.tm_mday, 2, w);
+	*w++ = ' ';
+	w = format_padded(tm.tm_hour, 2, w);
+	*w++ = ':';
+	w = format_padded(tm.tm_min, 2, w);
+	*w++ = ':';
+	w = format_padded(tm.tm_sec, 2, w);
+	*w++ = '.';
+	w = format_padded(frac, 6, w);
+	memcpy(w, "+00", 3);
+	return w + 3;
+	}
+
+static char* format_port(uint32 port, int proto, char *w)
+	{
+	w = format_uint(port, w);
+	*w++ = '/';
+	const char *name = port_proto_name(proto);
+	size_t length = strlen(name);
+	memcpy(w, name, length);
+	return w + length;
+	}
+
+// Room needed for any number or literal that is formatted into a row.
+static const size_t max_number_length = max_fixed_length;
+
+const char* encode_row_text(const char *p, const std::vector<int> &formats, Buffer &output_value,
+                            EscapeCache *cache)
+	{
+	uint16 fields = read_raw<uint16>(p);
+
+	for(int i=0 ; i < fields ; i++)
+		{
+		if(i>0)
+			output_value.push_back('\t');
+
+		int type = (unsigned char) *p++;
+		int format = i < (int) formats.size() ? formats[i] : COLUMN_DEFAULT;
+		size_t field_start = output_value.size();
+		char *w;
+		uint string_length=0;
+
+		switch (type)
+			{
+			case BRO_TYPE_INT:
+				w = output_value.reserve(max_number_length);
+				output_value.commit(format_int(read_raw<int>(p), w) - w);
+				break;
+			case BRO_TYPE_PORT:
+				{
+				uint32 port = read_raw<uint32>(p);
+				int proto = read_raw<int>(p);
+				w = output_value.reserve(max_number_length);
+				if( format == COLUMN_PORT )
+					output_value.commit(format_port(port, proto, w) - w);
+				else
+					output_value.commit(format_uint(port, w) - w);
+				break;
+				}
+			case BRO_TYPE_STRING:
+				// TODO: UTF8 input is handled appropriately
+				//       UTF16/32 will come through looking very weird.
+				string_length = read_raw<uint32>(p);
+
+				// Maxmimum character expansion is as \\xHH, so a factor of 5.
+				w = output_value.reserve(string_length*5);
+				if( cache )
+					output_value.commit(cache->escape(p, string_length, w) - w);
+				else
+					output_value.commit(escape_string(p, string_length, w) - w);
+
+				// Skip the bytes and the '\0' that follows them.
+				p += string_length + 1;
+
+				if ( verbose_output > 1 )
+					{
+					cout << "After munging: ";
+					cout.write(output_value.data() + field_start,
+					           output_value.size() - field_start);
+					cout << endl;
+					}
+				break;
+			case BRO_TYPE_COUNT:
+				w = output_value.reserve(max_number_length);
+				output_value.commit(format_uint(read_raw<uint32>(p), w) - w);
+				break;
+			case ROW_TYPE_INT64:
+				w = output_value.reserve(max_number_length);
+				output_value.commit(format_int(read_raw<int64_t>(p), w) - w);
+				break;
+			case BRO_TYPE_TIME:
+			case BRO_TYPE_DOUBLE:
+			case BRO_TYPE_INTERVAL:
+				w = output_value.reserve(max_number_length);
+				if( type == BRO_TYPE_TIME && format == COLUMN_TIMESTAMPTZ )
+					output_value.commit(format_timestamptz(read_raw<double>(p), w) - w);
+				else if( format == COLUMN_EXACT )
+					output_value.commit(format_shortest(read_raw<double>(p), w) - w);
+				else
+					// The same as the "fixed" notation that this was
+					// always written in.
+					output_value.commit(format_fixed(read_raw<double>(p), w) - w);
+				break;
+			case BRO_TYPE_BOOL:
+				output_value.append(read_raw<int>(p) ? "true" : "false");
+				break;
+			case BRO_TYPE_IPADDR:
+				w = output_value.reserve(max_ipv4_length);
+				output_value.commit(format_ipv4(read_raw<uint32>(p), w) - w);
+				break;
+			default:
+				cerr << "unhandled data type" << endl;
+				break;
+			}
+
+		if( output_value.size() == field_start )
+			output_value.append("\\N", 2);
+		}
+
+	output_value.push_back('\n');
+	return p;
+	}
+
+static inline bool text_column(Oid column_type)
+	{
+	return column_type == TEXTOID || column_type == VARCHAROID ||
+	       column_type == BPCHAROID;
+	}
+
+bool binary_supported(int bro_type, int format, Oid column_type)
+	{
+	switch (bro_type)
+		{
+		case BRO_TYPE_INT:
+			return column_type == INT4OID || column_type == INT8OID ||
+			       column_type == FLOAT8OID;
+		case BRO_TYPE_COUNT:
+			return column_type == INT4OID || column_type == INT8OID ||
+			       column_type == FLOAT8OID;
+		case ROW_TYPE_INT64:
+			return column_type == INT8OID;
+		case BRO_TYPE_PORT:
+			if( format == COLUMN_PORT )
+				return text_column(column_type);
+			return column_type == INT4OID || column_type == INT8OID;
+		case BRO_TYPE_DOUBLE:
+			return column_type == FLOAT8OID;
+		case BRO_TYPE_TIME:
+			return column_type == FLOAT8OID || column_type == TIMESTAMPTZOID ||
+			       column_type == TIMESTAMPOID;
+		case BRO_TYPE_INTERVAL:
+			return column_type == FLOAT8OID || column_type == INTERVALOID;
+		case BRO_TYPE_BOOL:
+			return column_type == BOOLOID;
+		case BRO_TYPE_IPADDR:
+			return column_type == INETOID || column_type == CIDROID;
+		case BRO_TYPE_STRING:
+			return text_column(column_type);
+		default:
+			// These are always NULL, whatever the column is.
+			return true;
+		}
+	}
+
+Oid default_column_type(int bro_type, int format)
+	{
+	switch (bro_type)
+		{
+		case BRO_TYPE_INT:
+		case BRO_TYPE_COUNT:
+		case ROW_TYPE_INT64:
+			return INT8OID;
+		case BRO_TYPE_PORT:
+			return format == COLUMN_PORT ? TEXTOID : INT4OID;
+		case BRO_TYPE_DOUBLE:
+		case BRO_TYPE_INTERVAL:
+			return FLOAT8OID;
+		case BRO_TYPE_TIME:
+			return format == COLUMN_TIMESTAMPTZ ? TIMESTAMPTZOID : FLOAT8OID;
+		case BRO_TYPE_BOOL:
+			return BOOLOID;
+		case BRO_TYPE_IPADDR:
+			return INETOID;
+		case BRO_TYPE_STRING:
+			return TEXTOID;
+		default:
+			return 0;
+		}
+	}
+
+static inline void put_int16(Buffer &out, int16_t value)
+	{
+	unsigned char *w = (unsigned char *) out.reserve(2);
+	w[0] = (value >> 8) & 0xFF;
+	w[1] = value & 0xFF;
+	out.commit(2);
+	}
+
+static inline void put_int32(Buffer &out, int32_t value)
+	{
+	unsigned char *w = (unsigned char *) out.reserve(4);
+	for(int i=0; i < 4; i++)
+		w[i] = (value >> (24 - 8*i)) & 0xFF;
+	out.commit(4);
+	}
+
+static inline void put_int64(Buffer &out, int64_t value)
+	{
+	unsigned char *w = (unsigned char *) out.reserve(8);
+	for(int i=0; i < 8; i++)
+		w[i] = (value >> (56 - 8*i)) & 0xFF;
+	out.commit(8);
+	}
+
+static inline void put_float64(Buffer &out, double value)
+	{
+	int64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	put_int64(out, bits);
+	}
+
+// Binary timestamps count microseconds from 2000-01-01 00:00:00 UTC.
+static const double postgres_epoch = 946684800.0;
+
+void encode_binary_header(Buffer &output_value)
+	{
+	output_value.append("PGCOPY\n\377\r\n", 10);
+	output_value.push_back('\0');
+	put_int32(output_value, 0);	// flags
+	put_int32(output_value, 0);	// header extension length
+	}
+
+void encode_binary_trailer(Buffer &output_value)
+	{
+	put_int16(output_value, -1);
+	}
+
+// Undo COPY text escaping in place, the way the server reads it, and return
+// the new length.  Used so that strings sent in binary are stored exactly
+// as their COPY text would have been.
+static size_t unescape_copy_text(char *s, size_t len)
+	{
+	char *r = s, *w = s, *end = s + len;
+
+	while( r < end )
+		{
+		char c = *r++;
+		if( c != '\\' || r == end )
+			{
+			*w++ = c;
+			continue;
+			}
+
+		c = *r++;
+		if( c >= '0' && c <= '7' )
+			{
+			int value = c - '0';
+			for(int n=0; n < 2 && r < end && *r >= '0' && *r <= '7'; n++)
+				value = value*8 + (*r++ - '0');
+			*w++ = (char) value;
+			}
+		else if( c == 'x' && r < end && isxdigit((unsigned char) *r) )
+			{
+			int value = 0;
+			for(int n=0; n < 2 && r < end && isxdigit((unsigned char) *r); n++, r++)
+				value = value*16 + (isdigit((unsigned char) *r) ? *r - '0' : (tolower(*r) - 'a' + 10));
+			*w++ = (char) value;
+			}
+		else
+			{
+			switch (c)
+				{
+				case 'b': *w++ = '\b'; break;
+				case 'f': *w++ = '\f'; break;
+				case 'n': *w++ = '\n'; break;
+				case 'r': *w++ = '\r'; break;
+				case 't': *w++ = '\t'; break;
+				case 'v': *w++ = '\v'; break;
+				default: *w++ = c; break;
+				}
+			}
+		}
+	return w - s;
+	}
+
+const char* encode_row_binary(const char *p, const std::vector<Oid> &columns,
+                              const std::vector<int> &formats, Buffer &output_value,
+                              EscapeCache *cache)
+	{
+	uint16 fields = read_raw<uint16>(p);
+	put_int16(output_value, fields);
+
+	for(int i=0 ; i < fields ; i++)
+		{
+		int type = (unsigned char) *p++;
+		Oid column = i < (int) columns.size() ? columns[i] : 0;
+		int format = i < (int) formats.size() ? formats[i] : COLUMN_DEFAULT;
+
+		// The length goes in front of the value, so it is filled in once
+		// the value has been written.  Nothing written means NULL.
+		size_t length_at = output_value.size();
+		put_int32(output_value, 0);
+		size_t field_start = output_value.size();
+
+		switch (type)
+			{
+			case BRO_TYPE_INT:
+				{
+				int value = read_raw<int>(p);
+				if( column == INT4OID )
+					put_int32(output_value, value);
+				else if( column == INT8OID )
+					put_int64(output_value, value);
+				else if( column == FLOAT8OID )
+					put_float64(output_value, value);
+				break;
+				}
+			case BRO_TYPE_COUNT:
+				{
+				uint32 value = read_raw<uint32>(p);
+				if( column == INT4OID )
+					{
+					if( value <= INT_MAX )
+						put_int32(output_value, value);
+					else
+						cerr << "count " << value << " is too large for an integer column, writing NULL" << endl;
+					}
+				else if( column == INT8OID )
+					put_int64(output_value, value);
+				else if( column == FLOAT8OID )
+					put_float64(output_value, value);
+				break;
+				}
+			case ROW_TYPE_INT64:
+				{
+				int64_t value = read_raw<int64_t>(p);
+				if( column == INT8OID )
+					put_int64(output_value, value);
+				break;
+				}
+			case BRO_TYPE_PORT:
+				{
+				uint32 value = read_raw<uint32>(p);
+				int proto = read_raw<int>(p);
+				if( format == COLUMN_PORT && text_column(column) )
+					{
+					char *w = output_value.reserve(max_literal_length);
+					output_value.commit(format_port(value, proto, w) - w);
+					}
+				else if( column == INT4OID )
+					put_int32(output_value, value);
+				else if( column == INT8OID )
+					put_int64(output_value, value);
+				break;
+				}
+			case BRO_TYPE_TIME:
+			case BRO_TYPE_DOUBLE:
+			case BRO_TYPE_INTERVAL:
+				{
+				double value = read_raw<double>(p);
+				if( column == FLOAT8OID )
+					put_float64(output_value, value);
+				else if( type == BRO_TYPE_TIME &&
+				         (column == TIMESTAMPTZOID || column == TIMESTAMPOID) )
+					put_int64(output_value, llround((value - postgres_epoch) * 1000000.0));
+				else if( type == BRO_TYPE_INTERVAL && column == INTERVALOID )
+					{
+					put_int64(output_value, llround(value * 1000000.0));
+					put_int32(output_value, 0);	// days
+					put_int32(output_value, 0);	// months
+					}
+				break;
+				}
+			case BRO_TYPE_BOOL:
+				{
+				int value = read_raw<int>(p);
+				if( column == BOOLOID )
+					output_value.push_back(value ? 1 : 0);
+				break;
+				}
+			case BRO_TYPE_IPADDR:
+				{
+				uint32 value = read_raw<uint32>(p);
+				if( column == INETOID || column == CIDROID )
+					{
+					output_value.push_back(AF_INET);	// PGSQL_AF_INET
+					output_value.push_back(32);	// bits
+					output_value.push_back(column == CIDROID ? 1 : 0);
+					output_value.push_back(4);
+					// Already in network byte order.
+					output_value.append(&value, 4);
+					}
+				break;
+				}
+			case BRO_TYPE_STRING:
+				{
+				uint32 string_length = read_raw<uint32>(p);
+				if( text_column(column) )
+					{
+					char *w = output_value.reserve(string_length*5);
+					size_t n = (cache ? cache->escape(p, string_length, w)
+					                  : escape_string(p, string_length, w)) - w;
+
+					// COPY text would have read "\N" as NULL.
+					if( !(n == 2 && w[0] == '\\' && w[1] == 'N') )
+						output_value.commit(unescape_copy_text(w, n));
+					}
+				p += string_length + 1;
+				break;
+				}
+			default:
+				break;
+			}
+
+		// Like COPY text, empty strings are written as NULL too.
+		int32_t length = output_value.size() - field_start;
+		if( length == 0 )
+			length = -1;
+
+		unsigned char *l = (unsigned char *) output_value.data() + length_at;
+		for(int n=0; n < 4; n++)
+			l[n] = (length >> (24 - 8*n)) & 0xFF;
+		}
+
+	return p;
+	}
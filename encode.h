@@ -0,0 +1,141 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "buffer.h"
+#include "rows.h"
+#include "metrics.h"
+
+// PostgreSQL type OIDs (as in the server's catalog/pg_type.h) for the
+// column types that binary COPY can write.
+enum {
+	BOOLOID = 16,
+	INT8OID = 20,
+	INT4OID = 23,
+	TEXTOID = 25,
+	CIDROID = 650,
+	FLOAT8OID = 701,
+	INETOID = 869,
+	BPCHAROID = 1042,
+	VARCHAROID = 1043,
+	TIMESTAMPOID = 1114,
+	TIMESTAMPTZOID = 1184,
+	INTERVALOID = 1186
+};
+
+// How a field is written when its column doesn't take the value's default
+// text form.  Set per table and field with -T.
+enum ColumnFormat {
+	COLUMN_DEFAULT = 0,
+	// A time as a timestamp with time zone, in UTC.
+	COLUMN_TIMESTAMPTZ,
+	// An address as inet, which is what it is written as anyway.
+	COLUMN_INET,
+	// A port with its protocol, like "80/tcp", for a text column.
+	COLUMN_PORT,
+	// A double with all of its precision instead of rounded to six
+	// decimals.
+	COLUMN_EXACT
+};
+
+// Parse "table:field=format[,field=format...]", where format is
+// timestamptz, inet, port or exact.  Returns false if the mapping can't be read.
+bool parse_column_formats(const std::string &spec, std::string &table, std::map<std::string, int> &formats);
+
+// Escaped strings that were seen before, for the fields (hosts, user
+// agents, query types, services) whose values repeat all the time, so that
+// those only cost a hash, a compare and a copy.  Entries are found by a
+// hash of the raw bytes and evicted with CLOCK once the cache holds its
+// limit in bytes.  A writer thread keeps a cache for each table it
+// writes, shared by the table's streams and partitions, and is the only
+// thread that uses it.
+//
+// Everything is allocated at the first insert: the entries, the index and
+// an arena that holds each entry's raw and escaped bytes together.  New
+// bytes go at the end of the arena, and once that is reached the live
+// ones are moved down over the evicted ones, so a miss never allocates.
+class EscapeCache {
+	public:
+		EscapeCache();
+
+		// How many bytes the entries may take (0 to not cache at all).
+		void set_limit(size_t bytes);
+
+		// Escape length bytes of str into sp, which must have room for
+		// length*5 bytes, and return the end of the output.
+		char* escape(const char *str, uint32 length, char *sp);
+
+		// Add the hits and misses since the last report to metrics.
+		void report(TableMetrics *metrics);
+
+	private:
+		// Where an entry's bytes are in the arena: a ChunkHeader, the
+		// raw string and then the escaped one.
+		struct Entry {
+			uint64_t hash;
+			uint32_t offset;
+			uint16_t raw_length, escaped_length;
+			bool live, referenced;
+		};
+
+		// Lets the arena be walked from the start.  id is the entry the
+		// chunk was made for, which is only still using it if the
+		// entry is live and at this offset.
+		struct ChunkHeader {
+			uint32_t id, length;
+		};
+
+		void allocate();
+		void insert(uint64_t hash, const char *str, uint32 length, const char *escaped, size_t escaped_length);
+		void evict();
+		void compact();
+
+		// Entries, and the open addressed index into them (entry + 1,
+		// or 0 for an empty slot).
+		std::vector<Entry> entries;
+		std::vector<uint32_t> index;
+		std::vector<uint32_t> free_entries;
+
+		// The arena, how far into it chunks have been put, and how many
+		// bytes of those are live chunks.
+		std::vector<char> arena;
+		size_t top, live_bytes;
+
+		size_t limit, max_entries, hand;
+		uint64_t hits, misses;
+};
+
+// Append the decoded row starting at p (see RowBatch) to output_value as
+// one line of COPY text, writing field i as formats[i] says.  Strings are
+// looked up in cache, if there is one.  Returns a pointer just past the
+// row.
+const char* encode_row_text(const char *p, const std::vector<int> &formats, Buffer &output_value,
+                            EscapeCache *cache=NULL);
+
+// Whether a Bro value of bro_type written as format can be written in
+// binary COPY format to a column of type column_type.  Timestamps assume
+// the server uses integer datetimes.
+bool binary_supported(int bro_type, int format, Oid column_type);
+
+// The column type that a Bro value of bro_type written as format is
+// written as in binary when there is no table to ask, as for COPY files.
+// Returns 0 for types that are always NULL.
+Oid default_column_type(int bro_type, int format);
+
+// The header that has to start and the trailer that has to end the data
+// of every binary COPY.
+void encode_binary_header(Buffer &output_value);
+void encode_binary_trailer(Buffer &output_value);
+
+// Append the decoded row starting at p as one binary COPY tuple, writing
+// field i as a value of type columns[i] in format formats[i].  Values the
+// column type can't take are written as NULL.  Returns a pointer just past
+// the row.
+const char* encode_row_binary(const char *p, const std::vector<Oid> &columns,
+                              const std::vector<int> &formats, Buffer &output_value,
+                              EscapeCache *cache=NULL);
+
+#endif
@@ -0,0 +1,494 @@
+#include <iostream>
+#include <algorithm>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "filesink.h"
+#include "encode.h"
+#include "archive.h"
+
+using namespace std;
+
+// Files are written this much at a time, from buffers aligned for
+// O_DIRECT.  The last block is padded to file_alignment and the file
+// truncated back to its size.
+static const size_t file_block_size = 1024*1024;
+static const size_t file_alignment = 4096;
+
+static unsigned file_sequence = 0;
+
+static void *file_writer_thread(void *arg)
+	{
+	((FileWriter *) arg)->run();
+	return NULL;
+	}
+
+FileWriter::FileWriter(FileSink *sink)
+	: sink(sink), stopping(false)
+	{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&wakeup, NULL);
+	}
+
+void FileWriter::start()
+	{
+	// Signals are only handled by the Broccoli thread.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if( pthread_create(&thread, NULL, file_writer_thread, this) != 0 )
+		{
+		cerr << "Could not start a file writer thread." << endl;
+		exit(-1);
+		}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+void FileWriter::enqueue(const WriterJob &job)
+	{
+	pthread_mutex_lock(&lock);
+	jobs.push_back(job);
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+	}
+
+void FileWriter::stop()
+	{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	}
+
+void FileWriter::run()
+	{
+	std::deque<WriterJob> work;
+
+	for(;;)
+		{
+		pthread_mutex_lock(&lock);
+		if( jobs.empty() && !stopping )
+			{
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec++;
+			pthread_cond_timedwait(&wakeup, &lock, &until);
+			}
+		work.swap(jobs);
+		bool stop_now = stopping;
+		pthread_mutex_unlock(&lock);
+
+		for( ; !work.empty(); work.pop_front() )
+			{
+			const WriterJob &job = work.front();
+			if( job.kind == WriterJob::ROWS )
+				write_batch(job.batch);
+			else if( job.kind == WriterJob::FLUSH )
+				flush_table(job.table);
+			else if( job.kind == WriterJob::FLUSH_ALL )
+				flush_tables();
+			}
+
+		if( stop_now )
+			break;
+		rotate_files(time((time_t *)NULL));
+		}
+
+	// The jobs were all taken before stopping was seen, so this is
+	// everything.
+	flush_tables();
+	}
+
+FileStream& FileWriter::stream_for(const Schema *schema)
+	{
+	map<string,FileStream>::iterator iter = streams.find(schema->stream);
+	if( iter != streams.end() )
+		return iter->second;
+
+	FileStream &s = streams[schema->stream];
+	s.schema = schema;
+	s.query = "COPY " + schema->table + " (" + schema->field_names + ") FROM STDIN";
+	s.binary = use_binary_copy && !file_archive;
+	for(size_t i=0; i < schema->types.size(); i++)
+		s.columns.push_back(default_column_type(schema->types[i], schema->formats[i]));
+	if( s.binary )
+		s.query += " WITH BINARY";
+	s.strings = &string_caches[schema->table];
+	s.strings->set_limit(string_cache_bytes);
+	s.file = NULL;
+	s.archived_records = 0;
+	s.archived_since = 0;
+	s.metrics = schema->metrics;
+	return s;
+	}
+
+bool FileWriter::open_file(FileStream &s)
+	{
+	// Table names may carry a schema, but never a directory.
+	std::string name = s.schema->table;
+	replace(name.begin(), name.end(), '/', '_');
+
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%010ld.%d.%06u", (long) time((time_t *)NULL),
+	         (int) getpid(), __atomic_fetch_add(&file_sequence, 1, __ATOMIC_RELAXED));
+
+	CopyFile *f = new CopyFile;
+	f->path = file_directory + "/" + name + suffix;
+	f->direct = false;
+	f->used = 0;
+	f->size = 0;
+	f->records = 0;
+	f->opened = time((time_t *)NULL);
+
+	std::string partial = f->path + ".partial";
+	int flags = O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC;
+	f->fd = -1;
+#ifdef O_DIRECT
+	// Not every file system takes O_DIRECT (tmpfs doesn't), and those
+	// that don't get ordinary writes of the same blocks.
+	f->fd = open(partial.c_str(), flags|O_DIRECT, 0644);
+	f->direct = f->fd >= 0;
+	if( f->fd < 0 && errno == EINVAL )
+#endif
+		f->fd = open(partial.c_str(), flags, 0644);
+	if( f->fd < 0 )
+		{
+		cerr << "Could not create COPY file " << partial << ": " << strerror(errno) << endl;
+		delete f;
+		return false;
+		}
+
+	if( posix_memalign((void **) &f->block, file_alignment, file_block_size) != 0 )
+		abort();
+
+	s.file = f;
+	if( s.binary )
+		{
+		Buffer header;
+		encode_binary_header(header);
+		return write_out(s, header.data(), header.size());
+		}
+	return true;
+	}
+
+// Copy data into the file's block, writing each block out as it fills up.
+bool FileWriter::write_out(FileStream &s, const char *data, size_t len)
+	{
+	CopyFile *f = s.file;
+	f->size += len;
+	while( len > 0 )
+		{
+		size_t n = min(len, file_block_size - f->used);
+		memcpy(f->block + f->used, data, n);
+		f->used += n;
+		data += n;
+		len -= n;
+		if( f->used == file_block_size )
+			{
+			if( !write_block(s, file_block_size) )
+				return false;
+			f->used = 0;
+			}
+		}
+	return true;
+	}
+
+bool FileWriter::write_block(FileStream &s, size_t len)
+	{
+	CopyFile *f = s.file;
+	uint64_t start = monotonic_usec();
+	size_t done = 0;
+	while( done < len )
+		{
+		ssize_t n = write(f->fd, f->block + done, len - done);
+		if( n < 0 && errno == EINTR )
+			continue;
+		if( n <= 0 )
+			{
+			abandon_file(s, "write", n < 0 ? errno : ENOSPC);
+			return false;
+			}
+		done += n;
+		}
+	s.metrics->put_usec.record(monotonic_usec() - start);
+	return true;
+	}
+
+// Give up on a file that couldn't be written, and on the rows in it.
+void FileWriter::abandon_file(FileStream &s, const char *what, int error)
+	{
+	CopyFile *f = s.file;
+	cerr << "Could not " << what << " COPY file " << f->path << ".partial: " << strerror(error)
+	     << "; dropping its " << f->records << " rows." << endl;
+	s.metrics->dropped_rows.add(f->records);
+	close(f->fd);
+	unlink((f->path + ".partial").c_str());
+	free(f->block);
+	delete f;
+	s.file = NULL;
+	}
+
+void FileWriter::close_file(FileStream &s)
+	{
+	if( s.binary )
+		{
+		Buffer trailer;
+		encode_binary_trailer(trailer);
+		if( !write_out(s, trailer.data(), trailer.size()) )
+			return;
+		}
+
+	CopyFile *f = s.file;
+	if( f->used > 0 )
+		{
+		size_t len = f->used;
+		if( f->direct )
+			{
+			len = (len + file_alignment - 1) & ~(file_alignment - 1);
+			memset(f->block + f->used, 0, len - f->used);
+			}
+		if( !write_block(s, len) )
+			return;
+		}
+	if( f->direct && ftruncate(f->fd, f->size) != 0 )
+		{
+		abandon_file(s, "truncate", errno);
+		return;
+		}
+	if( fdatasync(f->fd) != 0 )
+		{
+		abandon_file(s, "sync", errno);
+		return;
+		}
+
+	// The statement has to be there before the file that it loads.
+	// Segments carry their table and fields themselves.
+	std::string sql = f->path + ".sql";
+	if( !file_archive )
+		{
+		std::string statement = s.query + ";\n";
+		int fd = open(sql.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+		if( fd < 0 || write(fd, statement.data(), statement.size()) != (ssize_t) statement.size() )
+			{
+			int error = errno;
+			if( fd >= 0 )
+				close(fd);
+			abandon_file(s, "write the statement for", error);
+			return;
+			}
+		close(fd);
+		}
+
+	std::string path = f->path + (file_archive ? ".archive" : s.binary ? ".pgcopy" : ".copy");
+	if( rename((f->path + ".partial").c_str(), path.c_str()) != 0 )
+		{
+		int error = errno;
+		unlink(sql.c_str());
+		abandon_file(s, "rename", error);
+		return;
+		}
+
+	if(verbose_output>1)
+		cout << "Closed " << path << " with " << f->records << " rows" << endl;
+	s.metrics->commit_rows.record(f->records);
+	s.metrics->files.add();
+	close(f->fd);
+	free(f->block);
+	delete f;
+	s.file = NULL;
+	}
+
+// Encode the rows kept for the stream as one archive segment and write it
+// to a file of its own.
+void FileWriter::write_segment(FileStream &s)
+	{
+	int records = s.archived_records;
+	uint64_t start = monotonic_usec();
+	encoded.clear();
+	encode_segment(*s.schema, s.archived.data(), records, encoded);
+	s.metrics->rows.add(records);
+	s.metrics->bytes.add(encoded.size());
+	s.metrics->encode_usec.add(monotonic_usec() - start);
+	s.archived.clear();
+	s.archived_records = 0;
+
+	if( !open_file(s) || !write_out(s, encoded.data(), encoded.size()) )
+		{
+		s.metrics->dropped_rows.add(records);
+		return;
+		}
+	s.file->records = records;
+	close_file(s);
+	}
+
+// Close the stream's file, or write its segment, if it has any rows.
+void FileWriter::finish(FileStream &s)
+	{
+	if( s.file )
+		close_file(s);
+	else if( s.archived_records )
+		write_segment(s);
+	}
+
+void FileWriter::write_batch(RowBatch *batch)
+	{
+	FileStream &s = stream_for(batch->schema);
+	int records = batch->records;
+	size_t decoded = batch->data.size();
+
+	if( file_archive )
+		{
+		if( !s.archived_records )
+			s.archived_since = time((time_t *)NULL);
+		s.archived.append(batch->data.data(), decoded);
+		s.archived_records += records;
+		s.metrics->queued_rows.sub(records);
+		s.metrics->queued_bytes.sub(decoded);
+		sink->release_batch(batch);
+
+		if( file_rotate_bytes && s.archived.size() >= file_rotate_bytes )
+			write_segment(s);
+		return;
+		}
+
+	uint64_t start = monotonic_usec();
+	encoded.clear();
+	const char *p = batch->data.data();
+	if( s.binary )
+		{
+		for(int i=0; i < records; i++)
+			p = encode_row_binary(p, s.columns, s.schema->formats, encoded, s.strings);
+		}
+	else
+		{
+		for(int i=0; i < records; i++)
+			p = encode_row_text(p, s.schema->formats, encoded, s.strings);
+		}
+	s.strings->report(s.metrics);
+	s.metrics->rows.add(records);
+	s.metrics->bytes.add(encoded.size());
+	s.metrics->encode_usec.add(monotonic_usec() - start);
+	s.metrics->queued_rows.sub(records);
+	s.metrics->queued_bytes.sub(decoded);
+	sink->release_batch(batch);
+
+	if( !s.file && !open_file(s) )
+		{
+		s.metrics->dropped_rows.add(records);
+		return;
+		}
+
+	if( !write_out(s, encoded.data(), encoded.size()) )
+		{
+		s.metrics->dropped_rows.add(records);
+		return;
+		}
+	s.file->records += records;
+
+	if( file_rotate_bytes && s.file->size >= file_rotate_bytes )
+		close_file(s);
+	}
+
+void FileWriter::flush_table(const std::string &table)
+	{
+	map<string,FileStream>::iterator iter;
+	for( iter = streams.begin(); iter != streams.end(); iter++ )
+		{
+		if( iter->second.schema->table == table )
+			finish(iter->second);
+		}
+	}
+
+void FileWriter::flush_tables()
+	{
+	map<string,FileStream>::iterator iter;
+	for( iter = streams.begin(); iter != streams.end(); iter++ )
+		finish(iter->second);
+	}
+
+void FileWriter::rotate_files(time_t now_time)
+	{
+	if( !file_rotate_interval )
+		return;
+
+	map<string,FileStream>::iterator iter;
+	for( iter = streams.begin(); iter != streams.end(); iter++ )
+		{
+		FileStream &s = iter->second;
+		if( (s.file && now_time - s.file->opened >= file_rotate_interval) ||
+		    (s.archived_records && now_time - s.archived_since >= file_rotate_interval) )
+			finish(s);
+		}
+	}
+
+FileSink::FileSink(int threads)
+	{
+	for(int i=0; i < threads; i++)
+		writers.push_back(new FileWriter(this));
+	}
+
+FileSink::~FileSink()
+	{
+	for(size_t i=0; i < writers.size(); i++)
+		delete writers[i];
+	}
+
+void FileSink::start()
+	{
+	if( mkdir(file_directory.c_str(), 0755) != 0 && errno != EEXIST )
+		{
+		cerr << "Could not create the COPY file directory " << file_directory
+		     << ": " << strerror(errno) << endl;
+		exit(-1);
+		}
+
+	for(size_t i=0; i < writers.size(); i++)
+		writers[i]->start();
+	}
+
+FileWriter* FileSink::writer_for(const std::string &table)
+	{
+	return writers[thread_for(table, writers.size())];
+	}
+
+void FileSink::submit(RowBatch *batch)
+	{
+	batch->schema->metrics->queued_rows.add(batch->records);
+	batch->schema->metrics->queued_bytes.add(batch->data.size());
+
+	WriterJob job;
+	job.kind = WriterJob::ROWS;
+	job.batch = batch;
+	writer_for(batch->schema->table)->enqueue(job);
+	}
+
+void FileSink::flush(const std::string &table)
+	{
+	WriterJob job;
+	job.kind = WriterJob::FLUSH;
+	job.batch = NULL;
+	job.table = table;
+	writer_for(table)->enqueue(job);
+	}
+
+void FileSink::flush_all()
+	{
+	WriterJob job;
+	job.kind = WriterJob::FLUSH_ALL;
+	job.batch = NULL;
+	for(size_t i=0; i < writers.size(); i++)
+		writers[i]->enqueue(job);
+	}
+
+void FileSink::shutdown()
+	{
+	for(size_t i=0; i < writers.size(); i++)
+		writers[i]->stop();
+	}
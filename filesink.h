@@ -0,0 +1,137 @@
+#ifndef FILESINK_H
+#define FILESINK_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <time.h>
+#include <pthread.h>
+
+#include "sink.h"
+#include "writer.h"
+
+// A file of COPY data that is still being written.  It is written in
+// blocks of file_block_size from an aligned buffer, with O_DIRECT where
+// the file system allows it, so that bulk loading doesn't go through the
+// page cache of the machine that is also taking the events.
+//
+// While it is written the file is path + ".partial".  Once it is closed
+// its COPY statement is written to path + ".sql" and the file is renamed
+// to path + ".copy" (text) or path + ".pgcopy" (binary), so anything
+// that loads files with those names only ever sees complete ones.
+// Archive segments (see archive.h) are written the same way, without the
+// statement, as path + ".archive".
+class CopyFile {
+	public:
+		std::string path;
+		int fd;
+		bool direct;
+
+		// The block being filled and how much of it is.
+		char *block;
+		size_t used;
+
+		// Bytes and rows in the file so far, buffered or not, and when
+		// it was opened.
+		uint64_t size;
+		int records;
+		time_t opened;
+};
+
+// One of a table's COPY streams (see Schema), written to file after file.
+class FileStream {
+	public:
+		const Schema *schema;
+
+		// "COPY table (fields) FROM STDIN", for the .sql file.
+		std::string query;
+
+		// Binary files are written with the column types that
+		// default_column_type() picks.
+		bool binary;
+		std::vector<Oid> columns;
+
+		// The writer's escaped string cache for the table.
+		EscapeCache *strings;
+
+		// The file being written, if there is one.
+		CopyFile *file;
+
+		// With file_archive, the rows as they were decoded that go into
+		// the next segment, and when the first of them came.
+		Buffer archived;
+		int archived_records;
+		time_t archived_since;
+
+		TableMetrics *metrics;
+};
+
+class FileSink;
+
+// A file writer thread encodes and writes the rows of the tables that
+// hash to it.  Writes block, so unlike a Writer it simply waits for jobs
+// and looks at the age of its files once a second.
+class FileWriter {
+	public:
+		FileWriter(FileSink *sink);
+
+		void start();
+		void enqueue(const WriterJob &job);
+		void stop();
+		void run();
+
+	private:
+		FileStream& stream_for(const Schema *schema);
+		bool open_file(FileStream &s);
+		bool write_out(FileStream &s, const char *data, size_t len);
+		bool write_block(FileStream &s, size_t len);
+		void close_file(FileStream &s);
+		void abandon_file(FileStream &s, const char *what, int error);
+		void write_segment(FileStream &s);
+		void finish(FileStream &s);
+		void write_batch(RowBatch *batch);
+		void flush_table(const std::string &table);
+		void flush_tables();
+		void rotate_files(time_t now_time);
+
+		FileSink *sink;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t wakeup;
+		std::deque<WriterJob> jobs;
+		bool stopping;
+
+		// Only ever touched from the writer's own thread.  Streams are
+		// looked up by their Schema's stream.
+		std::map<std::string, FileStream> streams;
+		// Escaped string caches by table.
+		std::map<std::string, EscapeCache> string_caches;
+		Buffer encoded;
+};
+
+// The file sink: rows are written to COPY files in file_directory, a file
+// for each stream of a table at a time, and a file is closed once it
+// holds file_rotate_bytes, is file_rotate_interval seconds old, or its
+// table is flushed.  With file_archive the rows are kept until then and
+// written as an archive segment instead.
+class FileSink : public Sink {
+	public:
+		FileSink(int threads);
+		~FileSink();
+
+		void start();
+		void submit(RowBatch *batch);
+		void flush(const std::string &table);
+		void flush_all();
+
+		// Close every file and wait for the file writer threads to exit.
+		void shutdown();
+
+	private:
+		FileWriter* writer_for(const std::string &table);
+
+		std::vector<FileWriter*> writers;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "filter.h"
+
+using namespace std;
+
+bool parse_sample_rule(const std::string &spec, std::string &table, SampleRule &rule)
+	{
+	size_t second = spec.rfind(':');
+	if( second == std::string::npos || second == 0 )
+		return false;
+	size_t first = spec.rfind(':', second - 1);
+	if( first == std::string::npos || first == 0 || first + 1 == second )
+		return false;
+
+	table = spec.substr(0, first);
+	rule.field = spec.substr(first + 1, second - first - 1);
+
+	char *end;
+	rule.one_in = strtoul(spec.c_str() + second + 1, &end, 10);
+	return !*end && rule.one_in > 0;
+	}
+
+void parse_table_list(const std::string &list, std::set<std::string> &tables)
+	{
+	size_t at = 0;
+	while( at <= list.size() )
+		{
+		size_t end = list.find(',', at);
+		if( end == std::string::npos )
+			end = list.size();
+		if( end > at )
+			tables.insert(list.substr(at, end - at));
+		at = end + 1;
+		}
+	}
+
+// 64 bit FNV-1a, with the bits mixed afterwards so that the low ones
+// depend on all of the input.
+static uint64_t hash_value(const void *data, size_t len)
+	{
+	const unsigned char *p = (const unsigned char *) data;
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i=0; i < len; i++)
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+	}
+
+bool sample_keep(BroRecord *r, const SampleRule &rule)
+	{
+	int type = 0;
+	void *data = bro_record_get_named_val(r, rule.field.c_str(), &type);
+	if( !data )
+		return true;
+
+	uint64_t hash;
+	switch (type)
+		{
+		case BRO_TYPE_INT:
+		case BRO_TYPE_BOOL:
+			hash = hash_value(data, sizeof(int));
+			break;
+		case BRO_TYPE_COUNT:
+		case BRO_TYPE_IPADDR:
+			hash = hash_value(data, sizeof(uint32));
+			break;
+		case BRO_TYPE_TIME:
+		case BRO_TYPE_DOUBLE:
+		case BRO_TYPE_INTERVAL:
+			hash = hash_value(data, sizeof(double));
+			break;
+		case BRO_TYPE_PORT:
+			{
+			uint32 port_num = ((bro_port *) data)->port_num;
+			hash = hash_value(&port_num, sizeof(port_num));
+			break;
+			}
+		case BRO_TYPE_STRING:
+			hash = hash_value(bro_string_get_data((BroString *) data),
+			                  bro_string_get_length((BroString *) data));
+			break;
+		default:
+			return true;
+		}
+	return hash % rule.one_in == 0;
+	}
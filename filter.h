@@ -0,0 +1,28 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <string>
+#include <set>
+
+#include "bro-dblogger.h"
+
+// Keep one in every one_in rows of a table, picked by a hash of the value
+// of field.  The same value is always kept or always dropped, so a host
+// that is sampled keeps all of its rows.
+class SampleRule {
+	public:
+		std::string field;
+		unsigned long one_in;
+};
+
+// Parse "table:field:N".  Returns false if the rule can't be read.
+bool parse_sample_rule(const std::string &spec, std::string &table, SampleRule &rule);
+
+// Add the comma separated table names in list to tables.
+void parse_table_list(const std::string &list, std::set<std::string> &tables);
+
+// Whether the record is one of the rows that the rule keeps.  Records
+// without the field, or with a value that can't be hashed, are kept.
+bool sample_keep(BroRecord *r, const SampleRule &rule);
+
+#endif
@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "format.h"
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// Digits are worked out from the right into tmp and then copied over.
+char* format_padded(uint64_t value, int width, char *w)
+	{
+	char tmp[max_int_length];
+	char *t = tmp + sizeof(tmp);
+
+	while( value >= 100 )
+		{
+		int pair = (value % 100) * 2;
+		value /= 100;
+		*--t = digit_pairs[pair + 1];
+		*--t = digit_pairs[pair];
+		}
+	if( value >= 10 )
+		{
+		*--t = digit_pairs[value*2 + 1];
+		*--t = digit_pairs[value*2];
+		}
+	else
+		*--t = '0' + value;
+
+	int length = tmp + sizeof(tmp) - t;
+	for(; length < width; width--)
+		*w++ = '0';
+	memcpy(w, t, length);
+	return w + length;
+	}
+
+char* format_uint(uint64_t value, char *w)
+	{
+	return format_padded(value, 1, w);
+	}
+
+char* format_int(int64_t value, char *w)
+	{
+	if( value < 0 )
+		{
+		*w++ = '-';
+		// Negated as unsigned so that INT64_MIN works.
+		return format_padded(-(uint64_t) value, 1, w);
+		}
+	return format_padded(value, 1, w);
+	}
+
+#ifdef __SIZEOF_INT128__
+// Fractions are worked on as fixed point numbers with this many bits after
+// the point, so that multiplying by 10 can't overflow.  Anything that needs
+// more than that is below 2^-67 and comes out as zero.
+typedef unsigned __int128 fixed_point;
+static const int fraction_bits = 120;
+#endif
+
+char* format_fixed(double value, char *w)
+	{
+#ifdef __SIZEOF_INT128__
+	// Integer parts this large don't fit the integer formatter, and are
+	// never times or intervals anyway.
+	if( !isfinite(value) || fabs(value) >= 9223372036854775808.0 )
+#endif
+		return w + snprintf(w, max_fixed_length, "%f", value);
+
+#ifdef __SIZEOF_INT128__
+	if( signbit(value) )
+		{
+		*w++ = '-';
+		value = -value;
+		}
+
+	// Both parts are exact: the integer part fits, and so does what is
+	// left of a double once its integer part is taken off.
+	uint64_t integer = (uint64_t) value;
+	double fraction = value - (double) integer;
+
+	// fraction is mantissa / 2^shift, lined up here as fixed point.
+	fixed_point fixed = 0;
+	if( fraction > 0 )
+		{
+		int exponent;
+		uint64_t mantissa = (uint64_t) ldexp(frexp(fraction, &exponent), 53);
+		int shift = 53 - exponent;
+		if( shift <= fraction_bits )
+			fixed = (fixed_point) mantissa << (fraction_bits - shift);
+		}
+
+	const fixed_point mask = ((fixed_point) 1 << fraction_bits) - 1;
+	uint32_t decimals = 0;
+	for(int i=0; i < 6; i++)
+		{
+		fixed *= 10;
+		decimals = decimals*10 + (uint32_t) (fixed >> fraction_bits);
+		fixed &= mask;
+		}
+
+	const fixed_point half = (fixed_point) 1 << (fraction_bits - 1);
+	if( fixed > half || (fixed == half && (decimals & 1)) )
+		{
+		if( ++decimals == 1000000 )
+			{
+			decimals = 0;
+			integer++;
+			}
+		}
+
+	w = format_uint(integer, w);
+	*w++ = '.';
+	return format_padded(decimals, 6, w);
+#endif
+	}
+
+// format_shortest() finds the digits with Grisu3 (Florian Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010):
+// the double and the bounds of the interval that reads back as it are
+// scaled by a cached power of ten into 64 bit fixed point, and digits are
+// taken off until they fall inside the interval.  For the few doubles it
+// can't be sure about it gives up, and printf is tried at 15, 16 and 17
+// digits instead.
+
+// A 64 bit significand and a binary exponent.
+class DiyFp {
+	public:
+		DiyFp() { }
+		DiyFp(uint64_t f, int e) : f(f), e(e) { }
+
+		uint64_t f;
+		int e;
+};
+
+// The high 64 bits of the product, rounded.
+static DiyFp multiply(const DiyFp &x, const DiyFp &y)
+	{
+	const uint64_t mask = 0xffffffffULL;
+	uint64_t a = x.f >> 32, b = x.f & mask, c = y.f >> 32, d = y.f & mask;
+	uint64_t ac = a*c, bc = b*c, ad = a*d, bd = b*d;
+	uint64_t middle = (bd >> 32) + (ad & mask) + (bc & mask) + (1ULL << 31);
+	return DiyFp(ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64);
+	}
+
+static DiyFp normalize(DiyFp n)
+	{
+	while( !(n.f & 0xffc0000000000000ULL) )
+		{
+		n.f <<= 10;
+		n.e -= 10;
+		}
+	while( !(n.f & 0x8000000000000000ULL) )
+		{
+		n.f <<= 1;
+		n.e--;
+		}
+	return n;
+	}
+
+// 10^k for every eighth k from -348 to 340, normalized and rounded.
+class CachedPower {
+	public:
+		uint64_t f;
+		short e, k;
+};
+static const CachedPower cached_powers[] = {
+	{ 0xfa8fd5a0081c0288ULL, -1220, -348 }, { 0xbaaee17fa23ebf76ULL, -1193, -340 },
+	{ 0x8b16fb203055ac76ULL, -1166, -332 }, { 0xcf42894a5dce35eaULL, -1140, -324 },
+	{ 0x9a6bb0aa55653b2dULL, -1113, -316 }, { 0xe61acf033d1a45dfULL, -1087, -308 },
+	{ 0xab70fe17c79ac6caULL, -1060, -300 }, { 0xff77b1fcbebcdc4fULL, -1034, -292 },
+	{ 0xbe5691ef416bd60cULL, -1007, -284 }, { 0x8dd01fad907ffc3cULL, -980, -276 },
+	{ 0xd3515c2831559a83ULL, -954, -268 }, { 0x9d71ac8fada6c9b5ULL, -927, -260 },
+	{ 0xea9c227723ee8bcbULL, -901, -252 }, { 0xaecc49914078536dULL, -874, -244 },
+	{ 0x823c12795db6ce57ULL, -847, -236 }, { 0xc21094364dfb5637ULL, -821, -228 },
+	{ 0x9096ea6f3848984fULL, -794, -220 }, { 0xd77485cb25823ac7ULL, -768, -212 },
+	{ 0xa086cfcd97bf97f4ULL, -741, -204 }, { 0xef340a98172aace5ULL, -715, -196 },
+	{ 0xb23867fb2a35b28eULL, -688, -188 }, { 0x84c8d4dfd2c63f3bULL, -661, -180 },
+	{ 0xc5dd44271ad3cdbaULL, -635, -172 }, { 0x936b9fcebb25c996ULL, -608, -164 },
+	{ 0xdbac6c247d62a584ULL, -582, -156 }, { 0xa3ab66580d5fdaf6ULL, -555, -148 },
+	{ 0xf3e2f893dec3f126ULL, -529, -140 }, { 0xb5b5ada8aaff80b8ULL, -502, -132 },
+	{ 0x87625f056c7c4a8bULL, -475, -124 }, { 0xc9bcff6034c13053ULL, -449, -116 },
+	{ 0x964e858c91ba2655ULL, -422, -108 }, { 0xdff9772470297ebdULL, -396, -100 },
+	{ 0xa6dfbd9fb8e5b88fULL, -369, -92 }, { 0xf8a95fcf88747d94ULL, -343, -84 },
+	{ 0xb94470938fa89bcfULL, -316, -76 }, { 0x8a08f0f8bf0f156bULL, -289, -68 },
+	{ 0xcdb02555653131b6ULL, -263, -60 }, { 0x993fe2c6d07b7facULL, -236, -52 },
+	{ 0xe45c10c42a2b3b06ULL, -210, -44 }, { 0xaa242499697392d3ULL, -183, -36 },
+	{ 0xfd87b5f28300ca0eULL, -157, -28 }, { 0xbce5086492111aebULL, -130, -20 },
+	{ 0x8cbccc096f5088ccULL, -103, -12 }, { 0xd1b71758e219652cULL, -77, -4 },
+	{ 0x9c40000000000000ULL, -50, 4 }, { 0xe8d4a51000000000ULL, -24, 12 },
+	{ 0xad78ebc5ac620000ULL, 3, 20 }, { 0x813f3978f8940984ULL, 30, 28 },
+	{ 0xc097ce7bc90715b3ULL, 56, 36 }, { 0x8f7e32ce7bea5c70ULL, 83, 44 },
+	{ 0xd5d238a4abe98068ULL, 109, 52 }, { 0x9f4f2726179a2245ULL, 136, 60 },
+	{ 0xed63a231d4c4fb27ULL, 162, 68 }, { 0xb0de65388cc8ada8ULL, 189, 76 },
+	{ 0x83c7088e1aab65dbULL, 216, 84 }, { 0xc45d1df942711d9aULL, 242, 92 },
+	{ 0x924d692ca61be758ULL, 269, 100 }, { 0xda01ee641a708deaULL, 295, 108 },
+	{ 0xa26da3999aef774aULL, 322, 116 }, { 0xf209787bb47d6b85ULL, 348, 124 },
+	{ 0xb454e4a179dd1877ULL, 375, 132 }, { 0x865b86925b9bc5c2ULL, 402, 140 },
+	{ 0xc83553c5c8965d3dULL, 428, 148 }, { 0x952ab45cfa97a0b3ULL, 455, 156 },
+	{ 0xde469fbd99a05fe3ULL, 481, 164 }, { 0xa59bc234db398c25ULL, 508, 172 },
+	{ 0xf6c69a72a3989f5cULL, 534, 180 }, { 0xb7dcbf5354e9beceULL, 561, 188 },
+	{ 0x88fcf317f22241e2ULL, 588, 196 }, { 0xcc20ce9bd35c78a5ULL, 614, 204 },
+	{ 0x98165af37b2153dfULL, 641, 212 }, { 0xe2a0b5dc971f303aULL, 667, 220 },
+	{ 0xa8d9d1535ce3b396ULL, 694, 228 }, { 0xfb9b7cd9a4a7443cULL, 720, 236 },
+	{ 0xbb764c4ca7a44410ULL, 747, 244 }, { 0x8bab8eefb6409c1aULL, 774, 252 },
+	{ 0xd01fef10a657842cULL, 800, 260 }, { 0x9b10a4e5e9913129ULL, 827, 268 },
+	{ 0xe7109bfba19c0c9dULL, 853, 276 }, { 0xac2820d9623bf429ULL, 880, 284 },
+	{ 0x80444b5e7aa7cf85ULL, 907, 292 }, { 0xbf21e44003acdd2dULL, 933, 300 },
+	{ 0x8e679c2f5e44ff8fULL, 960, 308 }, { 0xd433179d9c8cb841ULL, 986, 316 },
+	{ 0x9e19db92b4e31ba9ULL, 1013, 324 }, { 0xeb96bf6ebadf77d9ULL, 1039, 332 },
+	{ 0xaf87023b9bf0ee6bULL, 1066, 340 },
+};
+
+// The products are lined up so that their exponent is from -60 to -32,
+// which leaves the integer part of each in 32 bits.
+static const int min_target_exponent = -60;
+
+// A cached power that scales a DiyFp with exponent e into that range, and
+// its decimal exponent.
+static int cached_power(int e, DiyFp &power)
+	{
+	int k = (int) ceil((min_target_exponent - e - 1) * 0.30102999566398114);
+	const CachedPower &c = cached_powers[(k + 347) / 8 + 1];
+	power = DiyFp(c.f, c.e);
+	return c.k;
+	}
+
+static const uint32_t powers_of_ten[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+// Move the last digit down while that gets closer to the double, and say
+// whether the digits are sure to be the closest that read back as it.
+static bool round_weed(char *digits, int length, uint64_t distance, uint64_t delta,
+                       uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+	{
+	uint64_t up = distance - unit, down = distance + unit;
+	while( rest < up && delta - rest >= ten_kappa &&
+	       (rest + ten_kappa < up || up - rest >= rest + ten_kappa - up) )
+		{
+		digits[length - 1]--;
+		rest += ten_kappa;
+		}
+	if( rest < down && delta - rest >= ten_kappa &&
+	    (rest + ten_kappa < down || down - rest > rest + ten_kappa - down) )
+		return false;
+	return 2*unit <= rest && rest <= delta - 4*unit;
+	}
+
+// The digits of the shortest number between low and high (exclusive),
+// which are scaled, with kappa set so that it is digits * 10^kappa.
+static bool generate_digits(DiyFp low, DiyFp w, DiyFp high, char *digits, int &length, int &kappa)
+	{
+	uint64_t unit = 1;
+	DiyFp too_low(low.f - unit, low.e), too_high(high.f + unit, high.e);
+	uint64_t unsafe = too_high.f - too_low.f;
+	DiyFp one(1ULL << -w.e, w.e);
+	uint32_t integer = (uint32_t) (too_high.f >> -one.e);
+	uint64_t fraction = too_high.f & (one.f - 1);
+
+	kappa = 1;
+	while( kappa < 10 && integer >= powers_of_ten[kappa] )
+		kappa++;
+	length = 0;
+
+	while( kappa > 0 )
+		{
+		uint32_t divisor = powers_of_ten[kappa - 1];
+		digits[length++] = '0' + integer / divisor;
+		integer %= divisor;
+		kappa--;
+		uint64_t rest = ((uint64_t) integer << -one.e) + fraction;
+		if( rest < unsafe )
+			return round_weed(digits, length, too_high.f - w.f, unsafe, rest,
+			                  (uint64_t) divisor << -one.e, unit);
+		}
+
+	for(;;)
+		{
+		fraction *= 10;
+		unit *= 10;
+		unsafe *= 10;
+		digits[length++] = '0' + (fraction >> -one.e);
+		fraction &= one.f - 1;
+		kappa--;
+		if( fraction < unsafe )
+			return round_weed(digits, length, (too_high.f - w.f) * unit, unsafe,
+			                  fraction, one.f, unit);
+		}
+	}
+
+// The shortest digits of a positive, finite value and the decimal exponent
+// of the last one, or false if Grisu3 couldn't tell.
+static bool grisu3(double value, char *digits, int &length, int &exponent)
+	{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	const uint64_t fraction_mask = 0x000fffffffffffffULL;
+	const uint64_t exponent_mask = 0x7ff0000000000000ULL;
+	DiyFp v;
+	if( bits & exponent_mask )
+		v = DiyFp((bits & fraction_mask) + (1ULL << 52), (int) ((bits & exponent_mask) >> 52) - 1075);
+	else
+		v = DiyFp(bits & fraction_mask, -1074);
+
+	// The bounds are halfway to the neighbouring doubles, and the lower
+	// neighbour is closer at a power of two.
+	DiyFp high = normalize(DiyFp((v.f << 1) + 1, v.e - 1));
+	DiyFp low;
+	if( !(bits & fraction_mask) && (bits & exponent_mask) )
+		low = DiyFp((v.f << 2) - 1, v.e - 2);
+	else
+		low = DiyFp((v.f << 1) - 1, v.e - 1);
+	low.f <<= low.e - high.e;
+	low.e = high.e;
+	DiyFp w = normalize(v);
+
+	DiyFp power;
+	int k = cached_power(w.e, power);
+	int kappa;
+	bool sure = generate_digits(multiply(low, power), multiply(w, power),
+	                            multiply(high, power), digits, length, kappa);
+	exponent = kappa - k;
+	return sure;
+	}
+
+// The same text as the first of "%.15g", "%.16g" and "%.17g" that reads
+// back as the value.
+static char* format_shortest_printf(double value, char *w)
+	{
+	char tmp[max_shortest_length];
+	int length = 0;
+
+	for(int precision=15; precision <= 17; precision++)
+		{
+		length = snprintf(tmp, sizeof(tmp), "%.*g", precision, value);
+		if( !isfinite(value) || strtod(tmp, NULL) == value )
+			break;
+		}
+	memcpy(w, tmp, length);
+	return w + length;
+	}
+
+char* format_shortest(double value, char *w)
+	{
+	if( !isfinite(value) )
+		return format_shortest_printf(value, w);
+
+	if( signbit(value) )
+		{
+		*w++ = '-';
+		value = -value;
+		}
+	if( value == 0 )
+		{
+		*w++ = '0';
+		return w;
+		}
+
+	char digits[20];
+	int length, exponent;
+	if( !grisu3(value, digits, length, exponent) )
+		return format_shortest_printf(value, w);
+
+	// Laid out as "%g" does at the precision printf would have needed:
+	// exponent notation for exponents below -4 or from the precision
+	// up, and no trailing zeros or point.
+	int point = length + exponent;
+	int precision = length > 15 ? length : 15;
+	if( point - 1 < -4 || point - 1 >= precision )
+		{
+		*w++ = digits[0];
+		if( length > 1 )
+			{
+			*w++ = '.';
+			memcpy(w, digits + 1, length - 1);
+			w += length - 1;
+			}
+		*w++ = 'e';
+		int e = point - 1;
+		*w++ = e < 0 ? '-' : '+';
+		return format_padded(e < 0 ? -e : e, 2, w);
+		}
+	if( point <= 0 )
+		{
+		*w++ = '0';
+		*w++ = '.';
+		for(int i=point; i < 0; i++)
+			*w++ = '0';
+		memcpy(w, digits, length);
+		return w + length;
+		}
+	if( point >= length )
+		{
+		memcpy(w, digits, length);
+		w += length;
+		for(int i=length; i < point; i++)
+			*w++ = '0';
+		return w;
+		}
+	memcpy(w, digits, point);
+	w += point;
+	*w++ = '.';
+	memcpy(w, digits + point, length - point);
+	return w + length - point;
+	}
+
+char* format_ipv4(uint32_t address, char *w)
+	{
+	const unsigned char *octets = (const unsigned char *) &address;
+	for(int i=0; i < 4; i++)
+		{
+		if( i > 0 )
+			*w++ = '.';
+		w = format_uint(octets[i], w);
+		}
+	return w;
+	}
@@ -0,0 +1,41 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+#include <float.h>
+
+// Number and address formatters for COPY text.  Each one writes straight
+// into the caller's buffer and returns a pointer just past what it wrote,
+// without a trailing '\0'.  They keep no state and never allocate, so the
+// writer threads can all use them at once.
+
+// Room for any int64_t or uint64_t in decimal.
+static const int max_int_length = 20;
+
+// Room for any double from format_fixed() or format_shortest().
+static const int max_fixed_length = DBL_MAX_10_EXP + 12;
+static const int max_shortest_length = 32;
+
+// Room for a dotted quad.
+static const int max_ipv4_length = 15;
+
+char* format_int(int64_t value, char *w);
+char* format_uint(uint64_t value, char *w);
+
+// value in decimal, zero padded to at least width digits.
+char* format_padded(uint64_t value, int width, char *w);
+
+// The same text as printf's "%f": fixed notation, rounded to six decimals
+// by the exact binary value with ties to even.
+char* format_fixed(double value, char *w);
+
+// The fewest significant digits that read back as the same double, in
+// printf's "%g" notation at 15 digits or, if it needs more, at as many as
+// it needs.  That is the same text as the first of "%.15g", "%.16g" and
+// "%.17g" that reads back, except for subnormals, which come out shorter.
+char* format_shortest(double value, char *w);
+
+// An IPv4 address in network byte order, as inet_ntoa() writes it.
+char* format_ipv4(uint32_t address, char *w);
+
+#endif
@@ -0,0 +1,144 @@
+// bro-dblogger-check - Checks the number and address formatters against
+// the printf and inet_ntoa output that COPY text used to be made with.
+//
+// Run by "make check".  Every value is formatted both ways, and the check
+// fails if any of them comes out differently.  format_shortest() is held
+// to the first of "%.15g", "%.16g" and "%.17g" that reads back, except for
+// subnormals, where it only has to read back and be no longer.
+
+#include <string>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include "format.h"
+
+using namespace std;
+
+static unsigned int seed = 1;
+
+static int random_below(int n)
+	{
+	return rand_r(&seed) % n;
+	}
+
+static double random_bits_double(void)
+	{
+	uint64_t bits = ((uint64_t) rand_r(&seed) << 42) ^ ((uint64_t) rand_r(&seed) << 21) ^ rand_r(&seed);
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+	}
+
+// What format_shortest() used to write.
+static std::string printf_shortest(double value)
+	{
+	char text[max_shortest_length];
+	for(int precision=15; precision <= 17; precision++)
+		{
+		snprintf(text, sizeof(text), "%.*g", precision, value);
+		if( !isfinite(value) || strtod(text, NULL) == value )
+			break;
+		}
+	return text;
+	}
+
+class FormatCheck {
+	public:
+		FormatCheck() : values(0), failures(0) { }
+
+		void compare(const char *what, const std::string &expected, const char *start, const char *end)
+			{
+			values++;
+			if( expected == std::string(start, end - start) )
+				return;
+			if( failures++ < 10 )
+				cerr << what << ": expected \"" << expected << "\" but got \""
+				     << std::string(start, end - start) << "\"" << endl;
+			}
+
+		void check_int(int64_t value)
+			{
+			char expected[32], out[max_int_length];
+			snprintf(expected, sizeof(expected), "%lld", (long long) value);
+			compare("int", expected, out, format_int(value, out));
+			if( value >= 0 )
+				compare("uint", expected, out, format_uint(value, out));
+			}
+
+		void check_double(double value)
+			{
+			char expected[max_fixed_length], out[max_fixed_length];
+			snprintf(expected, sizeof(expected), "%f", value);
+			compare("fixed", expected, out, format_fixed(value, out));
+
+			char *end = format_shortest(value, out);
+			if( !isfinite(value) || fabs(value) >= DBL_MIN || value == 0 )
+				{
+				compare("shortest", printf_shortest(value), out, end);
+				return;
+				}
+
+			values++;
+			*end = '\0';
+			if( (strtod(out, NULL) != value || strlen(out) > printf_shortest(value).size()) &&
+			    failures++ < 10 )
+				cerr << "shortest: " << out << " isn't the shortest text that reads back as "
+				     << printf_shortest(value) << endl;
+			}
+
+		void check_address(uint32_t value)
+			{
+			struct in_addr ip;
+			char out[max_ipv4_length];
+			ip.s_addr = value;
+			compare("ipv4", inet_ntoa(ip), out, format_ipv4(value, out));
+			}
+
+		uint64_t values, failures;
+};
+
+int main(int argc, char **argv)
+	{
+	FormatCheck check;
+
+	static const double doubles[] = {
+		0.0, -0.0, 0.5, 1.0, -1.0, 0.0000005, 0.0000015, 0.0000025, 1.0/128,
+		3.0/128, 0.9999995, 9.9999995, 999999.9999995, 0.1, 0.3, 1e-7, 5e-7,
+		1e-5, 1e-4, 1e14, 1e15, 1e16, 1e17, 123456789012345678.0, 1e-300,
+		4.9e-324, 2.2250738585072014e-308, 2.2250738585072009e-308,
+		1e15 + 0.5, 9007199254740993.0, 9223372036854775807.0,
+		-9223372036854775808.0, 1e19, 1e21, 1e22, 1e23, 1e300, DBL_MAX,
+		-DBL_MAX, HUGE_VAL, -HUGE_VAL, NAN, 1200000000.123456,
+		1699999999.9999995, 5e-324, 1.7976931348623157e308
+	};
+	for(size_t i=0; i < sizeof(doubles) / sizeof(doubles[0]); i++)
+		check.check_double(doubles[i]);
+
+	static const int64_t ints[] = {
+		0, 1, 9, 10, 99, 100, 65535, INT_MAX, INT_MIN, UINT_MAX,
+		INT64_MAX, INT64_MIN
+	};
+	for(size_t i=0; i < sizeof(ints) / sizeof(ints[0]); i++)
+		check.check_int(ints[i]);
+
+	for(int i=0; i < 200000; i++)
+		{
+		check.check_int((int) rand_r(&seed) - RAND_MAX / 2);
+		check.check_double(random_bits_double());
+		// Times like the ones Bro sends, to the microsecond and between.
+		check.check_double(1200000000.0 + random_below(100000000) + rand_r(&seed) / (double) RAND_MAX);
+		check.check_double((rand_r(&seed) - RAND_MAX / 2) / 1000000.0);
+		// Short decimals, which have many digits to take off.
+		check.check_double(random_below(1000000) / pow(10.0, random_below(30) - 10));
+		check.check_address(((uint32_t) rand_r(&seed) << 16) ^ rand_r(&seed));
+		}
+
+	printf("%llu values formatted, %llu different\n",
+	       (unsigned long long) check.values, (unsigned long long) check.failures);
+	return check.failures ? 1 : 0;
+	}
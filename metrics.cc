@@ -0,0 +1,335 @@
+#include <iostream>
+#include <map>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bro-dblogger.h"
+#include "metrics.h"
+
+using namespace std;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, TableMetrics*> tables;
+static std::map<std::string, PeerMetrics*> peers;
+static std::map<int, WriterMetrics*> writers;
+static time_t start_time = time((time_t *)NULL);
+
+uint64_t monotonic_usec(void)
+	{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+void Histogram::record(uint64_t value)
+	{
+	int bucket = value ? 64 - __builtin_clzll(value) : 0;
+	if( bucket >= BUCKETS )
+		bucket = BUCKETS - 1;
+	buckets[bucket].add();
+	count.add();
+	sum.add(value);
+	}
+
+static void append_uint(std::string &out, uint64_t value)
+	{
+	char number[24];
+	snprintf(number, sizeof(number), "%llu", (unsigned long long) value);
+	out.append(number);
+	}
+
+static void append_field(std::string &out, const char *name, uint64_t value, bool last=false)
+	{
+	out.append("\"");
+	out.append(name);
+	out.append("\": ");
+	append_uint(out, value);
+	if( !last )
+		out.append(", ");
+	}
+
+static void append_name(std::string &out, const std::string &name)
+	{
+	out.append("\"");
+	for(size_t i=0; i < name.size(); i++)
+		{
+		unsigned char c = name[i];
+		if( c == '"' || c == '\\' )
+			out.push_back('\\');
+		if( c < 0x20 )
+			out.push_back('?');
+		else
+			out.push_back(c);
+		}
+	out.append("\": ");
+	}
+
+uint64_t Histogram::percentile(int percent) const
+	{
+	uint64_t counts[BUCKETS];
+	uint64_t total = 0;
+	for(int i=0; i < BUCKETS; i++)
+		total += counts[i] = buckets[i].get();
+
+	uint64_t seen = 0;
+	for(int i=0; i < BUCKETS && total; i++)
+		{
+		seen += counts[i];
+		if( seen * 100 >= total * percent )
+			return (uint64_t) 1 << i;
+		}
+	return 0;
+	}
+
+void Histogram::write_json(std::string &out) const
+	{
+	static const int percentiles[] = { 50, 90, 99, 100 };
+	static const char *names[] = { "p50", "p90", "p99", "max" };
+
+	out.append("{");
+	append_field(out, "count", count.get());
+	append_field(out, "sum", sum.get());
+	for(int p=0; p < 4; p++)
+		append_field(out, names[p], percentile(percentiles[p]), p == 3);
+	out.append("}");
+	}
+
+TableMetrics* table_metrics(const std::string &table)
+	{
+	pthread_mutex_lock(&registry_lock);
+	TableMetrics *&metrics = tables[table];
+	if( !metrics )
+		metrics = new TableMetrics;
+	pthread_mutex_unlock(&registry_lock);
+	return metrics;
+	}
+
+PeerMetrics* peer_metrics(const std::string &peer)
+	{
+	pthread_mutex_lock(&registry_lock);
+	PeerMetrics *&metrics = peers[peer];
+	if( !metrics )
+		metrics = new PeerMetrics;
+	pthread_mutex_unlock(&registry_lock);
+	return metrics;
+	}
+
+WriterMetrics* writer_metrics(int writer)
+	{
+	pthread_mutex_lock(&registry_lock);
+	WriterMetrics *&metrics = writers[writer];
+	if( !metrics )
+		metrics = new WriterMetrics;
+	pthread_mutex_unlock(&registry_lock);
+	return metrics;
+	}
+
+std::string metrics_json(void)
+	{
+	std::string out;
+	time_t now_time = time((time_t *)NULL);
+
+	pthread_mutex_lock(&registry_lock);
+	out.append("{");
+	append_field(out, "time", now_time);
+	append_field(out, "uptime", now_time - start_time);
+
+	out.append("\"peers\": {");
+	map<string,PeerMetrics*>::iterator p;
+	for( p = peers.begin(); p != peers.end(); p++ )
+		{
+		if( p != peers.begin() )
+			out.append(", ");
+		append_name(out, p->first);
+		out.append("{");
+		append_field(out, "events", p->second->events.get());
+		append_field(out, "connected", p->second->connected.get());
+		append_field(out, "reconnects", p->second->reconnects.get(), true);
+		out.append("}");
+		}
+
+	out.append("}, \"writers\": [");
+	map<int,WriterMetrics*>::iterator w;
+	for( w = writers.begin(); w != writers.end(); w++ )
+		{
+		if( w != writers.begin() )
+			out.append(", ");
+		out.append("{");
+		append_field(out, "queued_jobs", w->second->queued_jobs.get());
+		append_field(out, "connections", w->second->connections.get());
+		append_field(out, "busy_connections", w->second->busy_connections.get(), true);
+		out.append("}");
+		}
+
+	out.append("], \"tables\": {");
+	map<string,TableMetrics*>::iterator t;
+	for( t = tables.begin(); t != tables.end(); t++ )
+		{
+		TableMetrics *m = t->second;
+		if( t != tables.begin() )
+			out.append(", ");
+		append_name(out, t->first);
+		out.append("{");
+		append_field(out, "filtered_rows", m->filtered_rows.get());
+		append_field(out, "sampled_out_rows", m->sampled_out_rows.get());
+		append_field(out, "rolled_up_rows", m->rolled_up_rows.get());
+		append_field(out, "queued_rows", m->queued_rows.get());
+		append_field(out, "queued_bytes", m->queued_bytes.get());
+		append_field(out, "backpressure", m->backpressure.get());
+		append_field(out, "rows", m->rows.get());
+		append_field(out, "bytes", m->bytes.get());
+		append_field(out, "encode_usec", m->encode_usec.get());
+		append_field(out, "rejected_rows", m->rejected_rows.get());
+		append_field(out, "dropped_rows", m->dropped_rows.get());
+		append_field(out, "spooled_rows", m->spooled_rows.get());
+		append_field(out, "replayed_rows", m->replayed_rows.get());
+		append_field(out, "pending_rows", m->pending_rows.get());
+		append_field(out, "pending_bytes", m->pending_bytes.get());
+		uint64_t hits = m->string_cache_hits.get();
+		uint64_t misses = m->string_cache_misses.get();
+		append_field(out, "string_cache_hits", hits);
+		append_field(out, "string_cache_misses", misses);
+		append_field(out, "string_cache_hit_percent", hits + misses ? hits * 100 / (hits + misses) : 0);
+		append_field(out, "files", m->files.get());
+		out.append("\"put_usec\": ");
+		m->put_usec.write_json(out);
+		out.append(", \"commit_usec\": ");
+		m->commit_usec.write_json(out);
+		out.append(", \"commit_rows\": ");
+		m->commit_rows.write_json(out);
+		out.append("}");
+		}
+	out.append("}}");
+	pthread_mutex_unlock(&registry_lock);
+	return out;
+	}
+
+static bool write_all(int fd, const std::string &data)
+	{
+	size_t done = 0;
+	while( done < data.size() )
+		{
+		ssize_t n = write(fd, data.data() + done, data.size() - done);
+		if( n < 0 && errno == EINTR )
+			continue;
+		if( n <= 0 )
+			return false;
+		done += n;
+		}
+	return true;
+	}
+
+// Written to a temporary file and renamed over the old one, so that
+// readers never see half of it.
+void write_metrics_file(void)
+	{
+	if( metrics_file.empty() )
+		return;
+
+	std::string tmp = metrics_file + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if( !f )
+		{
+		cerr << "Could not write metrics to " << tmp << ": " << strerror(errno) << endl;
+		return;
+		}
+	std::string json = metrics_json();
+	json.push_back('\n');
+	bool written = fwrite(json.data(), 1, json.size(), f) == json.size();
+	if( fclose(f) != 0 || !written || rename(tmp.c_str(), metrics_file.c_str()) != 0 )
+		cerr << "Could not write metrics to " << metrics_file << ": " << strerror(errno) << endl;
+	}
+
+static int listen_metrics_socket(void)
+	{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if( metrics_socket.size() >= sizeof(addr.sun_path) )
+		{
+		cerr << "The metrics socket path is too long." << endl;
+		exit(-1);
+		}
+	strcpy(addr.sun_path, metrics_socket.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	unlink(metrics_socket.c_str());
+	if( fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	    listen(fd, 8) != 0 )
+		{
+		cerr << "Could not listen on the metrics socket " << metrics_socket
+		     << ": " << strerror(errno) << endl;
+		exit(-1);
+		}
+	return fd;
+	}
+
+// Every connection to the socket gets one JSON object and is closed.
+static void *metrics_thread(void *arg)
+	{
+	int listen_fd = (int) (intptr_t) arg;
+	time_t next_dump = time((time_t *)NULL) + metrics_interval;
+
+	for(;;)
+		{
+		int timeout = -1;
+		if( !metrics_file.empty() )
+			{
+			time_t now_time = time((time_t *)NULL);
+			if( now_time >= next_dump )
+				{
+				write_metrics_file();
+				next_dump = now_time + metrics_interval;
+				}
+			timeout = (next_dump - now_time) * 1000;
+			}
+
+		struct pollfd pfd;
+		pfd.fd = listen_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if( poll(&pfd, listen_fd >= 0 ? 1 : 0, timeout) <= 0 )
+			continue;
+
+		int client = accept(listen_fd, NULL, NULL);
+		if( client < 0 )
+			continue;
+		// A client that doesn't read can't hold the thread up for long.
+		struct timeval send_timeout = { 1, 0 };
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+		std::string json = metrics_json();
+		json.push_back('\n');
+		write_all(client, json);
+		close(client);
+		}
+	return NULL;
+	}
+
+void start_metrics(void)
+	{
+	if( metrics_socket.empty() && metrics_file.empty() )
+		return;
+
+	int listen_fd = metrics_socket.empty() ? -1 : listen_metrics_socket();
+
+	// Signals are only handled by the Broccoli thread.
+	sigset_t all, old;
+	pthread_t thread;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if( pthread_create(&thread, NULL, metrics_thread, (void *) (intptr_t) listen_fd) != 0 )
+		{
+		cerr << "Could not start the metrics thread." << endl;
+		exit(-1);
+		}
+	pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
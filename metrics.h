@@ -0,0 +1,110 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <stdint.h>
+
+// Statistics are updated by the thread that owns what they describe and
+// read by whoever asks for them, so every value is a relaxed atomic: no
+// locks and no ordering, just no torn reads.
+class Counter {
+	public:
+		Counter() : value(0) { }
+
+		void add(uint64_t n=1) { __atomic_fetch_add(&value, n, __ATOMIC_RELAXED); }
+		void sub(uint64_t n=1) { __atomic_fetch_sub(&value, n, __ATOMIC_RELAXED); }
+		void set(uint64_t n) { __atomic_store_n(&value, n, __ATOMIC_RELAXED); }
+		uint64_t get() const { return __atomic_load_n(&value, __ATOMIC_RELAXED); }
+
+	private:
+		uint64_t value;
+};
+
+// Counts values in power of two buckets: bucket i holds the values below
+// 2^i that didn't fit in bucket i-1.  Percentiles are reported as the
+// upper bound of their bucket.
+class Histogram {
+	public:
+		enum { BUCKETS = 40 };
+
+		void record(uint64_t value);
+		void write_json(std::string &out) const;
+
+		// The bucket bound below which percent of the values fell.
+		uint64_t percentile(int percent) const;
+
+	private:
+		Counter buckets[BUCKETS];
+		Counter count, sum;
+};
+
+// Kept by the writer that owns the table, except for the rows that were
+// filtered out and the backpressure level, which the Broccoli thread
+// keeps, and the queued rows, which both of them count.
+class TableMetrics {
+	public:
+		// Rows of a table that isn't wanted, and rows that sampling left
+		// out.
+		Counter filtered_rows, sampled_out_rows;
+
+		// Rows that were summed up into the rows of a rollup.
+		Counter rolled_up_rows;
+
+		// Rows handed to a writer that it hasn't encoded yet, and their
+		// size as decoded.
+		Counter queued_rows, queued_bytes;
+
+		// The last backpressure level sent to Bro for the table.
+		Counter backpressure;
+
+		// Rows and bytes encoded, and the time spent encoding them.
+		Counter rows, bytes, encode_usec;
+
+		// Rows in COPYs the server rejected, rows that were thrown away,
+		// and rows that went to and came back from the spool.
+		Counter rejected_rows, dropped_rows, spooled_rows, replayed_rows;
+
+		// Encoded rows waiting for a COPY.
+		Counter pending_rows, pending_bytes;
+
+		// Strings found in the table's escaped string cache, and strings
+		// that had to be escaped.
+		Counter string_cache_hits, string_cache_misses;
+
+		// COPY files that the file sink closed.
+		Counter files;
+
+		// Time spent in each PQputCopyData call (or write of a COPY
+		// file), time from PQputCopyEnd until the server acknowledged the
+		// COPY, and rows per COPY (or file).
+		Histogram put_usec, commit_usec, commit_rows;
+};
+
+// Kept by the Broccoli thread.
+class PeerMetrics {
+	public:
+		Counter events, connected, reconnects;
+};
+
+class WriterMetrics {
+	public:
+		Counter queued_jobs, connections, busy_connections;
+};
+
+// The statistics for a table, peer or writer thread, made the first time
+// they are asked for.  They are never freed, so the pointers can be kept.
+TableMetrics* table_metrics(const std::string &table);
+PeerMetrics* peer_metrics(const std::string &peer);
+WriterMetrics* writer_metrics(int writer);
+
+// Everything as one JSON object.
+std::string metrics_json(void);
+
+// Start serving metrics_json() on the metrics socket and writing it to
+// the metrics file, if either is set.
+void start_metrics(void);
+void write_metrics_file(void);
+
+uint64_t monotonic_usec(void);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "partition.h"
+
+using namespace std;
+
+bool parse_partition_rule(const std::string &spec, std::string &table, PartitionRule &rule)
+	{
+	size_t second = spec.rfind(':');
+	if( second == std::string::npos || second == 0 )
+		return false;
+	size_t first = spec.rfind(':', second - 1);
+	if( first == std::string::npos || first == 0 || first + 1 == second )
+		return false;
+
+	table = spec.substr(0, first);
+	rule.field = spec.substr(first + 1, second - first - 1);
+
+	std::string interval = spec.substr(second + 1);
+	if( interval == "hourly" )
+		rule.interval = 3600;
+	else if( interval == "daily" )
+		rule.interval = 86400;
+	else
+		{
+		char *end;
+		rule.interval = strtol(interval.c_str(), &end, 10);
+		if( *end || rule.interval < 60 )
+			return false;
+		}
+	return true;
+	}
+
+time_t partition_start(double value, const PartitionRule &rule)
+	{
+	return (time_t) floor(value / rule.interval) * rule.interval;
+	}
+
+// The parent's name followed by the start of the partition in UTC, to the
+// precision that the interval needs.
+static std::string partition_name(const std::string &parent, long interval, time_t start)
+	{
+	const char *format = "_%Y%m%d%H%M%S";
+	if( interval % 86400 == 0 )
+		format = "_%Y%m%d";
+	else if( interval % 3600 == 0 )
+		format = "_%Y%m%d%H";
+	else if( interval % 60 == 0 )
+		format = "_%Y%m%d%H%M";
+
+	struct tm tm;
+	char suffix[32];
+	gmtime_r(&start, &tm);
+	strftime(suffix, sizeof(suffix), format, &tm);
+	return parent + suffix;
+	}
+
+static std::string sql_literal(const std::string &value)
+	{
+	std::string quoted = "'";
+	for(size_t i=0; i < value.size(); i++)
+		{
+		if( value[i] == '\'' )
+			quoted.push_back('\'');
+		quoted.push_back(value[i]);
+		}
+	quoted.push_back('\'');
+	return quoted;
+	}
+
+static std::string partition_values(const std::string &name, time_t start, time_t end)
+	{
+	char bounds[64];
+	snprintf(bounds, sizeof(bounds), ", %ld, %ld)", (long) start, (long) end);
+	return "(" + sql_literal(name) + bounds;
+	}
+
+Partition::Partition(const std::string &parent_table, const PartitionRule &rule, time_t partition_start)
+	: parent(parent_table), key(rule.field), start(partition_start), end(partition_start + rule.interval)
+	{
+	name = partition_name(parent, rule.interval, start);
+
+	// Unquoted column names in the COPY are folded to lower case.
+	for(size_t c=0; c < key.size(); c++)
+		key[c] = tolower(key[c]);
+
+	// The bounds are written in whatever type the key column has, which
+	// only the server knows.
+	create_query =
+		"DO $dblog$\n"
+		"DECLARE\n"
+		"	parent regclass := " + sql_literal(parent) + "::regclass;\n"
+		"	partitioned boolean;\n"
+		"	key_type regtype;\n"
+		"	part text;\n"
+		"	lo float8;\n"
+		"	hi float8;\n"
+		"	lo_bound text;\n"
+		"	hi_bound text;\n"
+		"BEGIN\n"
+		"	SELECT c.relkind = 'p' INTO partitioned FROM pg_class c WHERE c.oid = parent;\n"
+		"	SELECT a.atttypid::regtype INTO key_type FROM pg_attribute a\n"
+		"		WHERE a.attrelid = parent AND a.attname = " + sql_literal(key) + " AND NOT a.attisdropped;\n"
+		"	FOR part, lo, hi IN SELECT * FROM (VALUES " +
+			partition_values(name, start, end) + ", " +
+			partition_values(partition_name(parent, rule.interval, end), end, end + rule.interval) +
+			") AS v LOOP\n"
+		"		CONTINUE WHEN to_regclass(part) IS NOT NULL;\n"
+		"		IF key_type = 'timestamp with time zone'::regtype THEN\n"
+		"			lo_bound := quote_literal(to_timestamp(lo));\n"
+		"			hi_bound := quote_literal(to_timestamp(hi));\n"
+		"		ELSIF key_type = 'timestamp without time zone'::regtype THEN\n"
+		"			lo_bound := quote_literal(to_timestamp(lo) AT TIME ZONE 'UTC');\n"
+		"			hi_bound := quote_literal(to_timestamp(hi) AT TIME ZONE 'UTC');\n"
+		"		ELSE\n"
+		"			lo_bound := lo::text;\n"
+		"			hi_bound := hi::text;\n"
+		"		END IF;\n"
+		"		IF partitioned THEN\n"
+		"			EXECUTE format('CREATE TABLE IF NOT EXISTS %s PARTITION OF %s FOR VALUES FROM (%s) TO (%s)',\n"
+		"			               part, parent, lo_bound, hi_bound);\n"
+		"		ELSE\n"
+		"			EXECUTE format('CREATE TABLE IF NOT EXISTS %s (CHECK (%I >= %s AND %I < %s)) INHERITS (%s)',\n"
+		"			               part, " + sql_literal(key) + ", lo_bound, " + sql_literal(key) + ", hi_bound, parent);\n"
+		"		END IF;\n"
+		"	END LOOP;\n"
+		"END\n"
+		"$dblog$";
+	}
@@ -0,0 +1,40 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <string>
+#include <time.h>
+
+// How rows of a table are split into time partitions: by the value of
+// field, in intervals of that many seconds counted from the epoch.
+class PartitionRule {
+	public:
+		std::string field;
+		long interval;
+};
+
+// Parse "table:field:interval", where interval is "hourly", "daily" or a
+// number of seconds.  Returns false if the rule can't be read.
+bool parse_partition_rule(const std::string &spec, std::string &table, PartitionRule &rule);
+
+// One partition of a table.  Rows are COPYed straight into it, so the
+// server doesn't have to route them.
+class Partition {
+	public:
+		Partition(const std::string &parent, const PartitionRule &rule, time_t start);
+
+		std::string parent, key;
+		time_t start, end;
+		std::string name;
+
+		// Statements that create the partition, and the one after it so
+		// that it is there before its first row arrives.  Declarative
+		// partitioning is used if the parent is a partitioned table and
+		// inheritance with a CHECK constraint otherwise.  Partitions that
+		// already exist are left alone.
+		std::string create_query;
+};
+
+// The start of the interval that value falls into.
+time_t partition_start(double value, const PartitionRule &rule);
+
+#endif
@@ -0,0 +1,272 @@
+#include <iostream>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <netdb.h>
+
+#include "peers.h"
+
+using namespace std;
+
+// Seconds between connection attempts to a lost peer, doubling after each
+// failure up to the maximum.
+static const int min_retry_delay = 1;
+static const int max_retry_delay = 30;
+
+// How long a probe connect may take before the peer counts as down.
+static const int probe_timeout = 10;
+
+BroPeers::BroPeers()
+	{
+	if( (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 )
+		{
+		cerr << "Could not create the epoll instance: " << strerror(errno) << endl;
+		exit(-1);
+		}
+	}
+
+BroPeers::~BroPeers()
+	{
+	for(size_t i=0; i < peers.size(); i++)
+		{
+		BroPeer *peer = peers[i];
+		if( peer->state == BroPeer::PROBING )
+			close(peer->fd);
+		if( !bro_conn_delete(peer->bc) )
+			cerr << "There was a problem shutting down the Bro connection to "
+			     << peer->host << ":" << peer->port << "." << endl;
+		delete peer;
+		}
+	close(epoll_fd);
+	}
+
+BroPeer* BroPeers::add(const std::string &host, const std::string &port)
+	{
+	BroPeer *peer = new BroPeer;
+	peer->host = host;
+	peer->port = port;
+	peer->state = BroPeer::DOWN;
+	peer->fd = -1;
+	peer->retry_at = 0;
+	peer->retry_delay = min_retry_delay;
+	peer->ever_connected = false;
+	peer->metrics = peer_metrics(host + ":" + port);
+
+	if (! (peer->bc = bro_conn_new_str( (host + ":" + port).c_str(), BRO_CFLAG_NONE)))
+		{
+		cerr << endl << "Could not connect to Bro (" << host << ") at " <<
+		        host << ":" << port << endl;
+		exit(-1);
+		}
+
+	// Resolved once, so that probing never waits on DNS.
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	if( error != 0 )
+		{
+		cerr << "Could not resolve Bro host " << host << ": " << gai_strerror(error) << endl;
+		exit(-1);
+		}
+	memcpy(&peer->addr, res->ai_addr, res->ai_addrlen);
+	peer->addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	peers.push_back(peer);
+	return peer;
+	}
+
+void BroPeers::watch(BroPeer *peer, unsigned watch_events)
+	{
+	struct epoll_event ev;
+	ev.events = watch_events;
+	ev.data.ptr = peer;
+	if( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, peer->fd, &ev) != 0 )
+		cerr << "Could not watch the socket for Bro at " << peer->host << ":"
+		     << peer->port << ": " << strerror(errno) << endl;
+	}
+
+void BroPeers::unwatch(BroPeer *peer)
+	{
+	// Broccoli may already have closed its socket, which takes it out of
+	// the epoll set by itself.
+	if( peer->fd >= 0 )
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, peer->fd, NULL);
+	}
+
+void BroPeers::start_probe(BroPeer *peer, time_t now_time)
+	{
+	peer->fd = socket(peer->addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if( peer->fd < 0 )
+		{
+		cerr << "Could not create a socket to probe Bro: " << strerror(errno) << endl;
+		retry_later(peer, now_time, 0);
+		return;
+		}
+
+	peer->state = BroPeer::PROBING;
+	peer->retry_at = now_time + probe_timeout;
+	if( connect(peer->fd, (struct sockaddr *) &peer->addr, peer->addr_len) == 0 )
+		{
+		// Finished right away, as on the loopback.
+		close(peer->fd);
+		peer->fd = -1;
+		peer->state = BroPeer::DOWN;
+		connect_peer(peer, now_time);
+		}
+	else if( errno != EINPROGRESS )
+		{
+		int error = errno;
+		close(peer->fd);
+		peer->fd = -1;
+		peer->state = BroPeer::DOWN;
+		retry_later(peer, now_time, error);
+		}
+	else
+		watch(peer, EPOLLOUT);
+	}
+
+// The probe connect finished or timed out.  If the Bro port took it,
+// let Broccoli connect for real.
+void BroPeers::end_probe(BroPeer *peer, time_t now_time, bool timed_out)
+	{
+	int error = ETIMEDOUT;
+	if( !timed_out )
+		{
+		socklen_t len = sizeof(error);
+		if( getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 )
+			error = errno;
+		}
+
+	unwatch(peer);
+	close(peer->fd);
+	peer->fd = -1;
+	peer->state = BroPeer::DOWN;
+
+	if( error != 0 )
+		retry_later(peer, now_time, error);
+	else
+		connect_peer(peer, now_time);
+	}
+
+void BroPeers::retry_later(BroPeer *peer, time_t now_time, int error)
+	{
+	if( error && verbose_output )
+		cerr << "Bro at " << peer->host << ":" << peer->port
+		     << " is unreachable (" << strerror(error) << "); retrying in "
+		     << peer->retry_delay << "s." << endl;
+	peer->retry_at = now_time + peer->retry_delay;
+	peer->retry_delay = min(peer->retry_delay * 2, max_retry_delay);
+	}
+
+void BroPeers::connect_peer(BroPeer *peer, time_t now_time)
+	{
+	bool connected;
+
+	if( peer->ever_connected )
+		{
+		cerr << "Bro connection to " << peer->host << ":" << peer->port
+		     << " is lost; reconnecting...";
+		connected = bro_conn_reconnect(peer->bc);
+		cerr << (connected ? "done." : "failed!") << endl;
+		if( connected )
+			peer->metrics->reconnects.add();
+		}
+	else
+		{
+		connected = bro_conn_connect(peer->bc);
+		if( connected )
+			{
+			bro_event_registry_request(peer->bc);
+			if(verbose_output)
+				cerr << "Connected to Bro (" << peer->host << ") at " <<
+				        peer->host << ":" << peer->port << endl;
+			}
+		else
+			cerr << endl << "Could not connect to Bro at " << peer->host
+			     << ":" << peer->port << endl;
+		}
+
+	if( !connected )
+		{
+		retry_later(peer, now_time, 0);
+		return;
+		}
+
+	peer->ever_connected = true;
+	peer->retry_delay = min_retry_delay;
+	peer->state = BroPeer::CONNECTED;
+	peer->metrics->connected.set(1);
+	peer->fd = bro_conn_get_fd(peer->bc);
+	watch(peer, EPOLLIN);
+
+	// The handshake may have brought events along with it.
+	bro_conn_process_input(peer->bc);
+	}
+
+void BroPeers::lost(BroPeer *peer, time_t now_time)
+	{
+	unwatch(peer);
+	peer->fd = -1;
+	peer->state = BroPeer::DOWN;
+	peer->metrics->connected.set(0);
+	peer->retry_at = now_time;
+	}
+
+void BroPeers::process(int timeout_ms)
+	{
+	time_t now_time = time((time_t *)NULL);
+	for(size_t i=0; i < peers.size(); i++)
+		{
+		BroPeer *peer = peers[i];
+		if( peer->state == BroPeer::DOWN && now_time >= peer->retry_at )
+			start_probe(peer, now_time);
+		else if( peer->state == BroPeer::PROBING && now_time >= peer->retry_at )
+			end_probe(peer, now_time, true);
+		}
+
+	events.resize(peers.size() ? peers.size() : 1);
+	int ready = epoll_wait(epoll_fd, &events[0], events.size(), timeout_ms);
+	if( ready < 0 )
+		{
+		if( errno != EINTR )
+			cerr << "epoll_wait failed: " << strerror(errno) << endl;
+		ready = 0;
+		}
+
+	now_time = time((time_t *)NULL);
+	for(int i=0; i < ready; i++)
+		{
+		BroPeer *peer = (BroPeer *) events[i].data.ptr;
+		if( peer->state == BroPeer::CONNECTED )
+			bro_conn_process_input(peer->bc);
+		else if( peer->state == BroPeer::PROBING )
+			end_probe(peer, now_time, false);
+		}
+
+	for(size_t i=0; i < peers.size(); i++)
+		{
+		BroPeer *peer = peers[i];
+		if( peer->state != BroPeer::CONNECTED )
+			continue;
+
+		// Input is always processed on a timeout as well, and a peer
+		// that went away is noticed here.
+		if( !ready )
+			bro_conn_process_input(peer->bc);
+		if( !bro_conn_alive(peer->bc) )
+			lost(peer, now_time);
+		}
+	}
+
+void BroPeers::send(BroEvent *ev)
+	{
+	for(size_t i=0; i < peers.size(); i++)
+		{
+		if( peers[i]->state == BroPeer::CONNECTED )
+			bro_event_send(peers[i]->bc, ev);
+		}
+	}
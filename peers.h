@@ -0,0 +1,81 @@
+#ifndef PEERS_H
+#define PEERS_H
+
+#include <string>
+#include <vector>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "bro-dblogger.h"
+#include "metrics.h"
+
+// A Bro instance that db_log events are received from.
+class BroPeer {
+	public:
+		enum State {
+			DOWN,		// waiting until retry_at to connect again
+			PROBING,	// non-blocking test connect to the Bro port
+			CONNECTED
+		};
+
+		std::string host, port;
+		BroConn *bc;
+		State state;
+
+		// Broccoli's socket while connected, the probe socket while
+		// probing and -1 otherwise.
+		int fd;
+
+		// When the next connection attempt is due (or, while probing,
+		// when the probe is given up), and how long to wait after the
+		// next failure.
+		time_t retry_at;
+		int retry_delay;
+
+		bool ever_connected;
+		PeerMetrics *metrics;
+
+		struct sockaddr_storage addr;
+		socklen_t addr_len;
+};
+
+// All of the Bro peers, serviced from one epoll loop.  Rows from every
+// peer go through the same event handlers and so into the same COPYs.
+//
+// A lost peer is reconnected on its own schedule, backing off up to
+// max_retry_delay seconds between attempts.  Broccoli only connects
+// synchronously, so before handing a peer back to it the Bro port is
+// probed with a non-blocking connect; a peer whose host is down or
+// unreachable never stalls the others.
+class BroPeers {
+	public:
+		BroPeers();
+		~BroPeers();
+
+		// Handlers can be registered on the returned peer's bc before
+		// the first call to process() connects it.
+		BroPeer* add(const std::string &host, const std::string &port);
+
+		// Wait for up to timeout_ms for input from any peer and run the
+		// event handlers for it, then look after lost peers.
+		void process(int timeout_ms);
+
+		// Send ev to every peer that is connected.
+		void send(BroEvent *ev);
+
+	private:
+		void watch(BroPeer *peer, unsigned events);
+		void unwatch(BroPeer *peer);
+		void start_probe(BroPeer *peer, time_t now_time);
+		void end_probe(BroPeer *peer, time_t now_time, bool timed_out);
+		void retry_later(BroPeer *peer, time_t now_time, int error);
+		void connect_peer(BroPeer *peer, time_t now_time);
+		void lost(BroPeer *peer, time_t now_time);
+
+		int epoll_fd;
+		std::vector<BroPeer*> peers;
+		std::vector<struct epoll_event> events;
+};
+
+#endif
@@ -0,0 +1,459 @@
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rollup.h"
+#include "encode.h"
+
+using namespace std;
+
+// Windows are written out in batches of about the size that rows are
+// decoded in.
+static const size_t rollup_batch_bytes = 64*1024;
+
+static bool parse_interval(const std::string &text, long &interval)
+	{
+	if( text == "hourly" )
+		interval = 3600;
+	else if( text == "daily" )
+		interval = 86400;
+	else
+		{
+		char *end;
+		interval = strtol(text.c_str(), &end, 10);
+		if( text.empty() || *end || interval < 1 )
+			return false;
+		}
+	return true;
+	}
+
+static bool parse_aggregate(const std::string &text, RollupRule::Aggregate &aggregate)
+	{
+	std::string function = text;
+	size_t equals = text.find('=');
+	if( equals != std::string::npos )
+		{
+		aggregate.name = text.substr(0, equals);
+		function = text.substr(equals + 1);
+		if( aggregate.name.empty() )
+			return false;
+		}
+
+	if( function == "count" )
+		{
+		aggregate.function = RollupRule::COUNT;
+		if( aggregate.name.empty() )
+			aggregate.name = "count";
+		return true;
+		}
+
+	size_t open = function.find('(');
+	if( open == std::string::npos || function.size() < open + 3 ||
+	    function[function.size() - 1] != ')' )
+		return false;
+	std::string name = function.substr(0, open);
+	aggregate.field = function.substr(open + 1, function.size() - open - 2);
+	if( name == "sum" )
+		aggregate.function = RollupRule::SUM;
+	else if( name == "min" )
+		aggregate.function = RollupRule::MIN;
+	else if( name == "max" )
+		aggregate.function = RollupRule::MAX;
+	else
+		return false;
+	if( aggregate.name.empty() )
+		aggregate.name = aggregate.field + "_" + name;
+	return true;
+	}
+
+bool parse_rollup_rule(const std::string &spec, std::string &table, RollupRule &rule)
+	{
+	// Split at the last four colons, as table names may have a schema.
+	size_t colons[4];
+	size_t at = spec.size();
+	for(int i=3; i >= 0; i--)
+		{
+		if( at == 0 )
+			return false;
+		colons[i] = spec.rfind(':', at - 1);
+		if( colons[i] == std::string::npos || colons[i] == 0 )
+			return false;
+		at = colons[i];
+		}
+
+	table = spec.substr(0, colons[0]);
+	rule.field = spec.substr(colons[0] + 1, colons[1] - colons[0] - 1);
+	if( rule.field.empty() ||
+	    !parse_interval(spec.substr(colons[1] + 1, colons[2] - colons[1] - 1), rule.interval) )
+		return false;
+
+	rule.groups.clear();
+	std::string groups = spec.substr(colons[2] + 1, colons[3] - colons[2] - 1);
+	for( at = 0; at < groups.size(); )
+		{
+		size_t comma = groups.find(',', at);
+		if( comma == std::string::npos )
+			comma = groups.size();
+		if( comma == at )
+			return false;
+		rule.groups.push_back(groups.substr(at, comma - at));
+		at = comma + 1;
+		}
+
+	rule.aggregates.clear();
+	std::string aggregates = spec.substr(colons[3] + 1);
+	for( at = 0; at < aggregates.size(); )
+		{
+		size_t comma = aggregates.find(',', at);
+		if( comma == std::string::npos )
+			comma = aggregates.size();
+		RollupRule::Aggregate aggregate;
+		if( !parse_aggregate(aggregates.substr(at, comma - at), aggregate) )
+			return false;
+		rule.aggregates.push_back(aggregate);
+		at = comma + 1;
+		}
+
+	return !rule.groups.empty() || !rule.aggregates.empty();
+	}
+
+static inline bool integer_type(int type)
+	{
+	return type == BRO_TYPE_INT || type == BRO_TYPE_COUNT;
+	}
+
+// Whether a field of type can be what the function is taken over, or the
+// time field for a window.
+static bool aggregate_type(RollupRule::Function function, int type)
+	{
+	switch (type)
+		{
+		case BRO_TYPE_INT:
+		case BRO_TYPE_COUNT:
+		case BRO_TYPE_DOUBLE:
+		case BRO_TYPE_INTERVAL:
+			return true;
+		case BRO_TYPE_TIME:
+			return function == RollupRule::MIN || function == RollupRule::MAX;
+		default:
+			return false;
+		}
+	}
+
+static inline bool window_type(int type)
+	{
+	return type == BRO_TYPE_TIME || type == BRO_TYPE_DOUBLE || integer_type(type);
+	}
+
+// The field after the one that starts at p (see RowBatch).
+static const char* skip_field(const char *p)
+	{
+	int type = (unsigned char) *p++;
+	switch (type)
+		{
+		case BRO_TYPE_INT:
+		case BRO_TYPE_BOOL:
+			return p + sizeof(int);
+		case BRO_TYPE_COUNT:
+		case BRO_TYPE_IPADDR:
+			return p + sizeof(uint32);
+		case BRO_TYPE_DOUBLE:
+		case BRO_TYPE_TIME:
+		case BRO_TYPE_INTERVAL:
+			return p + sizeof(double);
+		case BRO_TYPE_PORT:
+			return p + sizeof(uint32) + sizeof(int);
+		case BRO_TYPE_STRING:
+			{
+			uint32 length;
+			memcpy(&length, p, sizeof(length));
+			return p + sizeof(length) + length + 1;
+			}
+		default:
+			return p;
+		}
+	}
+
+// The value of the number field that starts at p.
+static long long read_integer(const char *p)
+	{
+	int type = (unsigned char) *p++;
+	if( type == BRO_TYPE_COUNT )
+		{
+		uint32 value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+		}
+	int value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+	}
+
+static double read_double(const char *p)
+	{
+	int type = (unsigned char) *p;
+	if( integer_type(type) )
+		return read_integer(p);
+	double value;
+	memcpy(&value, p + 1, sizeof(value));
+	return value;
+	}
+
+static int field_index(const Schema *layout, const std::string &name)
+	{
+	for(size_t i=0; i < layout->names.size(); i++)
+		{
+		if( layout->names[i] == name )
+			return i;
+		}
+	return -1;
+	}
+
+Rollup::Rollup(const std::string &table, const RollupRule &rule,
+               const std::map<std::string, int> *formats, Sink *sink)
+	: pending(NULL), table(table), rule(&rule), formats(formats), sink(sink),
+	  schema(NULL), time_type(0), latest(0), last_row(0)
+	{
+	}
+
+Rollup::Layout& Rollup::layout_for(const Schema *layout)
+	{
+	map<const Schema*, Layout>::iterator iter = layouts.find(layout);
+	if( iter != layouts.end() )
+		return iter->second;
+
+	Layout &l = layouts[layout];
+	l.usable = true;
+	l.time_field = field_index(layout, rule->field);
+	if( l.time_field < 0 || !window_type(layout->types[l.time_field]) )
+		l.usable = false;
+	for(size_t i=0; i < rule->groups.size(); i++)
+		{
+		l.group_fields.push_back(field_index(layout, rule->groups[i]));
+		if( l.group_fields.back() < 0 )
+			l.usable = false;
+		}
+	for(size_t i=0; i < rule->aggregates.size(); i++)
+		{
+		const RollupRule::Aggregate &a = rule->aggregates[i];
+		int field = a.function == RollupRule::COUNT ? -1 : field_index(layout, a.field);
+		l.aggregate_fields.push_back(field);
+		if( a.function != RollupRule::COUNT &&
+		    (field < 0 || !aggregate_type(a.function, layout->types[field])) )
+			l.usable = false;
+		}
+
+	// Later layouts have to have the fields with the types the rows are
+	// written with.
+	if( l.usable && schema )
+		{
+		l.usable = layout->types[l.time_field] == time_type;
+		for(size_t i=0; i < l.group_fields.size(); i++)
+			l.usable = l.usable && layout->types[l.group_fields[i]] == group_types[i];
+		for(size_t i=0; i < l.aggregate_fields.size(); i++)
+			{
+			int field = l.aggregate_fields[i];
+			if( field >= 0 )
+				l.usable = l.usable && layout->types[field] == aggregate_types[i];
+			}
+		}
+	else if( l.usable )
+		make_schema(layout, l);
+
+	if( !l.usable )
+		cerr << "Records for table " << table << " (" << layout->stream << ") don't have the"
+		     << " fields of its rollup rule with the types it needs; their rows are dropped." << endl;
+	return l;
+	}
+
+void Rollup::make_schema(const Schema *layout, const Layout &l)
+	{
+	schema = new Schema;
+	schema->table = table;
+	schema->stream = table + " (rollup)";
+	schema->fingerprint = 0;
+	schema->partition = NULL;
+	schema->metrics = table_metrics(table);
+
+	time_type = layout->types[l.time_field];
+	schema->names.push_back(rule->field);
+	schema->types.push_back(time_type);
+	for(size_t i=0; i < l.group_fields.size(); i++)
+		{
+		group_types.push_back(layout->types[l.group_fields[i]]);
+		schema->names.push_back(rule->groups[i]);
+		schema->types.push_back(group_types.back());
+		}
+	for(size_t i=0; i < l.aggregate_fields.size(); i++)
+		{
+		const RollupRule::Aggregate &a = rule->aggregates[i];
+		int type = a.function == RollupRule::COUNT ? BRO_TYPE_COUNT : layout->types[l.aggregate_fields[i]];
+		aggregate_types.push_back(type);
+		if( a.function == RollupRule::SUM && integer_type(type) )
+			type = ROW_TYPE_INT64;
+		schema->names.push_back(a.name);
+		schema->types.push_back(type);
+		}
+
+	for(size_t i=0; i < schema->names.size(); i++)
+		{
+		if( i > 0 )
+			schema->field_names.append(", ");
+		schema->field_names.append(schema->names[i]);
+
+		int format = COLUMN_DEFAULT;
+		if( formats )
+			{
+			map<string,int>::const_iterator f = formats->find(schema->names[i]);
+			if( f != formats->end() )
+				format = f->second;
+			}
+		schema->formats.push_back(format);
+		}
+	}
+
+bool Rollup::add(const Schema *layout, const char *row)
+	{
+	const Layout &l = layout_for(layout);
+	if( !l.usable )
+		return false;
+
+	uint16 count;
+	memcpy(&count, row, sizeof(count));
+	const char *p = row + sizeof(count);
+	fields.resize(count + 1);
+	for(int i=0; i < count; i++)
+		{
+		fields[i] = p;
+		p = skip_field(p);
+		}
+	fields[count] = p;
+
+	double time = read_double(fields[l.time_field]);
+	if( !isfinite(time) )
+		return false;
+	time_t start = (time_t) floor(time / rule->interval) * rule->interval;
+
+	key.clear();
+	for(size_t i=0; i < l.group_fields.size(); i++)
+		{
+		int field = l.group_fields[i];
+		key.append(fields[field], fields[field + 1] - fields[field]);
+		}
+
+	Window &window = windows[start];
+	Window::iterator group = window.find(key);
+	bool first = group == window.end();
+	if( first )
+		group = window.insert(make_pair(key, std::vector<Value>(rule->aggregates.size()))).first;
+
+	for(size_t i=0; i < rule->aggregates.size(); i++)
+		{
+		Value &v = group->second[i];
+		RollupRule::Function function = rule->aggregates[i].function;
+		if( function == RollupRule::COUNT )
+			{
+			v.i++;
+			continue;
+			}
+
+		const char *field = fields[l.aggregate_fields[i]];
+		if( integer_type((unsigned char) *field) )
+			{
+			long long value = read_integer(field);
+			if( function == RollupRule::SUM )
+				v.i += value;
+			else if( first || (function == RollupRule::MIN ? value < v.i : value > v.i) )
+				v.i = value;
+			}
+		else
+			{
+			double value = read_double(field);
+			if( function == RollupRule::SUM )
+				v.d += value;
+			else if( first || (function == RollupRule::MIN ? value < v.d : value > v.d) )
+				v.d = value;
+			}
+		}
+
+	if( time > latest )
+		latest = time;
+	last_row = ::time((time_t *)NULL);
+	if( latest >= windows.begin()->first + rule->interval * 1.1 )
+		close_windows(last_row, false);
+	return true;
+	}
+
+void Rollup::close_windows(time_t now_time, bool all)
+	{
+	bool idle = now_time - last_row >= rule->interval;
+	while( !windows.empty() )
+		{
+		map<time_t, Window>::iterator w = windows.begin();
+		if( !all && !idle && latest < w->first + rule->interval * 1.1 )
+			break;
+		write_window(w->first, w->second);
+		windows.erase(w);
+		}
+	}
+
+template<typename T>
+static inline void put(Buffer &out, T value)
+	{
+	out.append(&value, sizeof(value));
+	}
+
+void Rollup::write_window(time_t start, const Window &window)
+	{
+	uint16 count = 1 + group_types.size() + aggregate_types.size();
+	Window::const_iterator group;
+	for( group = window.begin(); group != window.end(); group++ )
+		{
+		if( !pending )
+			{
+			pending = sink->get_batch();
+			pending->schema = schema;
+			}
+		Buffer &out = pending->data;
+
+		put<uint16>(out, count);
+		out.push_back(time_type);
+		if( time_type == BRO_TYPE_COUNT )
+			put<uint32>(out, start);
+		else if( time_type == BRO_TYPE_INT )
+			put<int>(out, start);
+		else
+			put<double>(out, start);
+
+		out.append(group->first.data(), group->first.size());
+
+		for(size_t i=0; i < aggregate_types.size(); i++)
+			{
+			const Value &v = group->second[i];
+			int type = aggregate_types[i];
+			RollupRule::Function function = rule->aggregates[i].function;
+			if( function == RollupRule::SUM && integer_type(type) )
+				{
+				out.push_back(ROW_TYPE_INT64);
+				put<int64_t>(out, v.i);
+				continue;
+				}
+
+			out.push_back(type);
+			if( type == BRO_TYPE_COUNT )
+				put<uint32>(out, v.i > 0xFFFFFFFFLL ? 0xFFFFFFFF : v.i);
+			else if( type == BRO_TYPE_INT )
+				put<int>(out, v.i);
+			else
+				put<double>(out, v.d);
+			}
+		pending->records++;
+
+		if( out.size() >= rollup_batch_bytes )
+			{
+			sink->submit(pending);
+			pending = NULL;
+			}
+		}
+	}
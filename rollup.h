@@ -0,0 +1,114 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <time.h>
+
+#include "rows.h"
+#include "sink.h"
+
+// How a table's rows are summed up before they are written.  Rows whose
+// group fields have the same values and whose time field falls in the same
+// window of interval seconds become one row: the start of the window in
+// the time field, the group fields, and a column for each aggregate.
+class RollupRule {
+	public:
+		enum Function { COUNT, SUM, MIN, MAX };
+
+		class Aggregate {
+			public:
+				Function function;
+				// The field it is taken over (none for COUNT) and the
+				// column it is written to.
+				std::string field;
+				std::string name;
+		};
+
+		std::string field;
+		long interval;
+		std::vector<std::string> groups;
+		std::vector<Aggregate> aggregates;
+};
+
+// Parse "table:field:interval:group,...:aggregate,...", where interval is
+// "hourly", "daily" or a number of seconds and each aggregate is count,
+// sum(field), min(field) or max(field), optionally preceded by "name=" for
+// its column.  Otherwise the column is named count, or field_sum,
+// field_min or field_max.  Returns false if the rule can't be read.
+bool parse_rollup_rule(const std::string &spec, std::string &table, RollupRule &rule);
+
+// The windows of a table that has a rollup rule, kept by the Broccoli
+// thread.  A window is written out once a row has come that is a tenth of
+// the interval past its end, once the table had no rows for an interval,
+// or when bro-dblogger quits.  A row that comes after its window was
+// written starts it over, and ends up in a row of its own.
+class Rollup {
+	public:
+		// formats are the -T formats of the table's columns, if any.
+		Rollup(const std::string &table, const RollupRule &rule,
+		       const std::map<std::string, int> *formats, Sink *sink);
+
+		// Fold the decoded row at row, which has the given layout, into
+		// its window.  Returns false if the layout lacks one of the
+		// rule's fields or has it with another type than the first
+		// layout did; the row isn't used then.
+		bool add(const Schema *layout, const char *row);
+
+		// Write out the windows that are done by now_time, or all of them.
+		void close_windows(time_t now_time, bool all);
+
+		// Rows of the windows written out that the sink hasn't taken yet.
+		RowBatch *pending;
+
+	private:
+		// Where the rule's fields are in a layout of the table.
+		class Layout {
+			public:
+				bool usable;
+				int time_field;
+				std::vector<int> group_fields, aggregate_fields;
+		};
+
+		// An aggregate so far: integers are kept in i and doubles in d.
+		class Value {
+			public:
+				long long i;
+				double d;
+		};
+
+		typedef std::map<std::string, std::vector<Value> > Window;
+
+		Layout& layout_for(const Schema *layout);
+		void make_schema(const Schema *layout, const Layout &l);
+		void write_window(time_t start, const Window &window);
+
+		std::string table;
+		const RollupRule *rule;
+		const std::map<std::string, int> *formats;
+		Sink *sink;
+
+		// The layout of the rows it writes, made from the first layout
+		// of the table's records, and the types of the fields that are
+		// read in that layout, in the order of the rule.
+		Schema *schema;
+		int time_type;
+		std::vector<int> group_types, aggregate_types;
+
+		std::map<const Schema*, Layout> layouts;
+
+		// Windows by their start.
+		std::map<time_t, Window> windows;
+
+		// The latest time of any row and when the last row came.
+		double latest;
+		time_t last_row;
+
+		// Reused for every row so that a row for a known group doesn't
+		// allocate.
+		std::vector<const char*> fields;
+		std::string key;
+};
+
+#endif
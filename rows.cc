@@ -0,0 +1,184 @@
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+
+#include "rows.h"
+
+using namespace std;
+
+static inline void append_raw(Buffer &out, const void *value, size_t len)
+	{
+	out.append(value, len);
+	}
+
+static void decode_int(const void *data, Buffer &out)
+	{
+	append_raw(out, data, sizeof(int));
+	}
+
+static void decode_uint32(const void *data, Buffer &out)
+	{
+	append_raw(out, data, sizeof(uint32));
+	}
+
+static void decode_double(const void *data, Buffer &out)
+	{
+	append_raw(out, data, sizeof(double));
+	}
+
+static void decode_port(const void *data, Buffer &out)
+	{
+	uint32 port_num = ((const bro_port *) data)->port_num;
+	int port_proto = ((const bro_port *) data)->port_proto;
+	append_raw(out, &port_num, sizeof(port_num));
+	append_raw(out, &port_proto, sizeof(port_proto));
+	}
+
+static void decode_string(const void *data, Buffer &out)
+	{
+	const BroString *bs = (const BroString*) data;
+	uint32 string_length = bro_string_get_length(bs);
+	append_raw(out, &string_length, sizeof(string_length));
+	append_raw(out, bro_string_get_data(bs), string_length);
+	// The UTF-8 check in the encoder can look a few bytes past the end of
+	// a string, like it always did with Broccoli's own '\0' terminated
+	// copy.
+	out.push_back('\0');
+	}
+
+static void decode_nothing(const void *, Buffer &)
+	{
+	}
+
+static FieldDecoder field_decoder(int type)
+	{
+	switch (type)
+		{
+		case BRO_TYPE_INT:
+		case BRO_TYPE_BOOL:
+			return decode_int;
+		case BRO_TYPE_COUNT:
+		case BRO_TYPE_IPADDR:
+			return decode_uint32;
+		case BRO_TYPE_TIME:
+		case BRO_TYPE_DOUBLE:
+		case BRO_TYPE_INTERVAL:
+			return decode_double;
+		case BRO_TYPE_PORT:
+			return decode_port;
+		case BRO_TYPE_STRING:
+			return decode_string;
+		default:
+			return decode_nothing;
+		}
+	}
+
+// 64 bit FNV-1a.
+static const uint64_t fnv_offset = 14695981039346656037ULL;
+
+static inline uint64_t fnv_hash(uint64_t hash, const void *data, size_t len)
+	{
+	const unsigned char *p = (const unsigned char *) data;
+	for(size_t i=0; i < len; i++)
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+	return hash;
+	}
+
+static inline uint64_t fnv_field(uint64_t hash, int type, const char *name)
+	{
+	hash = fnv_hash(hash, &type, sizeof(type));
+	return fnv_hash(hash, name, strlen(name) + 1);
+	}
+
+uint64_t record_fingerprint(BroRecord *r)
+	{
+	int rec_len = bro_record_get_length(r);
+	uint64_t hash = fnv_hash(fnv_offset, &rec_len, sizeof(rec_len));
+	for(int i=0 ; i < rec_len ; i++)
+		{
+		int type=0;
+		bro_record_get_nth_val(r, i, &type);
+		hash = fnv_field(hash, type, bro_record_get_nth_name(r, i));
+		}
+	return hash;
+	}
+
+Schema* new_schema(const std::string &table, BroRecord *r, int version)
+	{
+	Schema *schema = new Schema;
+	schema->table = table;
+	schema->stream = table;
+	if( version > 0 )
+		{
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), " (layout %d)", version + 1);
+		schema->stream.append(suffix);
+		}
+
+	int rec_len = bro_record_get_length(r);
+	for(int i=0 ; i < rec_len ; i++)
+		{
+		int type=0;
+		bro_record_get_nth_val(r, i, &type);
+		const char *name = bro_record_get_nth_name(r, i);
+
+		if(i>0)
+			schema->field_names.append(", ");
+		schema->field_names.append(name);
+		schema->names.push_back(name);
+		schema->types.push_back(type);
+		schema->plan.push_back(field_decoder(type));
+		schema->formats.push_back(0);
+		}
+	schema->fingerprint = record_fingerprint(r);
+	schema->partition = NULL;
+	schema->metrics = table_metrics(table);
+	return schema;
+	}
+
+DecodeResult decode_record(BroRecord *r, RowBatch *batch)
+	{
+	const Schema *schema = batch->schema;
+	Buffer &out = batch->data;
+	size_t row_start = out.size();
+
+	int rec_len = bro_record_get_length(r);
+	if( rec_len != (int) schema->types.size() )
+		return RECORD_DRIFTED;
+
+	uint16 fields = rec_len;
+	append_raw(out, &fields, sizeof(fields));
+
+	for(int i=0 ; i < rec_len ; i++)
+		{
+		// A layout that only renames fields has the same count and types.
+		if( strcmp(schema->names[i].c_str(), bro_record_get_nth_name(r, i)) != 0 )
+			{
+			out.truncate(row_start);
+			return RECORD_DRIFTED;
+			}
+
+		// Asking for the type the schema expects makes Broccoli check it,
+		// so the value never has to be looked at to find out what it is.
+		int type = schema->types[i];
+		void *data = bro_record_get_nth_val(r, i, &type);
+		if( data == NULL || type != schema->types[i] )
+			{
+			out.truncate(row_start);
+
+			// Either the field has another type now or there is no
+			// value at all.
+			type=0;
+			if( bro_record_get_nth_val(r, i, &type) )
+				return RECORD_DRIFTED;
+			cerr << "data couldn't be extracted from record!" << endl;
+			return RECORD_FAILED;
+			}
+
+		out.push_back((char) type);
+		schema->plan[i](data, out);
+		}
+
+	batch->records++;
+	return RECORD_DECODED;
+	}
@@ -0,0 +1,97 @@
+#ifndef ROWS_H
+#define ROWS_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "bro-dblogger.h"
+#include "buffer.h"
+#include "partition.h"
+#include "metrics.h"
+
+// Copies one field's value out of Broccoli onto the end of a row.  There is
+// one of these for each Bro type.
+typedef void (*FieldDecoder)(const void *data, Buffer &out);
+
+// A column layout of a table, taken from the first db_log record that came
+// in with it.  A table normally has one, but a policy script or Bro version
+// that changes the record gives it another.
+class Schema {
+	public:
+		std::string table;
+
+		// Tells the writers' COPY streams for different layouts of the
+		// same table apart.  It is the table name for the first layout.
+		std::string stream;
+
+		// Comma separated column names for the COPY query.
+		std::string field_names;
+
+		// Each field's name and Bro type, in record order.
+		std::vector<std::string> names;
+		std::vector<int> types;
+
+		// The decoder for each field's type, in record order.
+		std::vector<FieldDecoder> plan;
+
+		// How each field is written out, one of the ColumnFormats.
+		std::vector<int> formats;
+
+		// Hash of the field count and every field's type and name.
+		uint64_t fingerprint;
+
+		// Set when table is a time partition that rows are routed to.
+		const Partition *partition;
+
+		// The metrics of table.
+		TableMetrics *metrics;
+};
+
+// Rollups write sums of ints and counts, which can outgrow the 32 bits
+// those are kept in, as this type.  Broccoli has no type of this number.
+enum { ROW_TYPE_INT64 = BRO_TYPE_MAX + 1 };
+
+// Rows pulled out of Broccoli records on the Broccoli thread that are
+// waiting for a writer thread to encode and COPY them.
+//
+// Nothing inside a BroRecord outlives the event handler, so each row is
+// copied into data as a 16 bit field count followed by every field as a
+// one byte Bro type and the raw value:
+//   BRO_TYPE_INT, BRO_TYPE_BOOL           int
+//   BRO_TYPE_COUNT, BRO_TYPE_IPADDR       uint32
+//   BRO_TYPE_DOUBLE/TIME/INTERVAL         double
+//   BRO_TYPE_PORT                         uint32 port number, int protocol
+//   BRO_TYPE_STRING                       uint32 length, the bytes, '\0'
+//   ROW_TYPE_INT64                        int64_t
+// Any other type carries no value and is written out as NULL.
+class RowBatch {
+	public:
+		const Schema *schema;
+		Buffer data;
+
+		// Number of rows in data.
+		int records;
+};
+
+// Build the layout of record r.  version counts the earlier layouts that
+// were seen for the table.
+Schema* new_schema(const std::string &table, BroRecord *r, int version);
+
+// The fingerprint that a schema made from record r would have.
+uint64_t record_fingerprint(BroRecord *r);
+
+enum DecodeResult {
+	RECORD_DECODED,
+	// The record doesn't have the batch schema's layout.
+	RECORD_DRIFTED,
+	// A value couldn't be extracted from the record.
+	RECORD_FAILED
+};
+
+// Append the record to the batch by running its schema's plan.  The batch
+// is left untouched unless the record was decoded.  Every record's field
+// count, names and types are checked against the schema.
+DecodeResult decode_record(BroRecord *r, RowBatch *batch);
+
+#endif
@@ -0,0 +1,149 @@
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static size_t copy_clean_prefix_scalar(const char *s, size_t len)
+	{
+	size_t i = 0;
+	while( i < len )
+		{
+		unsigned char c = s[i];
+		if( c < 27 || c > 126 || c == '\\' )
+			break;
+		i++;
+		}
+	return i;
+	}
+
+static size_t ascii_prefix_scalar(const char *s, size_t len)
+	{
+	size_t i = 0;
+	while( i < len && !(s[i] & 0x80) )
+		i++;
+	return i;
+	}
+
+#ifdef SCAN_X86
+
+// Bytes compare as signed here, so everything from 0x80 up is negative and
+// fails the "greater than 26" test along with the control characters.
+
+__attribute__((target("sse2")))
+static size_t copy_clean_prefix_sse2(const char *s, size_t len)
+	{
+	const __m128i low = _mm_set1_epi8(26);
+	const __m128i high = _mm_set1_epi8(127);
+	const __m128i backslash = _mm_set1_epi8('\\');
+	size_t i = 0;
+
+	for( ; i + 16 <= len; i += 16 )
+		{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i clean = _mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, high));
+		clean = _mm_andnot_si128(_mm_cmpeq_epi8(v, backslash), clean);
+		unsigned dirty = ~_mm_movemask_epi8(clean) & 0xFFFF;
+		if( dirty )
+			return i + __builtin_ctz(dirty);
+		}
+	return i + copy_clean_prefix_scalar(s + i, len - i);
+	}
+
+__attribute__((target("sse2")))
+static size_t ascii_prefix_sse2(const char *s, size_t len)
+	{
+	size_t i = 0;
+
+	for( ; i + 16 <= len; i += 16 )
+		{
+		unsigned high_bits = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (s + i)));
+		if( high_bits )
+			return i + __builtin_ctz(high_bits);
+		}
+	return i + ascii_prefix_scalar(s + i, len - i);
+	}
+
+__attribute__((target("avx2")))
+static size_t copy_clean_prefix_avx2(const char *s, size_t len)
+	{
+	const __m256i low = _mm256_set1_epi8(26);
+	const __m256i high = _mm256_set1_epi8(127);
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	size_t i = 0;
+
+	for( ; i + 32 <= len; i += 32 )
+		{
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i clean = _mm256_and_si256(_mm256_cmpgt_epi8(v, low), _mm256_cmpgt_epi8(high, v));
+		clean = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, backslash), clean);
+		unsigned dirty = ~(unsigned) _mm256_movemask_epi8(clean);
+		if( dirty )
+			return i + __builtin_ctz(dirty);
+		}
+	return i + copy_clean_prefix_sse2(s + i, len - i);
+	}
+
+__attribute__((target("avx2")))
+static size_t ascii_prefix_avx2(const char *s, size_t len)
+	{
+	size_t i = 0;
+
+	for( ; i + 32 <= len; i += 32 )
+		{
+		unsigned high_bits = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (s + i)));
+		if( high_bits )
+			return i + __builtin_ctz(high_bits);
+		}
+	return i + ascii_prefix_sse2(s + i, len - i);
+	}
+
+#endif
+
+typedef size_t (*scan_func)(const char *, size_t);
+
+class ScanImplementation {
+	public:
+		ScanImplementation()
+			: name("scalar"), clean(copy_clean_prefix_scalar), ascii(ascii_prefix_scalar)
+			{
+#ifdef SCAN_X86
+			__builtin_cpu_init();
+			if( __builtin_cpu_supports("avx2") )
+				{
+				name = "avx2";
+				clean = copy_clean_prefix_avx2;
+				ascii = ascii_prefix_avx2;
+				}
+			else if( __builtin_cpu_supports("sse2") )
+				{
+				name = "sse2";
+				clean = copy_clean_prefix_sse2;
+				ascii = ascii_prefix_sse2;
+				}
+#endif
+			}
+
+		const char *name;
+		scan_func clean;
+		scan_func ascii;
+};
+
+// Picked before main() runs, so the writer threads only ever read it.
+static const ScanImplementation scan;
+
+size_t copy_clean_prefix(const char *s, size_t len)
+	{
+	return scan.clean(s, len);
+	}
+
+size_t ascii_prefix(const char *s, size_t len)
+	{
+	return scan.ascii(s, len);
+	}
+
+const char* scan_implementation(void)
+	{
+	return scan.name;
+	}
@@ -0,0 +1,20 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Byte scanners for the string encoding fast paths.  Each one looks at 16
+// or 32 bytes at a time with SSE2 or AVX2 when the CPU has them (picked
+// once at startup) and one byte at a time otherwise.
+
+// Length of the run at the start of s that COPY text escaping copies
+// through unchanged: bytes from 27 to 126, other than '\\'.
+size_t copy_clean_prefix(const char *s, size_t len);
+
+// Length of the run of 7 bit ASCII at the start of s.
+size_t ascii_prefix(const char *s, size_t len);
+
+// "avx2", "sse2" or "scalar".
+const char* scan_implementation(void);
+
+#endif
@@ -0,0 +1,50 @@
+#include "sink.h"
+
+using namespace std;
+
+Sink::Sink()
+	{
+	pthread_mutex_init(&free_lock, NULL);
+	}
+
+Sink::~Sink()
+	{
+	for(size_t i=0; i < free_batches.size(); i++)
+		delete free_batches[i];
+	}
+
+size_t Sink::thread_for(const std::string &table, size_t count)
+	{
+	// FNV-1a.
+	uint32 hash = 2166136261U;
+	for(size_t i=0; i < table.size(); i++)
+		hash = (hash ^ (unsigned char) table[i]) * 16777619U;
+	return hash % count;
+	}
+
+RowBatch* Sink::get_batch()
+	{
+	RowBatch *batch = NULL;
+
+	pthread_mutex_lock(&free_lock);
+	if( !free_batches.empty() )
+		{
+		batch = free_batches.back();
+		free_batches.pop_back();
+		}
+	pthread_mutex_unlock(&free_lock);
+
+	if( !batch )
+		batch = new RowBatch;
+	batch->schema = NULL;
+	batch->data.clear();
+	batch->records = 0;
+	return batch;
+	}
+
+void Sink::release_batch(RowBatch *batch)
+	{
+	pthread_mutex_lock(&free_lock);
+	free_batches.push_back(batch);
+	pthread_mutex_unlock(&free_lock);
+	}
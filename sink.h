@@ -0,0 +1,48 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "rows.h"
+
+// Where the rows of a table go once the Broccoli thread has decoded them.
+// A sink encodes and writes the batches handed to it on threads of its
+// own: WriterPool COPYs them into PostgreSQL, and FileSink writes them to
+// COPY files for loading later.
+class Sink {
+	public:
+		Sink();
+		virtual ~Sink();
+
+		virtual void start() = 0;
+
+		// Hand a batch over.  The sink owns the batch from here on.
+		virtual void submit(RowBatch *batch) = 0;
+
+		// Get the table's rows, or everybody's, to where they are going
+		// as soon as possible.
+		virtual void flush(const std::string &table) = 0;
+		virtual void flush_all() = 0;
+
+		// Write out everything that is queued and wait for the sink's
+		// threads to exit.
+		virtual void shutdown() = 0;
+
+		// Empty batches are recycled rather than freed so that their
+		// buffers don't have to grow again.
+		RowBatch* get_batch();
+		void release_batch(RowBatch *batch);
+
+	protected:
+		// Which of count threads the rows of a table go to.  All of a
+		// table's rows always go to the same one.
+		static size_t thread_for(const std::string &table, size_t count);
+
+	private:
+		std::vector<RowBatch*> free_batches;
+		pthread_mutex_t free_lock;
+};
+
+#endif
@@ -0,0 +1,348 @@
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+
+using namespace std;
+
+static const char spool_magic[8] = { 'B', 'D', 'L', 'S', 'P', 'O', 'O', 'L' };
+static const uint32_t spool_version = 1;
+
+// Segments are made this big unless a single chunk needs more.
+static const size_t spool_segment_size = 16*1024*1024;
+
+// Length, row count and CRC-32 in front of every chunk.
+static const size_t chunk_header_size = 3 * sizeof(uint32_t);
+
+// Bytes of spool_budget that segments take up, shared by all writers.
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t spool_used = 0;
+static unsigned spool_sequence = 0;
+
+static bool reserve(size_t bytes, bool force)
+	{
+	pthread_mutex_lock(&budget_lock);
+	bool fits = force || !spool_budget || spool_used + bytes <= spool_budget;
+	if( fits )
+		spool_used += bytes;
+	pthread_mutex_unlock(&budget_lock);
+	return fits;
+	}
+
+static void give_back(size_t bytes)
+	{
+	pthread_mutex_lock(&budget_lock);
+	spool_used -= min(bytes, spool_used);
+	pthread_mutex_unlock(&budget_lock);
+	}
+
+class CRCTable {
+	public:
+		CRCTable()
+			{
+			for(uint32_t i=0; i < 256; i++)
+				{
+				uint32_t c = i;
+				for(int k=0; k < 8; k++)
+					c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+				table[i] = c;
+				}
+			}
+
+		uint32_t table[256];
+};
+
+static const CRCTable crc_table;
+
+static uint32_t crc32(const void *data, size_t len, uint32_t crc=0)
+	{
+	const unsigned char *p = (const unsigned char *) data;
+	crc = ~crc;
+	for(size_t i=0; i < len; i++)
+		crc = crc_table.table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+	}
+
+static uint32_t header_crc(const SpoolHeader *header)
+	{
+	uint32_t crc = crc32(header, offsetof(SpoolHeader, header_crc));
+	return crc32(header + 1, header->table_length + header->query_length, crc);
+	}
+
+bool spool_enabled(void)
+	{
+	return !spool_directory.empty();
+	}
+
+SpoolSegment::SpoolSegment()
+	: header(NULL), size(0), sealed(false), failures(0), fd(-1), map(NULL), map_size(0)
+	{
+	}
+
+SpoolSegment::~SpoolSegment()
+	{
+	if( map )
+		munmap(map, map_size);
+	if( fd >= 0 )
+		close(fd);
+	}
+
+SpoolSegment* SpoolSegment::create(const std::string &table, const std::string &query,
+                                   bool binary, size_t rows)
+	{
+	size_t data_start = (sizeof(SpoolHeader) + table.size() + query.size() + 63) & ~(size_t) 63;
+	size_t size = max(spool_segment_size, data_start + chunk_header_size + rows);
+	if( !reserve(size, false) )
+		return NULL;
+
+	// Table names may carry a schema, but never a directory.
+	std::string name = table;
+	replace(name.begin(), name.end(), '/', '_');
+
+	pthread_mutex_lock(&budget_lock);
+	unsigned sequence = spool_sequence++;
+	pthread_mutex_unlock(&budget_lock);
+
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%010ld.%d.%06u.spool",
+	         (long) time((time_t *)NULL), (int) getpid(), sequence);
+
+	SpoolSegment *segment = new SpoolSegment;
+	segment->path = spool_directory + "/" + name + suffix;
+	segment->table = table;
+	segment->query = query;
+	segment->size = size;
+
+	int error = 0;
+	segment->fd = ::open(segment->path.c_str(), O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+	if( segment->fd < 0 )
+		error = errno;
+	// The space is allocated up front so that running out of disk shows
+	// up here rather than as a SIGBUS while writing to the mapping.
+	else if( (error = posix_fallocate(segment->fd, 0, size)) == 0 )
+		{
+		segment->map = (char *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, segment->fd, 0);
+		if( segment->map == MAP_FAILED )
+			{
+			error = errno;
+			segment->map = NULL;
+			}
+		}
+	if( error )
+		{
+		cerr << "Could not create spool segment " << segment->path << ": " << strerror(error) << endl;
+		if( segment->fd >= 0 )
+			unlink(segment->path.c_str());
+		give_back(size);
+		delete segment;
+		return NULL;
+		}
+	segment->map_size = size;
+
+	SpoolHeader *header = segment->header = (SpoolHeader *) segment->map;
+	memcpy(header->magic, spool_magic, sizeof(spool_magic));
+	header->version = spool_version;
+	header->flags = binary ? SPOOL_BINARY : 0;
+	header->table_length = table.size();
+	header->query_length = query.size();
+	header->data_start = data_start;
+	memcpy(header + 1, table.data(), table.size());
+	memcpy((char *) (header + 1) + table.size(), query.data(), query.size());
+	header->header_crc = header_crc(header);
+	header->unused = 0;
+	header->committed = header->replayed = data_start;
+
+	// The header has to be on disk before anything can refer to it.
+	msync(segment->map, data_start, MS_SYNC);
+	return segment;
+	}
+
+SpoolSegment* SpoolSegment::open(const std::string &path)
+	{
+	SpoolSegment *segment = new SpoolSegment;
+	segment->path = path;
+	segment->sealed = true;
+
+	struct stat st;
+	segment->fd = ::open(path.c_str(), O_RDWR|O_CLOEXEC);
+	if( segment->fd < 0 || fstat(segment->fd, &st) != 0 ||
+	    (size_t) st.st_size < sizeof(SpoolHeader) )
+		{
+		delete segment;
+		return NULL;
+		}
+	segment->size = segment->map_size = st.st_size;
+	segment->map = (char *) mmap(NULL, segment->map_size, PROT_READ|PROT_WRITE,
+	                             MAP_SHARED, segment->fd, 0);
+	if( segment->map == MAP_FAILED )
+		{
+		segment->map = NULL;
+		delete segment;
+		return NULL;
+		}
+
+	SpoolHeader *header = segment->header = (SpoolHeader *) segment->map;
+	if( memcmp(header->magic, spool_magic, sizeof(spool_magic)) != 0 ||
+	    header->version != spool_version ||
+	    sizeof(SpoolHeader) + (uint64_t) header->table_length + header->query_length > header->data_start ||
+	    header->data_start > segment->size ||
+	    header->committed > segment->size ||
+	    header->replayed < header->data_start ||
+	    header->replayed > header->committed ||
+	    header_crc(header) != header->header_crc )
+		{
+		delete segment;
+		return NULL;
+		}
+
+	const char *names = (const char *) (header + 1);
+	segment->table.assign(names, header->table_length);
+	segment->query.assign(names + header->table_length, header->query_length);
+
+	// A segment that was still being written when the last run stopped
+	// has unused space at the end.
+	if( header->committed < segment->size && ftruncate(segment->fd, header->committed) == 0 )
+		segment->size = header->committed;
+	reserve(segment->size, true);
+	return segment;
+	}
+
+bool SpoolSegment::append(const char *rows, size_t len, int records)
+	{
+	if( sealed || header->committed + chunk_header_size + len > size )
+		return false;
+
+	char *p = map + header->committed;
+	uint32_t fields[3] = { (uint32_t) len, (uint32_t) records, crc32(rows, len) };
+	memcpy(p, fields, sizeof(fields));
+	memcpy(p + chunk_header_size, rows, len);
+
+	// The chunk has to be complete before committed covers it.
+	__sync_synchronize();
+	header->committed += chunk_header_size + len;
+	return true;
+	}
+
+void SpoolSegment::seal()
+	{
+	if( sealed )
+		return;
+	sealed = true;
+
+	msync(map, map_size, MS_SYNC);
+	if( ftruncate(fd, header->committed) == 0 )
+		{
+		give_back(size - header->committed);
+		size = header->committed;
+		}
+	}
+
+void SpoolSegment::remove()
+	{
+	if( unlink(path.c_str()) != 0 )
+		cerr << "Could not remove spool segment " << path << ": " << strerror(errno) << endl;
+	give_back(size);
+	size = 0;
+	}
+
+void SpoolSegment::set_aside()
+	{
+	std::string failed = path + ".failed";
+	if( rename(path.c_str(), failed.c_str()) != 0 )
+		cerr << "Could not rename spool segment " << path << ": " << strerror(errno) << endl;
+	else
+		cerr << "    Set the spooled rows aside in " << failed << endl;
+	give_back(size);
+	size = 0;
+	}
+
+bool SpoolSegment::chunk(uint64_t offset, const char *&rows, size_t &len,
+                         int &records, uint64_t &next) const
+	{
+	if( offset + chunk_header_size > header->committed )
+		return false;
+
+	uint32_t fields[3];
+	memcpy(fields, map + offset, sizeof(fields));
+	if( offset + chunk_header_size + fields[0] > header->committed )
+		return false;
+
+	rows = map + offset + chunk_header_size;
+	len = fields[0];
+	records = fields[1];
+	next = offset + chunk_header_size + len;
+	if( crc32(rows, len) != fields[2] )
+		{
+		cerr << "Corrupt chunk at offset " << offset << " in spool segment " << path << endl;
+		return false;
+		}
+	return true;
+	}
+
+std::vector<SpoolSegment*> spool_scan(void)
+	{
+	std::vector<SpoolSegment*> segments;
+	std::vector<std::string> names;
+
+	if( mkdir(spool_directory.c_str(), 0700) != 0 && errno != EEXIST )
+		{
+		cerr << "Could not create the spool directory " << spool_directory
+		     << ": " << strerror(errno) << endl;
+		exit(-1);
+		}
+
+	DIR *dir = opendir(spool_directory.c_str());
+	if( !dir )
+		{
+		cerr << "Could not read the spool directory " << spool_directory
+		     << ": " << strerror(errno) << endl;
+		exit(-1);
+		}
+	struct dirent *entry;
+	while( (entry = readdir(dir)) )
+		{
+		std::string name = entry->d_name;
+		if( name.size() > 6 && name.compare(name.size() - 6, 6, ".spool") == 0 )
+			names.push_back(name);
+		}
+	closedir(dir);
+
+	// The names carry the time they were made, so this is oldest first
+	// within each table.
+	sort(names.begin(), names.end());
+
+	for(size_t i=0; i < names.size(); i++)
+		{
+		std::string path = spool_directory + "/" + names[i];
+		SpoolSegment *segment = SpoolSegment::open(path);
+		if( !segment )
+			{
+			std::string corrupt = path + ".corrupt";
+			cerr << "Spool segment " << path << " is unreadable; moving it to "
+			     << corrupt << endl;
+			rename(path.c_str(), corrupt.c_str());
+			}
+		else if( segment->empty() )
+			{
+			segment->remove();
+			delete segment;
+			}
+		else
+			segments.push_back(segment);
+		}
+
+	if(verbose_output && !segments.empty())
+		cout << "Found " << segments.size() << " spool segment(s) to replay." << endl;
+	return segments;
+	}
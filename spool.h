@@ -0,0 +1,102 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "bro-dblogger.h"
+
+// COPY data that couldn't go to the database right away is kept on disk in
+// spool segments until it can be replayed.  A segment is a file of a
+// fixed size that is reserved up front and mapped into memory; chunks of
+// encoded rows are appended to it and it is truncated to what it holds
+// once it is full.
+//
+// The file starts with a SpoolHeader, followed by the table name and the
+// COPY query, followed by the chunks from data_start on.  Each chunk is a
+// uint32 length, a uint32 row count and the CRC-32 of the rows, followed
+// by the rows themselves (without the binary COPY header and trailer).
+// committed only moves past a chunk once all of it is in place, and
+// replayed only once its COPY has been acknowledged, so a crash at any
+// point leaves a segment that can be read back: a chunk that was half
+// written is never looked at, and at worst the chunks of the COPY that
+// was running are inserted a second time.
+struct SpoolHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t table_length;
+	uint32_t query_length;
+	uint64_t data_start;
+	// CRC-32 of the header up to here, the table name and the query.
+	uint32_t header_crc;
+	uint32_t unused;
+	uint64_t committed;
+	uint64_t replayed;
+};
+
+enum { SPOOL_BINARY = 1 };
+
+class SpoolSegment {
+	public:
+		// Create a new segment in the spool directory with room for a
+		// chunk of at least rows bytes.  Returns NULL if that would go
+		// over the disk budget or the file couldn't be made.
+		static SpoolSegment* create(const std::string &table, const std::string &query,
+		                            bool binary, size_t rows);
+
+		// Open a segment left behind by an earlier run.  Returns NULL if
+		// it isn't a valid segment.
+		static SpoolSegment* open(const std::string &path);
+
+		// Unmaps the segment but leaves the file where it is.
+		~SpoolSegment();
+
+		// Append a chunk of rows.  Returns false if it doesn't fit.
+		bool append(const char *rows, size_t len, int records);
+
+		// Stop appending, make sure that everything is on disk and give
+		// the unused space back.
+		void seal();
+
+		// The segment was replayed: delete it.
+		void remove();
+
+		// Keep a segment that keeps failing around for someone to look
+		// at, but out of the way of the replay.
+		void set_aside();
+
+		// The chunk at offset, if there is a valid one below committed.
+		// next is set to the offset of the chunk after it.
+		bool chunk(uint64_t offset, const char *&rows, size_t &len,
+		           int &records, uint64_t &next) const;
+
+		bool empty() const { return header->committed == header->replayed; }
+		bool binary() const { return header->flags & SPOOL_BINARY; }
+
+		std::string path, table, query;
+		SpoolHeader *header;
+		// Bytes of the disk budget that the file takes up.
+		size_t size;
+		bool sealed;
+
+		// How often replaying this segment has failed.
+		int failures;
+
+	private:
+		SpoolSegment();
+
+		int fd;
+		char *map;
+		size_t map_size;
+};
+
+// Every segment in the spool directory, oldest first.  Segments that
+// were already replayed are deleted and broken ones are set aside.
+std::vector<SpoolSegment*> spool_scan(void);
+
+// Whether spooling is turned on at all.
+bool spool_enabled(void);
+
+#endif
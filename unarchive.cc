@@ -0,0 +1,305 @@
+// bro-dblogger-unarchive - Turns the archive segments that bro-dblogger
+// writes with -F and -A back into COPY input.
+//
+// Each segment comes out as a "COPY table (fields) FROM STDIN;" line, its
+// rows and a "\." line, which psql -f - loads as it is.  The rows are
+// written by the same encoder as live COPYs, with the column formats the
+// segment was written with, so they come out exactly as bro-dblogger
+// would have COPYed them.
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "bro-dblogger.h"
+#include "archive.h"
+#include "encode.h"
+
+using namespace std;
+
+SharedSetting verbose_output;
+
+static bool show_index = false;
+static bool rows_only = false;
+
+// Segments are skipped unless range_field can have a value from
+// range_low to range_high.
+static string range_field, range_low, range_high;
+
+static void usage(void)
+	{
+	cout << "bro-dblogger-unarchive - Writes the rows of archive segments as COPY input." << endl <<
+		"USAGE: bro-dblogger-unarchive [-in] [-w field:low:high] segment ..." << endl <<
+		endl <<
+		"  -i       Show each segment's table, rows and column ranges instead of its rows." << endl <<
+		"  -n       Write only the rows, without the COPY statement and \\. around them." << endl <<
+		"  -w range Skip segments that have no value of field from low to high, given as" << endl <<
+		"           numbers, epoch seconds for times and dotted quads for addresses" << endl <<
+		"           (e.g. -w epoch:1700000000:1700003600)." << endl << endl;
+	exit(0);
+	}
+
+// bound in the form of the column's min and max.
+static bool parse_bound(const ArchiveColumn &column, const string &bound, uint64_t &value)
+	{
+	const char *text = bound.c_str();
+	char *end = NULL;
+	switch (column.type)
+		{
+		case BRO_TYPE_TIME:
+		case BRO_TYPE_DOUBLE:
+		case BRO_TYPE_INTERVAL:
+			{
+			double d = strtod(text, &end);
+			memcpy(&value, &d, sizeof(value));
+			break;
+			}
+		case BRO_TYPE_INT:
+		case ROW_TYPE_INT64:
+			value = strtoll(text, &end, 10);
+			break;
+		case BRO_TYPE_IPADDR:
+			{
+			struct in_addr address;
+			if( !inet_aton(text, &address) )
+				return false;
+			value = ntohl(address.s_addr);
+			return true;
+			}
+		default:
+			value = strtoull(text, &end, 10);
+			break;
+		}
+	return *text && !*end;
+	}
+
+// Whether the segment can have rows in the -w range.
+static bool in_range(const ArchiveSegment &segment, const string &path)
+	{
+	if( range_field.empty() )
+		return true;
+
+	for(size_t c=0; c < segment.columns.size(); c++)
+		{
+		const ArchiveColumn &column = segment.columns[c];
+		if( column.name != range_field )
+			continue;
+		if( column.type == BRO_TYPE_STRING )
+			return column.overlaps(range_low, range_high);
+
+		uint64_t low, high;
+		if( !parse_bound(column, range_low, low) || !parse_bound(column, range_high, high) )
+			{
+			cerr << "Could not read the range " << range_low << ":" << range_high
+			     << " for " << range_field << "." << endl;
+			exit(-1);
+			}
+		return column.overlaps(low, high);
+		}
+
+	cerr << path << " has no field " << range_field << "; skipping it." << endl;
+	return false;
+	}
+
+// A value of the column's range, as min or max hold it.
+static string range_text(const ArchiveColumn &column, uint64_t value)
+	{
+	char text[64];
+	switch (column.type)
+		{
+		case BRO_TYPE_TIME:
+		case BRO_TYPE_DOUBLE:
+		case BRO_TYPE_INTERVAL:
+			{
+			double d;
+			memcpy(&d, &value, sizeof(d));
+			snprintf(text, sizeof(text), "%f", d);
+			break;
+			}
+		case BRO_TYPE_INT:
+		case ROW_TYPE_INT64:
+			snprintf(text, sizeof(text), "%lld", (long long) value);
+			break;
+		case BRO_TYPE_IPADDR:
+			{
+			struct in_addr address;
+			address.s_addr = htonl((uint32_t) value);
+			snprintf(text, sizeof(text), "%s", inet_ntoa(address));
+			break;
+			}
+		default:
+			snprintf(text, sizeof(text), "%llu", (unsigned long long) value);
+			break;
+		}
+	return text;
+	}
+
+static const char* encoding_name(int encoding)
+	{
+	switch (encoding)
+		{
+		case ARCHIVE_RAW32: return "raw32";
+		case ARCHIVE_BOOL: return "bool";
+		case ARCHIVE_DOUBLE: return "double";
+		case ARCHIVE_DELTA: return "delta";
+		case ARCHIVE_DICTIONARY: return "dictionary";
+		case ARCHIVE_RAW64: return "raw64";
+		default: return "none";
+		}
+	}
+
+static void print_index(const ArchiveSegment &segment, const string &path)
+	{
+	cout << path << ": " << segment.table << ", " << segment.rows << " rows" << endl;
+	for(size_t c=0; c < segment.columns.size(); c++)
+		{
+		const ArchiveColumn &column = segment.columns[c];
+		cout << "  " << column.name << " " << encoding_name(column.encoding)
+		     << " " << column.length << " bytes";
+		if( column.has_range && column.type == BRO_TYPE_STRING )
+			cout << " '" << column.min_string << "' to '" << column.max_string << "'";
+		else if( column.has_range )
+			cout << " " << range_text(column, column.min) << " to " << range_text(column, column.max);
+		cout << endl;
+		}
+	}
+
+static bool write_all(const char *data, size_t len)
+	{
+	return fwrite(data, 1, len, stdout) == len;
+	}
+
+static void write_rows(const ArchiveSegment &segment, const string &path)
+	{
+	Buffer rows, out;
+	string error;
+	if( !segment.decode_rows(rows, error) )
+		{
+		cerr << path << ": " << error << endl;
+		exit(-1);
+		}
+
+	vector<int> formats;
+	string fields;
+	for(size_t c=0; c < segment.columns.size(); c++)
+		{
+		formats.push_back(segment.columns[c].format);
+		if( c > 0 )
+			fields.append(", ");
+		fields.append(segment.columns[c].name);
+		}
+
+	if( !rows_only )
+		{
+		string statement = "COPY " + segment.table + " (" + fields + ") FROM STDIN;\n";
+		write_all(statement.data(), statement.size());
+		}
+
+	const char *p = rows.data();
+	for(uint32_t r=0; r < segment.rows; r++)
+		{
+		p = encode_row_text(p, formats, out);
+		if( out.size() >= 1024*1024 )
+			{
+			write_all(out.data(), out.size());
+			out.clear();
+			}
+		}
+	write_all(out.data(), out.size());
+
+	if( !rows_only )
+		write_all("\\.\n", 3);
+	}
+
+static void unarchive(const string &path)
+	{
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if( fd < 0 || fstat(fd, &st) != 0 )
+		{
+		cerr << "Could not open " << path << ": " << strerror(errno) << endl;
+		exit(-1);
+		}
+
+	const char *data = NULL;
+	if( st.st_size > 0 )
+		{
+		data = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if( data == MAP_FAILED )
+			{
+			cerr << "Could not read " << path << ": " << strerror(errno) << endl;
+			exit(-1);
+			}
+		}
+
+	ArchiveSegment segment;
+	string error;
+	if( !segment.parse(data, st.st_size, error) )
+		{
+		cerr << path << ": " << error << endl;
+		exit(-1);
+		}
+
+	if( in_range(segment, path) )
+		{
+		if( show_index )
+			print_index(segment, path);
+		else
+			write_rows(segment, path);
+		}
+
+	if( data )
+		munmap((void *) data, st.st_size);
+	close(fd);
+	}
+
+int main(int argc, char **argv)
+	{
+	int opt;
+	while( (opt = getopt(argc, argv, "hinw:")) != -1 )
+		{
+		switch (opt)
+			{
+			case 'i':
+				show_index = true;
+				break;
+
+			case 'n':
+				rows_only = true;
+				break;
+
+			case 'w':
+				{
+				string range = optarg;
+				size_t first = range.find(':');
+				size_t second = first == string::npos ? first : range.find(':', first + 1);
+				if( second == string::npos )
+					usage();
+				range_field = range.substr(0, first);
+				range_low = range.substr(first + 1, second - first - 1);
+				range_high = range.substr(second + 1);
+				break;
+				}
+
+			case 'h':
+			default:
+				usage();
+			}
+		}
+
+	if( optind >= argc )
+		usage();
+	for(int i=optind; i < argc; i++)
+		unarchive(argv[i]);
+	fflush(stdout);
+	return 0;
+	}
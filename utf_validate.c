@@ -1,4 +1,5 @@
 #include "utf_validate.h"
+#include "scan.h"
 
 
 const char *
@@ -36,6 +37,13 @@ bool utf_is_valid(const char *data, int len)
   int state = FSM_START;
   while (data < end)
     {
+      /* ASCII leaves the machine in FSM_START, so skip runs of it. */
+      if (state == FSM_START)
+        {
+          data += ascii_prefix(data, end - data);
+          if (data == end)
+            break;
+        }
       unsigned char octet = *data++;
       int category = octet_category[octet];
       state = machine[state][category];
@@ -0,0 +1,1572 @@
+#include <iostream>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+
+#include "writer.h"
+#include "encode.h"
+
+using namespace std;
+
+// Seconds to wait before connecting again after PostgreSQL couldn't be
+// reached, doubled after every failed attempt up to the most, and before
+// trying a table again after a COPY into it failed.
+static const int min_database_retry_delay = 1;
+static const int max_database_retry_delay = 60;
+static const int table_retry_delay = 60;
+
+// A connection that isn't made within this many seconds counts as failed.
+static const int connect_timeout = 10;
+
+// A connection whose server stops answering keepalives, or doesn't
+// acknowledge data for tcp_user_timeout seconds, is closed by the kernel
+// and noticed like any other lost connection.
+static const int keepalive_idle = 30, keepalive_interval = 10, keepalive_count = 3;
+static const int tcp_user_timeout = 120;
+
+// A COPY whose connection was lost is tried again on another connection
+// this many times in a row before its rows are spooled or dropped.
+static const int max_copy_retries = 3;
+
+// A spool segment is set aside after its replay failed this many times.
+static const int max_replay_failures = 5;
+
+// Rows are spooled once a table has this many times its byte limit
+// waiting for a connection.
+static const size_t spill_factor = 4;
+
+static void *writer_thread(void *arg)
+	{
+	((Writer *) arg)->run();
+	return NULL;
+	}
+
+Writer::Writer(WriterPool *pool, int id, int max_connections, const WriterSettings &settings)
+	: pool(pool), stopping(false), wakeup_pending(false),
+	  max_connections(max_connections), settings(settings), database_down_until(0),
+	  database_retry_delay(min_database_retry_delay),
+	  metrics(writer_metrics(id))
+	{
+	pthread_mutex_init(&lock, NULL);
+	if( pipe(wakeup_pipe) != 0 )
+		{
+		cerr << "Could not create a writer wakeup pipe: " << strerror(errno) << endl;
+		exit(-1);
+		}
+	fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+	}
+
+void Writer::start()
+	{
+	// Signals are only handled by the Broccoli thread.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if( pthread_create(&thread, NULL, writer_thread, this) != 0 )
+		{
+		cerr << "Could not start a writer thread." << endl;
+		exit(-1);
+		}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+void Writer::enqueue(const WriterJob &job)
+	{
+	pthread_mutex_lock(&lock);
+	jobs.push_back(job);
+	if( !wakeup_pending )
+		{
+		// One byte is enough to wake the writer no matter how many jobs
+		// are queued behind it.
+		wakeup_pending = true;
+		if( write(wakeup_pipe[1], "", 1) < 0 && errno != EAGAIN )
+			cerr << "Could not wake writer thread: " << strerror(errno) << endl;
+		}
+	pthread_mutex_unlock(&lock);
+	}
+
+void Writer::stop()
+	{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	if( write(wakeup_pipe[1], "", 1) < 0 && errno != EAGAIN )
+		cerr << "Could not wake writer thread: " << strerror(errno) << endl;
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	close(wakeup_pipe[0]);
+	close(wakeup_pipe[1]);
+	}
+
+void Writer::run()
+	{
+	std::deque<WriterJob> work;
+	std::vector<struct pollfd> fds;
+	std::vector<PGConnection*> polled;
+	char drain[64];
+
+	for(;;)
+		{
+		// Lost connections are dropped here, where nothing else points
+		// at them; the scheduler opens new ones as they are needed.  So
+		// are free ones that the pool no longer has room for.
+		for(size_t i=0; i < connections.size(); )
+			{
+			if( connections[i]->state == PGConnection::BROKEN ||
+			    (!connections[i]->table && (int) connections.size() > max_connections) )
+				{
+				PQfinish(connections[i]->conn);
+				delete connections[i];
+				connections.erase(connections.begin() + i);
+				}
+			else
+				i++;
+			}
+
+		// The wakeup pipe always comes first, followed by every
+		// PostgreSQL socket with the events its connection waits on.
+		fds.clear();
+		polled.clear();
+
+		struct pollfd pfd;
+		pfd.fd = wakeup_pipe[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		fds.push_back(pfd);
+
+		for(size_t i=0; i < connections.size(); i++)
+			{
+			PGConnection *pg = connections[i];
+			if( PQsocket(pg->conn) < 0 )
+				continue;
+
+			pfd.fd = PQsocket(pg->conn);
+			if( pg->state == PGConnection::CONNECTING )
+				pfd.events = pg->connect_poll == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+			else
+				pfd.events = POLLIN | (pg->want_write ? POLLOUT : 0);
+			fds.push_back(pfd);
+			polled.push_back(pg);
+			}
+
+		if( poll(&fds[0], fds.size(), 1000) < 0 && errno != EINTR )
+			cerr << "Writer poll failed: " << strerror(errno) << endl;
+
+		if( fds[0].revents )
+			while( read(wakeup_pipe[0], drain, sizeof(drain)) > 0 )
+				;
+
+		pthread_mutex_lock(&lock);
+		work.swap(jobs);
+		wakeup_pending = false;
+		bool stop_now = stopping;
+		pthread_mutex_unlock(&lock);
+
+		metrics->queued_jobs.set(work.size());
+		for( ; !work.empty(); work.pop_front() )
+			run_job(work.front());
+
+		for(size_t i=1; i < fds.size(); i++)
+			{
+			if( fds[i].revents )
+				progress(polled[i-1], fds[i].revents & (POLLIN|POLLERR|POLLHUP));
+			}
+
+		// libpq never gives up on a server that doesn't answer while
+		// connecting, so it is done here.
+		time_t now_time = time((time_t *)NULL);
+		for(size_t i=0; i < connections.size(); i++)
+			{
+			PGConnection *pg = connections[i];
+			if( pg->state == PGConnection::CONNECTING &&
+			    now_time - pg->connect_started >= connect_timeout )
+				database_failed(pg, "timed out connecting to the server\n");
+			}
+
+		if( stop_now )
+			{
+			// Flush all existing queries to the database and keep
+			// polling until every commit has been acknowledged.
+			flush_tables();
+			}
+
+		// Tables that reached one of their limits (or stopped receiving
+		// rows and timed out) get a connection.
+		int flush_count = schedule(!stop_now);
+		if(verbose_output>1 && flush_count)
+			cout << "Flushing " << flush_count << " table(s)." << endl;
+		drop_retired();
+
+		int busy = 0;
+		for(size_t i=0; i < connections.size(); i++)
+			busy += connections[i]->table != NULL;
+		metrics->connections.set(connections.size());
+		metrics->busy_connections.set(busy);
+
+		if( stop_now && all_idle() )
+			break;
+		}
+
+	// Shut down and delete all PostgreSQL connections
+	for(size_t i=0; i < connections.size(); i++)
+		{
+		PQfinish(connections[i]->conn);
+		delete connections[i];
+		}
+	connections.clear();
+
+	// Whatever is still spooled is replayed by the next run.
+	map<string,TableState>::iterator iter;
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		{
+		TableState &t = iter->second;
+		if( t.spooling )
+			{
+			t.spooling->seal();
+			t.spooled.push_back(t.spooling);
+			t.spooling = NULL;
+			}
+		for(size_t i=0; i < t.spooled.size(); i++)
+			delete t.spooled[i];
+		t.spooled.clear();
+		}
+	}
+
+void Writer::run_job(const WriterJob &job)
+	{
+	switch (job.kind)
+		{
+		case WriterJob::ROWS:
+			write_batch(job.batch);
+			break;
+		case WriterJob::FLUSH:
+			flush_table(job.table);
+			break;
+		case WriterJob::FLUSH_ALL:
+			flush_tables();
+			break;
+		case WriterJob::CONFIGURE:
+			configure(job.connections, job.settings);
+			break;
+		case WriterJob::RETIRE:
+			retiring.push_back(job.schema);
+			break;
+		}
+	}
+
+void Writer::configure(int connections, const WriterSettings &new_settings)
+	{
+	if(verbose_output && connections != max_connections)
+		cout << "Writer now uses up to " << connections << " connections" << endl;
+	max_connections = connections;
+	settings = new_settings;
+
+	map<string,TableState>::iterator iter;
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		iter->second.byte_limit = settings.max_copy_bytes;
+	}
+
+bool Writer::all_idle()
+	{
+	map<string,TableState>::iterator iter;
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		{
+		TableState &t = iter->second;
+		if( t.try_it && (!t.pending.empty() || !t.unencoded.empty()) )
+			return false;
+		}
+	for(size_t i=0; i < connections.size(); i++)
+		{
+		if( connections[i]->table )
+			return false;
+		}
+	return true;
+	}
+
+PGConnection* Writer::connect_to_postgres()
+	{
+	PGConnection *pg = new PGConnection;
+
+	std::string connect_string =
+		"host="+postgresql_host+" port="+postgresql_port+
+		" user="+postgresql_user+" password="+postgresql_password+
+		" dbname="+postgresql_db;
+	if( !(pg->conn = PQconnectStart(connect_string.c_str())) )
+		{
+		cerr << "Total screw up with the postgres connection" << endl;
+		exit(-1);
+		}
+
+	if(verbose_output)
+		cout << "Opening PostgreSQL connection " << connections.size()+1
+		     << " of " << max_connections << endl;
+
+	pg->state = PGConnection::CONNECTING;
+	pg->connect_started = time((time_t *)NULL);
+	// libpq wants the socket to be writable before the first poll.
+	pg->connect_poll = PGRES_POLLING_WRITING;
+	pg->want_write = false;
+	pg->table = NULL;
+	pg->waiting = false;
+	pg->records = 0;
+	pg->bytes = 0;
+	pg->sent = 0;
+	pg->open = false;
+	pg->opened = 0;
+	pg->replay = NULL;
+	pg->copy_error = false;
+	pg->header_sent = pg->trailer_sent = false;
+	connections.push_back(pg);
+
+	if( PQstatus(pg->conn) == CONNECTION_BAD )
+		{
+		database_failed(pg, PQerrorMessage(pg->conn));
+		return NULL;
+		}
+	return pg;
+	}
+
+// Have the kernel notice a server that went away without closing the
+// connection: keepalives while the connection waits on the server, and
+// TCP_USER_TIMEOUT while data it was sent goes unacknowledged.  These are
+// set on the socket rather than with libpq's keepalive options, which
+// older versions of libpq don't know.  Nothing is set for UNIX sockets.
+static void watch_socket(int fd)
+	{
+	int on = 1;
+	if( setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0 )
+		return;
+#ifdef TCP_KEEPIDLE
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive_idle, sizeof(keepalive_idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive_interval, sizeof(keepalive_interval));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive_count, sizeof(keepalive_count));
+#endif
+#ifdef TCP_USER_TIMEOUT
+	unsigned int timeout = tcp_user_timeout * 1000;
+	setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+#endif
+	}
+
+// A connection to PostgreSQL couldn't be made.  No new connections are
+// tried for a while, longer after every attempt that fails, and in the
+// meantime rows are spooled, or kept in memory if there is no spool.
+void Writer::database_failed(PGConnection *pg, const char *error)
+	{
+	time_t now_time = time((time_t *)NULL);
+	if( database_down_until <= now_time )
+		{
+		cerr << "Could not connect to PostgreSQL, trying again in " << database_retry_delay
+		     << " seconds -- " << error;
+		if( verbose_output && database_retry_delay == min_database_retry_delay )
+			cout << (spool_enabled() ? "Spooling" : "Keeping") << " rows until PostgreSQL is back." << endl;
+		database_down_until = now_time + database_retry_delay;
+		database_retry_delay = min(database_retry_delay * 2, max_database_retry_delay);
+		}
+	close_connection(pg);
+	}
+
+// A connection that was made stopped working: the server closed it, or
+// the kernel gave up on it.
+void Writer::connection_lost(PGConnection *pg)
+	{
+	cerr << "Lost a PostgreSQL connection -- " << PQerrorMessage(pg->conn);
+	close_connection(pg);
+	}
+
+// A free connection for the scheduler: an idle one from the pool, or a
+// new one if the pool isn't full yet.
+PGConnection* Writer::free_connection(size_t &next_free, time_t now_time)
+	{
+	for( ; next_free < connections.size(); next_free++ )
+		{
+		PGConnection *pg = connections[next_free];
+		if( !pg->table && pg->state != PGConnection::BROKEN )
+			return connections[next_free++];
+		}
+
+	if( (int) connections.size() < max_connections && now_time >= database_down_until )
+		{
+		PGConnection *pg = connect_to_postgres();
+		next_free = connections.size();
+		return pg;
+		}
+	return NULL;
+	}
+
+void Writer::assign(PGConnection *pg, TableState &table, SpoolSegment *replay)
+	{
+	pg->table = &table;
+	table.connections++;
+	if( replay )
+		{
+		pg->replay = replay;
+		table.replaying = true;
+		}
+	else
+		{
+		pg->waiting = true;
+		table.waiting_connections++;
+		}
+
+	// A connection that is still being opened carries on once its
+	// socket is ready.
+	if( pg->state == PGConnection::IDLE )
+		progress(pg);
+	}
+
+// Hand the connection back to the pool.  Any COPY data it still holds
+// is dropped, and a segment that it was replaying waits for the next
+// replay.
+void Writer::release(PGConnection *pg)
+	{
+	TableState *table = pg->table;
+	if( !table )
+		return;
+
+	if( pg->waiting )
+		table->waiting_connections--;
+	if( table->open_copy == pg )
+		table->open_copy = NULL;
+	if( pg->replay )
+		{
+		table->spooled.push_front(pg->replay);
+		table->replaying = false;
+		}
+	table->connections--;
+	pg->table = NULL;
+	pg->waiting = false;
+	pg->open = false;
+	pg->replay = NULL;
+	pg->copy_data.clear();
+	pg->records = 0;
+	pg->bytes = 0;
+	pg->sent = 0;
+	pg->copy_error = false;
+	}
+
+void Writer::close_connection(PGConnection *pg)
+	{
+	if( pg->state == PGConnection::DESCRIBING )
+		pg->table->describing = false;
+	if( pg->state == PGConnection::PREPARING )
+		pg->table->preparing = false;
+	if( pg->table )
+		copy_failed(pg, false);
+	release(pg);
+	pg->state = PGConnection::BROKEN;
+	}
+
+// The COPY on the connection didn't go through, either because the
+// server rejected it (table_error) or because the connection was lost.
+// Its rows are spooled if there is a spool, and otherwise the table is
+// given up on after a rejected COPY, like it always was.
+void Writer::copy_failed(PGConnection *pg, bool table_error)
+	{
+	TableState &t = *pg->table;
+	time_t now_time = time((time_t *)NULL);
+
+	if( table_error )
+		t.metrics->rejected_rows.add(pg->records);
+
+	if( pg->replay )
+		{
+		if( table_error && ++pg->replay->failures >= max_replay_failures )
+			{
+			cerr << "    Replaying " << pg->replay->path << " failed "
+			     << pg->replay->failures << " times." << endl;
+			pg->replay->set_aside();
+			delete pg->replay;
+			pg->replay = NULL;
+			t.replaying = false;
+			}
+		}
+	else if( !table_error && pg->records && ++t.lost_copies <= max_copy_retries )
+		{
+		// The server never acknowledged the COPY, so its rows go back in
+		// front of the table's pending ones to be COPYed again on
+		// another connection.  If the server committed them just before
+		// the connection went, they end up in the table twice.
+		if(verbose_output)
+			cout << "Retrying " << pg->records << " records for the '" << t.name
+			     << "' table on another connection." << endl;
+		if( t.pending.empty() )
+			t.pending_since = now_time;
+		pg->copy_data.append(t.pending.data(), t.pending.size());
+		t.pending.swap(pg->copy_data);
+		t.pending_records += pg->records;
+		}
+	else if( spool_enabled() )
+		{
+		spool(t, pg->copy_data, pg->records);
+		}
+	else if( table_error )
+		{
+		cerr << "    Removing the '" << t.name << "' table due to failure." << endl;
+		t.metrics->dropped_rows.add(pg->records + t.pending_records);
+		t.try_it = false;
+		t.pending.clear();
+		t.pending_records = 0;
+		}
+	else if( pg->records )
+		{
+		cerr << "    " << pg->records << " records for the '" << t.name
+		     << "' table were lost." << endl;
+		t.metrics->dropped_rows.add(pg->records);
+		}
+
+	if( table_error )
+		t.retry_at = now_time + table_retry_delay;
+	pg->copy_data.clear();
+	pg->records = 0;
+	}
+
+// Append rows to the table's spool segment, starting a new segment when
+// it is full.
+void Writer::spool(TableState &t, const Buffer &data, int records)
+	{
+	if( data.empty() )
+		return;
+	if( !spool_enabled() )
+		{
+		cerr << "    " << records << " records for the '" << t.name
+		     << "' table were lost." << endl;
+		t.metrics->dropped_rows.add(records);
+		return;
+		}
+
+	if( t.spooling && t.spooling->query == t.query &&
+	    t.spooling->append(data.data(), data.size(), records) )
+		{
+		t.metrics->spooled_rows.add(records);
+		return;
+		}
+
+	if( t.spooling )
+		{
+		t.spooling->seal();
+		t.spooled.push_back(t.spooling);
+		}
+	t.spooling = SpoolSegment::create(t.name, t.query, t.format == TableState::BINARY,
+	                                  data.size());
+	if( !t.spooling || !t.spooling->append(data.data(), data.size(), records) )
+		{
+		cerr << "The spool is full; " << records << " records for the '"
+		     << t.name << "' table were lost." << endl;
+		t.metrics->dropped_rows.add(records);
+		return;
+		}
+	t.metrics->spooled_rows.add(records);
+
+	if(verbose_output>1)
+		cout << "Spooled " << records << " records for " << t.name << "." << endl;
+	}
+
+void Writer::spool_pending(TableState &t)
+	{
+	spool(t, t.pending, t.pending_records);
+	t.pending.clear();
+	t.pending_records = 0;
+	t.flush_requested = false;
+	}
+
+// Whether the table's pending data, together with what was put into its
+// open COPY, has reached one of its limits.
+bool Writer::flush_due(const TableState &table, time_t now_time)
+	{
+	int records = table.pending_records;
+	size_t bytes = table.pending.size();
+	if( table.open_copy )
+		{
+		records += table.open_copy->records;
+		bytes += table.open_copy->copy_data.size();
+		}
+
+	return table.flush_requested ||
+	       (settings.max_copy_records && records >= settings.max_copy_records) ||
+	       (table.byte_limit && bytes >= table.byte_limit) ||
+	       difftime(now_time, table.pending_since) >= settings.seconds_between_copyend;
+	}
+
+void Writer::start_open_copy(PGConnection *pg, TableState &t, time_t now_time)
+	{
+	pg->table = &t;
+	pg->open = true;
+	pg->opened = now_time;
+	t.connections++;
+	t.open_copy = pg;
+	if( pg->state == PGConnection::IDLE )
+		progress(pg);
+	}
+
+// Let the table's open COPY end with what it has.  Whether another is
+// started for the table's next rows depends on whether this one got any.
+void Writer::end_open_copy(TableState &t)
+	{
+	PGConnection *pg = t.open_copy;
+	t.keep_open = pg->records > 0;
+	t.open_copy = NULL;
+	t.flush_requested = false;
+	pg->open = false;
+	progress(pg);
+	}
+
+// Put the rows of tables with an open COPY into it, and end the ones that
+// are due.  An open COPY that went unused for a flush interval is ended
+// too, so that tables which stopped getting rows give their connection
+// back.
+void Writer::feed_open_copies(time_t now_time)
+	{
+	map<string,TableState>::iterator iter;
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		{
+		TableState &t = iter->second;
+		PGConnection *pg = t.open_copy;
+		if( !pg || pg->state != PGConnection::COPYING )
+			continue;
+
+		if( !t.pending.empty() )
+			{
+			if( pg->copy_data.empty() )
+				pg->copy_data.swap(t.pending);
+			else
+				pg->copy_data.append(t.pending.data(), t.pending.size());
+			t.pending.clear();
+			pg->records += t.pending_records;
+			pg->bytes = pg->copy_data.size();
+			t.pending_records = 0;
+			}
+
+		if( t.flush_requested || (pg->records && flush_due(t, now_time)) ||
+		    (!pg->records && difftime(now_time, pg->opened) >= settings.seconds_between_copyend) )
+			end_open_copy(t);
+		else
+			progress(pg);
+		}
+	}
+
+// End an open COPY so that its connection comes free for a table that is
+// due to be flushed.  Returns false if there is none.
+bool Writer::reclaim_open_copy()
+	{
+	map<string,TableState>::iterator iter;
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		{
+		TableState &t = iter->second;
+		if( t.open_copy && t.open_copy->state == PGConnection::COPYING )
+			{
+			end_open_copy(t);
+			return true;
+			}
+		}
+	return false;
+	}
+
+// The server acknowledged the end of a COPY.  With a target commit
+// latency the table's byte limit is moved toward it: commits that took
+// too long shrink it, and quick commits of COPYs that were cut off by the
+// limit grow it back.
+void Writer::commit_done(PGConnection *pg)
+	{
+	TableState &t = *pg->table;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long latency_usec = (now.tv_sec - pg->copy_end_time.tv_sec) * 1000000 +
+	                    (now.tv_usec - pg->copy_end_time.tv_usec);
+	long latency = latency_usec / 1000;
+
+	t.metrics->commit_usec.record(latency_usec);
+	t.metrics->commit_rows.record(pg->records);
+	t.lost_copies = 0;
+	if( pg->replay )
+		t.metrics->replayed_rows.add(pg->records);
+
+	// Replayed segments are as big as they are, so they say nothing
+	// about the size of the next COPY.
+	if( settings.target_commit_latency > 0 && !pg->replay )
+		{
+		// Without a size limit, start from the size of this COPY.
+		if( !t.byte_limit )
+			t.byte_limit = pg->bytes;
+
+		if( latency > settings.target_commit_latency )
+			t.byte_limit = t.byte_limit / 4 * 3;
+		else if( latency < settings.target_commit_latency / 2 &&
+		         pg->bytes >= t.byte_limit / 2 )
+			t.byte_limit = t.byte_limit / 4 * 5;
+
+		if( t.byte_limit < settings.min_copy_bytes )
+			t.byte_limit = settings.min_copy_bytes;
+		if( settings.max_copy_bytes && t.byte_limit > settings.max_copy_bytes )
+			t.byte_limit = settings.max_copy_bytes;
+		}
+
+	if(verbose_output>1)
+		cout << (pg->replay ? "Replayed " : "Committed ") << pg->records
+		     << " records (" << pg->bytes << " bytes) into " << t.name
+		     << " in " << latency << "ms." << endl;
+
+	if( pg->replay )
+		{
+		// The replay only stops short of the end at a corrupt chunk.
+		pg->replay->header->replayed = pg->replay_offset;
+		if( pg->replay->empty() )
+			pg->replay->remove();
+		else
+			pg->replay->set_aside();
+		delete pg->replay;
+		pg->replay = NULL;
+		t.replaying = false;
+		}
+	}
+
+// Move the connection along as far as it can go without waiting on the
+// server.  Input is only read when the socket was readable.
+void Writer::progress(PGConnection *pg, bool readable)
+	{
+	PGresult *result=NULL;
+	ExecStatusType result_status;
+
+	if( pg->state == PGConnection::BROKEN )
+		return;
+
+	if( pg->state == PGConnection::CONNECTING )
+		{
+		pg->connect_poll = PQconnectPoll(pg->conn);
+		if( pg->connect_poll == PGRES_POLLING_FAILED ||
+		    PQstatus(pg->conn) == CONNECTION_BAD )
+			{
+			database_failed(pg, PQerrorMessage(pg->conn));
+			return;
+			}
+		if( pg->connect_poll != PGRES_POLLING_OK )
+			return;
+
+		if( PQsetnonblocking(pg->conn, 1) != 0 )
+			cerr << "Could not put a PostgreSQL connection into non-blocking mode." << endl;
+		else if(verbose_output)
+			cout << "Connected to PostgreSQL in non-blocking mode" << endl;
+		watch_socket(PQsocket(pg->conn));
+		database_retry_delay = min_database_retry_delay;
+		pg->state = PGConnection::IDLE;
+		}
+
+	if( (readable && !PQconsumeInput(pg->conn)) || PQstatus(pg->conn) == CONNECTION_BAD )
+		{
+		connection_lost(pg);
+		return;
+		}
+
+	if( pg->state == PGConnection::DESCRIBING )
+		{
+		while( pg->state == PGConnection::DESCRIBING && !PQisBusy(pg->conn) )
+			{
+			result = PQgetResult(pg->conn);
+			if( result == NULL )
+				{
+				if( pg->table->format == TableState::UNDECIDED )
+					set_format(*pg->table, pg->conn, NULL);
+				pg->table->describing = false;
+				pg->state = PGConnection::IDLE;
+				break;
+				}
+			set_format(*pg->table, pg->conn, result);
+			PQclear(result);
+			}
+		}
+
+	if( pg->state == PGConnection::PREPARING )
+		{
+		while( pg->state == PGConnection::PREPARING && !PQisBusy(pg->conn) )
+			{
+			result = PQgetResult(pg->conn);
+			if( result == NULL )
+				{
+				// If it didn't work, the COPY will say why.
+				pg->table->preparing = false;
+				pg->table->partition_ready = true;
+				pg->state = PGConnection::IDLE;
+				break;
+				}
+			if( PQresultStatus(result) != PGRES_COMMAND_OK )
+				cerr << "Could not create partition " << pg->table->name << " -- "
+				     << PQresultErrorMessage(result);
+			PQclear(result);
+			}
+		}
+
+	if( pg->state == PGConnection::IDLE && pg->replay )
+		{
+		if(verbose_output)
+			cout << "Replaying " << pg->replay->path << endl;
+
+		if( !PQsendQuery(pg->conn, pg->replay->query.c_str()) )
+			{
+			cerr << "On table (" << pg->table->name << ") -- " << PQerrorMessage(pg->conn) << endl;
+			close_connection(pg);
+			return;
+			}
+		pg->replay_offset = pg->replay->header->replayed;
+		pg->state = PGConnection::STARTING_COPY;
+		}
+
+	if( pg->state == PGConnection::IDLE && pg->table &&
+	    pg->table->schema && pg->table->schema->partition &&
+	    !pg->table->partition_ready )
+		{
+		// The partition has to exist before its columns can be looked
+		// up or rows COPYed into it.
+		if( pg->table->preparing )
+			release(pg);
+		else
+			prepare_partition(pg);
+		}
+
+	if( pg->state == PGConnection::IDLE && pg->table &&
+	    pg->table->format == TableState::UNDECIDED )
+		{
+		// Only one connection needs to look up the columns.
+		if( pg->table->describing )
+			release(pg);
+		else
+			describe_table(pg);
+		}
+
+	if( pg->state == PGConnection::IDLE && pg->table && pg->open )
+		{
+		// Rows are put as they come, once the COPY is in.
+		if(verbose_output>1)
+			cout << "Starting ahead: " << pg->table->query << endl;
+
+		if( !PQsendQuery(pg->conn, pg->table->query.c_str()) )
+			{
+			cerr << "On table (" << pg->table->name << ") -- " << PQerrorMessage(pg->conn) << endl;
+			close_connection(pg);
+			return;
+			}
+		pg->state = PGConnection::STARTING_COPY;
+		}
+
+	if( pg->state == PGConnection::IDLE && pg->table )
+		{
+		TableState &t = *pg->table;
+
+		if( t.pending.empty() || !t.try_it ||
+		    !flush_due(t, time((time_t *)NULL)) )
+			{
+			release(pg);
+			}
+		else
+			{
+			// Take everything the table has pending; rows that
+			// arrive from now on wait for the next COPY.
+			pg->copy_data.swap(t.pending);
+			pg->records = t.pending_records;
+			pg->bytes = pg->copy_data.size();
+			t.pending_records = 0;
+			t.flush_requested = false;
+			pg->waiting = false;
+			t.waiting_connections--;
+
+			if(verbose_output)
+				cout << "Executing: " << t.query << endl;
+
+			if( !PQsendQuery(pg->conn, t.query.c_str()) )
+				{
+				cerr << "On table (" << t.name << ") -- " << PQerrorMessage(pg->conn) << endl;
+				close_connection(pg);
+				return;
+				}
+			pg->state = PGConnection::STARTING_COPY;
+			}
+		}
+
+	if( pg->state == PGConnection::STARTING_COPY )
+		{
+		while( pg->state == PGConnection::STARTING_COPY && !PQisBusy(pg->conn) )
+			{
+			result = PQgetResult(pg->conn);
+			if( result == NULL )
+				{
+				// The COPY failed and the connection is free again.
+				pg->state = PGConnection::IDLE;
+				release(pg);
+				break;
+				}
+			result_status = PQresultStatus(result);
+			PQclear(result);
+
+			if( result_status == PGRES_COPY_IN )
+				{
+				pg->state = PGConnection::COPYING;
+				pg->header_sent = pg->trailer_sent = false;
+				pg->sent = 0;
+				}
+			else if( result_status == PGRES_FATAL_ERROR )
+				{
+				cerr << "On table (" << pg->table->name << ") -- " << PQerrorMessage(pg->conn) << endl;
+				copy_failed(pg, true);
+				}
+			}
+		}
+
+	if( pg->state == PGConnection::COPYING )
+		{
+		put_copy_data(pg);
+		if( pg->state == PGConnection::BROKEN )
+			return;
+		}
+
+	if( pg->state == PGConnection::ENDING_COPY )
+		{
+		while( !PQisBusy(pg->conn) )
+			{
+			result = PQgetResult(pg->conn);
+			if( result == NULL )
+				{
+				if( pg->copy_error )
+					copy_failed(pg, true);
+				else
+					commit_done(pg);
+				pg->state = PGConnection::IDLE;
+				release(pg);
+				break;
+				}
+			result_status = PQresultStatus(result);
+			PQclear(result);
+			if(result_status != PGRES_COMMAND_OK)
+				{
+				cerr << "Error when ending copy on \"" << pg->table->name << "\" table :: "
+					 << PQerrorMessage(pg->conn);
+				pg->copy_error = true;
+				}
+			}
+		}
+
+	int flushed = PQflush(pg->conn);
+	if( flushed < 0 )
+		{
+		connection_lost(pg);
+		return;
+		}
+	pg->want_write = flushed == 1;
+	}
+
+// Put the connection's COPY data and end the COPY.  Whatever libpq can't
+// take right now is put once the socket is writable again.
+void Writer::put_copy_data(PGConnection *pg)
+	{
+	bool binary = pg->replay ? pg->replay->binary()
+	                         : pg->table->format == TableState::BINARY;
+
+	if( !binary )
+		pg->header_sent = true;
+	else if( !pg->header_sent )
+		{
+		binary_marker.clear();
+		encode_binary_header(binary_marker);
+		pg->header_sent = PQputCopyData(pg->conn, binary_marker.data(), binary_marker.size()) != 0;
+		}
+	if( !pg->header_sent )
+		return;
+
+	if( pg->replay )
+		{
+		// Straight out of the mapped segment, a chunk at a time.
+		const char *rows;
+		size_t len;
+		int records;
+		uint64_t next;
+		while( pg->replay->chunk(pg->replay_offset, rows, len, records, next) )
+			{
+			uint64_t start = monotonic_usec();
+			int put = PQputCopyData(pg->conn, rows, len);
+			pg->table->metrics->put_usec.record(monotonic_usec() - start);
+			if( put == 0 )
+				return;
+			if( put < 0 )
+				{
+				connection_lost(pg);
+				return;
+				}
+			pg->records += records;
+			pg->bytes += len;
+			pg->replay_offset = next;
+			}
+		}
+	else if( pg->sent < pg->copy_data.size() )
+		{
+		uint64_t start = monotonic_usec();
+		int put = PQputCopyData(pg->conn, pg->copy_data.data() + pg->sent,
+		                        pg->copy_data.size() - pg->sent);
+		pg->table->metrics->put_usec.record(monotonic_usec() - start);
+		if( put == 0 )
+			return;
+		if( put < 0 )
+			{
+			connection_lost(pg);
+			return;
+			}
+		pg->sent = pg->copy_data.size();
+		}
+
+	// More rows may still come for a COPY that was started ahead.
+	if( pg->open )
+		return;
+
+	if( binary && !pg->trailer_sent )
+		{
+		binary_marker.clear();
+		encode_binary_trailer(binary_marker);
+		pg->trailer_sent = PQputCopyData(pg->conn, binary_marker.data(), binary_marker.size()) != 0;
+		if( !pg->trailer_sent )
+			return;
+		}
+
+	int ended_copy = PQputCopyEnd(pg->conn, NULL);
+	if( ended_copy == 1 )
+		{
+		if(verbose_output)
+			cout << "Inserting " << pg->records << " records into " << pg->table->name << "." << endl;
+		gettimeofday(&pg->copy_end_time, NULL);
+		pg->state = PGConnection::ENDING_COPY;
+		}
+	else if( ended_copy < 0 )
+		connection_lost(pg);
+	}
+
+static bool pending_longer(const TableState *a, const TableState *b)
+	{
+	return a->pending_since < b->pending_since;
+	}
+
+// Give free connections to the tables that need one, the longest waiting
+// first.  A table gets another connection only when the ones it already
+// has are busy with earlier COPYs, and never more than
+// max_table_connections of them.  Connections that are left over replay
+// the spool and then start COPYs ahead, unless the writer is no longer
+// running.  Returns the number of tables that got a connection.
+int Writer::schedule(bool running)
+	{
+	bool replay = running, prestart = running;
+	time_t now_time = time((time_t *)NULL);
+	bool database_down = now_time < database_down_until;
+	int assigned=0;
+
+	feed_open_copies(now_time);
+
+	ready_tables.clear();
+	map<string,TableState>::iterator iter;
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		{
+		TableState &t = iter->second;
+		if( t.pending.empty() && t.unencoded.empty() )
+			{
+			// Nothing is buffered, so there is nothing to flush.
+			t.flush_requested = false;
+			continue;
+			}
+		if( !t.try_it )
+			continue;
+
+		// Without a database to ask, binary COPY is out.
+		if( t.format == TableState::UNDECIDED && database_down && !t.describing )
+			set_format(t, NULL, NULL);
+
+		if( t.format != TableState::UNDECIDED && flush_due(t, now_time) &&
+		    (database_down || now_time < t.retry_at) )
+			{
+			// Without a spool the rows wait for the database, up to
+			// spill_factor times the byte limit, or are dropped when
+			// there is nothing left to wait for.
+			if( spool_enabled() || !running || now_time < t.retry_at ||
+			    (t.byte_limit && t.pending.size() >= spill_factor * t.byte_limit) )
+				spool_pending(t);
+			continue;
+			}
+
+		// Rows of a table with an open COPY go into it once it is in.
+		if( t.open_copy || t.waiting_connections ||
+		    (settings.max_table_connections && t.connections >= settings.max_table_connections) )
+			continue;
+
+		// A partition is created and a table's columns are looked up
+		// as soon as its first rows arrive, after that it waits for one
+		// of its limits.
+		bool ready;
+		if( t.schema && t.schema->partition && !t.partition_ready )
+			ready = !t.preparing;
+		else if( t.format == TableState::UNDECIDED )
+			ready = !t.describing;
+		else
+			ready = flush_due(t, now_time);
+		if( ready )
+			ready_tables.push_back(&t);
+		}
+
+	size_t next_free = 0;
+	if( !ready_tables.empty() )
+		{
+		std::sort(ready_tables.begin(), ready_tables.end(), pending_longer);
+
+		for(size_t i=0; i < ready_tables.size(); i++)
+			{
+			PGConnection *pg = free_connection(next_free, now_time);
+			if( !pg )
+				{
+				// Tables that are due come before COPYs started ahead.
+				reclaim_open_copy();
+				break;
+				}
+			assign(pg, *ready_tables[i], NULL);
+			assigned++;
+			}
+		}
+
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		{
+		TableState &t = iter->second;
+
+		// Rather than keep piling up rows that the database can't take
+		// fast enough, move them to the spool.
+		if( spool_enabled() && t.format != TableState::UNDECIDED && t.byte_limit &&
+		    t.pending.size() >= spill_factor * t.byte_limit )
+			spool_pending(t);
+
+		t.metrics->pending_rows.add(t.pending_records - t.reported_records);
+		t.metrics->pending_bytes.add(t.pending.size() - t.reported_bytes);
+		t.reported_records = t.pending_records;
+		t.reported_bytes = t.pending.size();
+
+		if( !replay || database_down || t.replaying || now_time < t.retry_at ||
+		    (t.spooled.empty() && !t.spooling) ||
+		    (t.schema && t.schema->partition && !t.partition_ready) ||
+		    (settings.max_table_connections && t.connections >= settings.max_table_connections) )
+			continue;
+
+		PGConnection *pg = free_connection(next_free, now_time);
+		if( !pg )
+			{
+			replay = false;
+			continue;
+			}
+
+		// Rows are only appended to the newest segment, so it has to
+		// be closed before it can be replayed.
+		if( t.spooled.empty() )
+			{
+			t.spooling->seal();
+			t.spooled.push_back(t.spooling);
+			t.spooling = NULL;
+			}
+		SpoolSegment *segment = t.spooled.front();
+		t.spooled.pop_front();
+		assign(pg, t, segment);
+		assigned++;
+		}
+
+	// Connections that are still free start the next COPY of tables that
+	// are getting rows, so that it is ready to take them while the last
+	// one commits.  Not while shutting down, when only the flushes count.
+	for( iter = tables.begin(); iter != tables.end() && prestart; iter++ )
+		{
+		TableState &t = iter->second;
+		if( t.open_copy || !t.try_it || t.format == TableState::UNDECIDED ||
+		    database_down || now_time < t.retry_at ||
+		    (t.pending.empty() && !t.keep_open) ||
+		    (t.schema && t.schema->partition && !t.partition_ready) ||
+		    (settings.max_table_connections && t.connections >= settings.max_table_connections) )
+			continue;
+
+		PGConnection *pg = free_connection(next_free, now_time);
+		if( !pg )
+			break;
+		start_open_copy(pg, t, now_time);
+		}
+	return assigned;
+	}
+
+// The streams of a partitioned table's partitions are flushed with it.
+void Writer::flush_table(const std::string &table)
+	{
+	map<string,TableState>::iterator iter;
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		{
+		const TableState &t = iter->second;
+		const std::string &name = t.schema && t.schema->partition ? t.schema->partition->parent : t.name;
+		if( name == table )
+			iter->second.flush_requested = true;
+		}
+	}
+
+void Writer::flush_tables()
+	{
+	map<string,TableState>::iterator iter;
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		iter->second.flush_requested = true;
+	}
+
+// Whether nothing is left to do for the stream: no rows, COPYs, spooled
+// segments or connections.
+bool Writer::stream_done(const TableState &t)
+	{
+	if( !t.pending.empty() || !t.unencoded.empty() || t.open_copy || t.connections ||
+	    t.describing || t.preparing || t.replaying || t.spooling || !t.spooled.empty() )
+		return false;
+	for(size_t i=0; i < connections.size(); i++)
+		{
+		if( connections[i]->table == &t )
+			return false;
+		}
+	return true;
+	}
+
+// Drop the streams of retired partitions that are done.  Their rows were
+// all queued before the partition was retired, so none come after.
+void Writer::drop_retired()
+	{
+	for(size_t i=0; i < retiring.size(); )
+		{
+		const Schema *schema = retiring[i];
+		map<string,TableState>::iterator iter = tables.find(schema->stream);
+		if( iter != tables.end() )
+			{
+			TableState &t = iter->second;
+			if( !stream_done(t) )
+				{
+				i++;
+				continue;
+				}
+			t.metrics->pending_rows.sub(t.reported_records);
+			t.metrics->pending_bytes.sub(t.reported_bytes);
+			tables.erase(iter);
+			}
+		delete schema->partition;
+		delete schema;
+		retiring[i] = retiring.back();
+		retiring.pop_back();
+		}
+	}
+
+TableState& Writer::table_state(const std::string &stream, const std::string &name,
+                                TableMetrics *metrics)
+	{
+	map<string,TableState>::iterator iter = tables.find(stream);
+	if( iter != tables.end() )
+		return iter->second;
+
+	// A new layout of a known table: what is waiting in the old one's
+	// stream goes out now rather than whenever it would have.
+	for( iter = tables.begin(); iter != tables.end(); iter++ )
+		{
+		if( iter->second.name == name )
+			iter->second.flush_requested = true;
+		}
+
+	TableState &t = tables[stream];
+	t.name = name;
+	t.schema = NULL;
+	t.format = use_binary_copy ? TableState::UNDECIDED : TableState::TEXT;
+	t.strings = NULL;
+	t.describing = false;
+	t.partition_ready = false;
+	t.preparing = false;
+	t.pending_records = 0;
+	t.pending_since = 0;
+	t.reported_records = 0;
+	t.reported_bytes = 0;
+	t.byte_limit = settings.max_copy_bytes;
+	t.connections = 0;
+	t.waiting_connections = 0;
+	t.open_copy = NULL;
+	t.keep_open = false;
+	t.try_it = true;
+	t.flush_requested = false;
+	t.spooling = NULL;
+	t.replaying = false;
+	t.retry_at = 0;
+	t.lost_copies = 0;
+	t.metrics = metrics;
+	return t;
+	}
+
+EscapeCache* Writer::string_cache(const Schema *schema)
+	{
+	const std::string &table = schema->partition ? schema->partition->parent : schema->table;
+	map<string,EscapeCache>::iterator iter = string_caches.find(table);
+	if( iter != string_caches.end() )
+		return &iter->second;
+
+	EscapeCache &cache = string_caches[table];
+	cache.set_limit(string_cache_bytes);
+	return &cache;
+	}
+
+void Writer::adopt_segment(SpoolSegment *segment)
+	{
+	table_state(segment->table, segment->table, table_metrics(segment->table)).spooled.push_back(segment);
+	}
+
+void Writer::write_batch(RowBatch *batch)
+	{
+	const std::string &table = batch->schema->table;
+	TableState &t = table_state(batch->schema->stream, table, batch->schema->metrics);
+
+	// A table can be known from the spool before any of its rows arrive.
+	if( !t.schema )
+		{
+		t.schema = batch->schema;
+		t.query = "COPY " + table + " (" + batch->schema->field_names + ") FROM STDIN";
+		t.strings = string_cache(batch->schema);
+		}
+
+	// If try_it is false, skip all of this.  This query has had a fatal error.
+	if( !t.try_it )
+		{
+		cerr << "ERROR: Some earlier fatal error with " << table << endl;
+		t.metrics->dropped_rows.add(batch->records);
+		t.metrics->queued_rows.sub(batch->records);
+		t.metrics->queued_bytes.sub(batch->data.size());
+		pool->release_batch(batch);
+		return;
+		}
+
+	if( t.pending.empty() && t.unencoded.empty() &&
+	    !(t.open_copy && t.open_copy->records) )
+		t.pending_since = time((time_t *)NULL);
+
+	if( t.format == TableState::UNDECIDED )
+		t.unencoded.push_back(batch);
+	else
+		encode_batch(t, batch);
+	}
+
+// Encode the batch's rows onto the table's pending COPY data.
+void Writer::encode_batch(TableState &t, RowBatch *batch)
+	{
+	uint64_t start = monotonic_usec();
+	size_t start_size = t.pending.size();
+	const char *p = batch->data.data();
+	if( t.format == TableState::BINARY )
+		{
+		for(int i=0; i < batch->records; i++)
+			p = encode_row_binary(p, t.columns, t.schema->formats, t.pending, t.strings);
+		}
+	else
+		{
+		for(int i=0; i < batch->records; i++)
+			p = encode_row_text(p, t.schema->formats, t.pending, t.strings);
+		}
+	t.strings->report(t.metrics);
+	t.pending_records += batch->records;
+	t.metrics->rows.add(batch->records);
+	t.metrics->bytes.add(t.pending.size() - start_size);
+	t.metrics->encode_usec.add(monotonic_usec() - start);
+	t.metrics->queued_rows.sub(batch->records);
+	t.metrics->queued_bytes.sub(batch->data.size());
+	pool->release_batch(batch);
+	}
+
+// Ask the server for the table's column types so that binary COPY can be
+// used if every field can be written in binary.
+void Writer::describe_table(PGConnection *pg)
+	{
+	const char *query =
+		"SELECT a.attname, a.atttypid FROM pg_catalog.pg_attribute a"
+		" WHERE a.attrelid = $1::regclass AND a.attnum > 0"
+		" AND NOT a.attisdropped";
+	const char *values[1] = { pg->table->name.c_str() };
+
+	pg->table->describing = true;
+	if( !PQsendQueryParams(pg->conn, query, 1, NULL, values, NULL, NULL, 0) )
+		{
+		set_format(*pg->table, pg->conn, NULL);
+		pg->table->describing = false;
+		return;
+		}
+	pg->state = PGConnection::DESCRIBING;
+	}
+
+// Create the partition that the connection's table is, and the one after
+// it, unless they are there already.
+void Writer::prepare_partition(PGConnection *pg)
+	{
+	TableState &t = *pg->table;
+
+	if(verbose_output)
+		cout << "Creating partition " << t.name << " of " << t.schema->partition->parent << endl;
+
+	t.preparing = true;
+	if( !PQsendQuery(pg->conn, t.schema->partition->create_query.c_str()) )
+		{
+		cerr << "Could not create partition " << t.name << " -- " << PQerrorMessage(pg->conn) << endl;
+		t.preparing = false;
+		t.partition_ready = true;
+		return;
+		}
+	pg->state = PGConnection::PREPARING;
+	}
+
+// Pick binary COPY if the column lookup worked and every field maps onto
+// a column type the binary encoder knows, and text COPY otherwise.  Rows
+// that waited for the decision are encoded now.
+void Writer::set_format(TableState &t, PGconn *conn, PGresult *result)
+	{
+	std::string reason;
+
+	t.format = TableState::TEXT;
+	if( !conn )
+		reason = "PostgreSQL is unavailable";
+	else if( !result || PQresultStatus(result) != PGRES_TUPLES_OK )
+		reason = std::string("column lookup failed: ") + PQerrorMessage(conn);
+	else
+		{
+		const char *datetimes = PQparameterStatus(conn, "integer_datetimes");
+		bool integer_datetimes = datetimes && strcmp(datetimes, "on") == 0;
+
+		t.columns.clear();
+		for(size_t i=0; i < t.schema->names.size() && reason.empty(); i++)
+			{
+			// Unquoted column names in the COPY are folded to lower case.
+			std::string name = t.schema->names[i];
+			for(size_t c=0; c < name.size(); c++)
+				name[c] = tolower(name[c]);
+
+			Oid column = 0;
+			for(int row=0; row < PQntuples(result); row++)
+				{
+				if( name == PQgetvalue(result, row, 0) )
+					column = strtoul(PQgetvalue(result, row, 1), NULL, 10);
+				}
+
+			if( !binary_supported(t.schema->types[i], t.schema->formats[i], column) )
+				reason = "no binary encoding for column " + name;
+			else if( (column == TIMESTAMPOID || column == TIMESTAMPTZOID) &&
+			         !integer_datetimes )
+				reason = "server doesn't use integer datetimes";
+			t.columns.push_back(column);
+			}
+
+		if( reason.empty() )
+			{
+			t.format = TableState::BINARY;
+			t.query += " WITH BINARY";
+			}
+		}
+
+	if(verbose_output)
+		{
+		if( t.format == TableState::BINARY )
+			cout << "Using binary COPY for " << t.name << endl;
+		else
+			cout << "Using text COPY for " << t.name << " (" << reason << ")" << endl;
+		}
+
+	for(size_t i=0; i < t.unencoded.size(); i++)
+		encode_batch(t, t.unencoded[i]);
+	t.unencoded.clear();
+	}
+
+WriterPool::WriterPool(int threads, int connections, const WriterSettings &settings)
+	{
+	for(int i=0; i < threads; i++)
+		writers.push_back(new Writer(this, i, connections / threads +
+		                                      (i < connections % threads ? 1 : 0), settings));
+	}
+
+WriterPool::~WriterPool()
+	{
+	for(size_t i=0; i < writers.size(); i++)
+		delete writers[i];
+	}
+
+void WriterPool::start()
+	{
+	// Rows spooled by an earlier run go to the writer for their table.
+	if( spool_enabled() )
+		{
+		std::vector<SpoolSegment*> segments = spool_scan();
+		for(size_t i=0; i < segments.size(); i++)
+			writer_for(segments[i]->table)->adopt_segment(segments[i]);
+		}
+
+	for(size_t i=0; i < writers.size(); i++)
+		writers[i]->start();
+	}
+
+Writer* WriterPool::writer_for(const std::string &table)
+	{
+	return writers[thread_for(table, writers.size())];
+	}
+
+void WriterPool::submit(RowBatch *batch)
+	{
+	batch->schema->metrics->queued_rows.add(batch->records);
+	batch->schema->metrics->queued_bytes.add(batch->data.size());
+
+	WriterJob job;
+	job.kind = WriterJob::ROWS;
+	job.batch = batch;
+	writer_for(batch->schema->table)->enqueue(job);
+	}
+
+// A partitioned table's partitions hash to any of the writers, so every
+// one of them is asked.
+void WriterPool::flush(const std::string &table)
+	{
+	WriterJob job;
+	job.kind = WriterJob::FLUSH;
+	job.batch = NULL;
+	job.table = table;
+	for(size_t i=0; i < writers.size(); i++)
+		writers[i]->enqueue(job);
+	}
+
+void WriterPool::retire(const Schema *schema)
+	{
+	WriterJob job;
+	job.kind = WriterJob::RETIRE;
+	job.batch = NULL;
+	job.schema = schema;
+	writer_for(schema->table)->enqueue(job);
+	}
+
+void WriterPool::reconfigure(int connections, const WriterSettings &settings)
+	{
+	int threads = writers.size();
+	if( connections < threads )
+		connections = threads;
+
+	for(int i=0; i < threads; i++)
+		{
+		WriterJob job;
+		job.kind = WriterJob::CONFIGURE;
+		job.batch = NULL;
+		job.connections = connections / threads + (i < connections % threads ? 1 : 0);
+		job.settings = settings;
+		writers[i]->enqueue(job);
+		}
+	}
+
+void WriterPool::flush_all()
+	{
+	WriterJob job;
+	job.kind = WriterJob::FLUSH_ALL;
+	job.batch = NULL;
+	for(size_t i=0; i < writers.size(); i++)
+		writers[i]->enqueue(job);
+	}
+
+void WriterPool::shutdown()
+	{
+	for(size_t i=0; i < writers.size(); i++)
+		writers[i]->stop();
+	}
@@ -0,0 +1,327 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "rows.h"
+#include "encode.h"
+#include "sink.h"
+#include "spool.h"
+#include "metrics.h"
+
+class PGConnection;
+
+// Everything a writer keeps for one COPY stream of a table: how its COPY
+// looks and the rows that are waiting for one.  Each column layout that a
+// table's records come in gets a stream of its own, and so does each
+// partition that rows are routed to.
+class TableState {
+	public:
+		// How rows are encoded for the COPY.  Until the column types are
+		// known it isn't decided yet and batches wait in unencoded.
+		enum Format { UNDECIDED, TEXT, BINARY };
+
+		std::string name;
+		const Schema *schema;
+
+		// The "Copy" query for this table.
+		std::string query;
+
+		Format format;
+		// Column types in record field order, for binary COPY.
+		std::vector<Oid> columns;
+		// The writer's escaped string cache for the table.
+		EscapeCache *strings;
+		std::vector<RowBatch*> unencoded;
+		// Whether a connection is looking up the column types.
+		bool describing;
+
+		// For a partition: whether it was created, or a connection is
+		// creating it.
+		bool partition_ready;
+		bool preparing;
+
+		// Encoded COPY data that no connection has taken yet, the number
+		// of rows in it and when the oldest of them arrived.
+		Buffer pending;
+		int pending_records;
+		time_t pending_since;
+
+		// What is in pending as last counted in the metrics, which the
+		// table's other streams count into as well.
+		int reported_records;
+		size_t reported_bytes;
+
+		// How many bytes may be pending before the table is flushed.
+		// With a target commit latency this is tuned after every commit.
+		size_t byte_limit;
+
+		// Connections working for this table, and how many of those
+		// haven't taken the pending data yet.
+		int connections;
+		int waiting_connections;
+
+		// A connection whose COPY was started ahead of the next flush.
+		// Encoded rows are put into it as they come, so that the flush
+		// only has to end it while the next one is started elsewhere.
+		// A table gets one again as long as it keeps sending rows.
+		PGConnection *open_copy;
+		bool keep_open;
+
+		// This is if the COPY query should be attempted again.
+		bool try_it;
+
+		// Flush as soon as possible, regardless of the limits.
+		bool flush_requested;
+
+		// Spooled rows waiting to be replayed, oldest first, and the
+		// segment that rows are being spooled to.
+		std::deque<SpoolSegment*> spooled;
+		SpoolSegment *spooling;
+		// Whether a connection is replaying one of the segments.
+		bool replaying;
+
+		// After a COPY into the table failed, its rows go to the spool
+		// until this time.
+		time_t retry_at;
+
+		// COPYs into the table whose connection was lost since the last
+		// one that was committed.
+		int lost_copies;
+
+		TableMetrics *metrics;
+};
+
+// A connection in a writer's pool.  Connections aren't tied to a table:
+// when a table is due to be flushed a free connection is assigned to it,
+// takes everything the table has pending, runs one COPY with it and goes
+// back to the pool once the server acknowledges it.  Connections nobody
+// needs start the next COPY of a busy table ahead of time instead, and
+// take its rows as they are encoded until it is due.
+class PGConnection {
+	public:
+		// Where the connection is in its life.  Everything is driven by
+		// Writer::progress() as the socket becomes readable or writable,
+		// so no state ever waits on the server.
+		enum State {
+			CONNECTING,	// PQconnectPoll is still running
+			PREPARING,	// creating the table's partition
+			DESCRIBING,	// looking up column types for binary COPY
+			IDLE,		// connected, no COPY in progress
+			STARTING_COPY,	// COPY sent, waiting for PGRES_COPY_IN
+			COPYING,	// rows can be put
+			ENDING_COPY,	// PQputCopyEnd sent, waiting for the result
+			BROKEN		// the connection was lost
+		};
+
+		PGconn *conn;
+		State state;
+
+		// The table this connection is assigned to, or NULL when free.
+		TableState *table;
+		// Assigned, but the table's pending data isn't taken yet.
+		bool waiting;
+
+		// The data of the current COPY, and the count of records and
+		// bytes in it.  The data is kept until the COPY is acknowledged
+		// so that it can be spooled if the COPY fails.  sent is how much
+		// of it has been put.
+		Buffer copy_data;
+		int records;
+		size_t bytes;
+		size_t sent;
+
+		// Whether this is its table's open_copy, and since when.
+		bool open;
+		time_t opened;
+
+		// When it started connecting.
+		time_t connect_started;
+
+		// The spool segment this connection is replaying instead of
+		// live rows, and the offset of the next chunk to put.
+		SpoolSegment *replay;
+		uint64_t replay_offset;
+
+		// Whether the server rejected the COPY.
+		bool copy_error;
+
+		// Whether the binary header and trailer of the current COPY have
+		// been put.
+		bool header_sent, trailer_sent;
+
+		// When PQputCopyEnd was called, for measuring commit latency.
+		struct timeval copy_end_time;
+
+		// Last PQconnectPoll result while connecting, otherwise whether
+		// libpq has output it couldn't send yet.
+		PostgresPollingStatusType connect_poll;
+		bool want_write;
+};
+
+// When a table's COPYs are ended and how many connections it may have.
+// Each writer keeps its own copy, which only changes between jobs, so a
+// reload never changes them under a writer.
+class WriterSettings {
+	public:
+		// A COPY is ended once it is seconds_between_copyend old or
+		// holds max_copy_bytes or max_copy_records (0 for no limit).
+		// With a target commit latency (in milliseconds) the byte limit
+		// of each table is tuned between min_copy_bytes and
+		// max_copy_bytes.
+		int seconds_between_copyend;
+		size_t max_copy_bytes, min_copy_bytes;
+		int max_copy_records;
+		long target_commit_latency;
+
+		// No table uses more connections than this at once (0 for no
+		// limit).
+		int max_table_connections;
+};
+
+class WriterJob {
+	public:
+		enum Kind { ROWS, FLUSH, FLUSH_ALL, CONFIGURE, RETIRE };
+
+		Kind kind;
+		RowBatch *batch;
+		std::string table;
+		// For RETIRE, the layout of a partition's stream.  The writer
+		// frees it, and the Partition, once the stream is done.
+		const Schema *schema;
+		// For CONFIGURE, the writer's share of the pool's connections
+		// and its new settings.
+		int connections;
+		WriterSettings settings;
+};
+
+class WriterPool;
+
+// A writer thread does all of the COPY work for the tables that hash to
+// it, so that a slow commit never holds up the Broccoli thread.  Those
+// tables share the writer's pool of non-blocking connections, which is
+// polled together with the job queue: a busy table can have COPYs running
+// on several connections at once, quiet tables take turns on one, and one
+// slow table doesn't hold up the others.
+class Writer {
+	public:
+		Writer(WriterPool *pool, int id, int max_connections, const WriterSettings &settings);
+
+		void start();
+		void enqueue(const WriterJob &job);
+		void stop();
+		void run();
+
+		// Take over a segment left in the spool by an earlier run.  Only
+		// called before the writer is started.
+		void adopt_segment(SpoolSegment *segment);
+
+	private:
+		TableState& table_state(const std::string &stream, const std::string &name,
+		                        TableMetrics *metrics);
+		EscapeCache* string_cache(const Schema *schema);
+		PGConnection* connect_to_postgres();
+		PGConnection* free_connection(size_t &next_free, time_t now_time);
+		void assign(PGConnection *pg, TableState &table, SpoolSegment *replay);
+		void release(PGConnection *pg);
+		void close_connection(PGConnection *pg);
+		void progress(PGConnection *pg, bool readable=false);
+		void put_copy_data(PGConnection *pg);
+		bool flush_due(const TableState &table, time_t now_time);
+		void start_open_copy(PGConnection *pg, TableState &table, time_t now_time);
+		void end_open_copy(TableState &table);
+		void feed_open_copies(time_t now_time);
+		bool reclaim_open_copy();
+		void commit_done(PGConnection *pg);
+		void copy_failed(PGConnection *pg, bool table_error);
+		void database_failed(PGConnection *pg, const char *error);
+		void connection_lost(PGConnection *pg);
+		void spool(TableState &table, const Buffer &data, int records);
+		void spool_pending(TableState &table);
+		int schedule(bool running);
+		void flush_table(const std::string &table);
+		void flush_tables();
+		bool all_idle();
+		bool stream_done(const TableState &table);
+		void drop_retired();
+		void run_job(const WriterJob &job);
+		void configure(int connections, const WriterSettings &new_settings);
+		void describe_table(PGConnection *pg);
+		void prepare_partition(PGConnection *pg);
+		void set_format(TableState &table, PGconn *conn, PGresult *columns);
+		void encode_batch(TableState &table, RowBatch *batch);
+		void write_batch(RowBatch *batch);
+
+		WriterPool *pool;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		std::deque<WriterJob> jobs;
+		bool stopping;
+
+		// Written to by enqueue() to wake the writer out of poll().
+		int wakeup_pipe[2];
+		bool wakeup_pending;
+
+		// Only ever touched from the writer's own thread.  Tables are
+		// looked up by their Schema's stream.
+		std::map<std::string, TableState> tables;
+		// Layouts of partitions the Broccoli thread is done with, whose
+		// streams are dropped once they have nothing left to do.
+		std::vector<const Schema*> retiring;
+		// Escaped string caches by table, with the partitions of a table
+		// sharing the table's.
+		std::map<std::string, EscapeCache> string_caches;
+		std::vector<PGConnection*> connections;
+		int max_connections;
+		WriterSettings settings;
+		std::vector<TableState*> ready_tables;
+
+		// No connections are opened until this time after one failed,
+		// and the wait after the next one that fails.
+		time_t database_down_until;
+		int database_retry_delay;
+
+		WriterMetrics *metrics;
+		Buffer binary_marker;
+};
+
+// The libpq sink: writer threads that COPY the rows into PostgreSQL.
+class WriterPool : public Sink {
+	public:
+		// The connections are split as evenly as possible between the
+		// writer threads.  A writer only polls its own, so no table gets
+		// more than its writer's share.
+		WriterPool(int threads, int connections, const WriterSettings &settings);
+		~WriterPool();
+
+		void start();
+		void submit(RowBatch *batch);
+		void flush(const std::string &table);
+		void flush_all();
+
+		// The partition with this layout gets no more rows.  Its stream
+		// is dropped and schema is freed once its rows are committed.
+		void retire(const Schema *schema);
+
+		// Take up the settings after a reload: the pool's new number of
+		// connections, which is never less than one per writer, and the
+		// COPY limits, which every table starts over from.
+		void reconfigure(int connections, const WriterSettings &settings);
+
+		// Flush everything that is queued, close all of the PostgreSQL
+		// connections and wait for the writer threads to exit.
+		void shutdown();
+
+	private:
+		Writer* writer_for(const std::string &table);
+
+		std::vector<Writer*> writers;
+};
+
+#endif